@@ -4,18 +4,200 @@
 #include <linux/if_ether.h>
 #include <linux/ip.h>
 #include <linux/in.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
 #include <bpf/bpf_endian.h>
 #include <bpf/bpf_helpers.h>
 
+#include "common.h"
+
+/* Keyed by XSKS_MAP_KEY(queue, slot) */
 struct bpf_map_def SEC("maps") xsks_map = {
         .type = BPF_MAP_TYPE_XSKMAP,
         .key_size = sizeof(int),
         .value_size = sizeof(int),
-        .max_entries = 64,  /* Assume netdev has no more than 64 queues */
+        .max_entries = STEER_MAX_QUEUES * STEER_MAX_SOCKETS,
 };
 
-SEC("xdp")
-int xdp_sock_prog(struct xdp_md *ctx)
+/* --steer, see common.h */
+struct bpf_map_def SEC("maps") steer_cfg_map = {
+        .type = BPF_MAP_TYPE_ARRAY,
+        .key_size = sizeof(__u32),
+        .value_size = sizeof(struct steer_cfg),
+        .max_entries = 1,
+};
+
+struct bpf_map_def SEC("maps") steer_map = {
+        .type = BPF_MAP_TYPE_ARRAY,
+        .key_size = sizeof(__u32),
+        .value_size = sizeof(__u32), /* slot */
+        .max_entries = STEER_MAX_QUEUES * STEER_TABLE_SIZE,
+};
+
+/* Non-zero while the socket of the slot is falling behind. Workers set
+ * and clear it through a mmap of the map, without a syscall. */
+struct bpf_map_def SEC("maps") xsk_busy_map = {
+        .type = BPF_MAP_TYPE_ARRAY,
+        .key_size = sizeof(__u32),
+        .value_size = sizeof(__u32),
+        .max_entries = STEER_MAX_QUEUES * STEER_MAX_SOCKETS,
+        .map_flags = BPF_F_MMAPABLE,
+};
+
+/* Where flows of a busy socket go instead, the kernel stack of another
+ * CPU */
+struct bpf_map_def SEC("maps") cpu_map = {
+        .type = BPF_MAP_TYPE_CPUMAP,
+        .key_size = sizeof(__u32),
+        .value_size = sizeof(__u32), /* queue size */
+        .max_entries = STEER_MAX_CPUS,
+};
+
+/* af_xdp_user --handover: pid of the process owning the sockets in
+ * xsks_map, 0 once it has handed them over. Only userspace uses it, it
+ * is kept here to be pinned along with the other maps. */
+struct bpf_map_def SEC("maps") handover_map = {
+        .type = BPF_MAP_TYPE_ARRAY,
+        .key_size = sizeof(__u32),
+        .value_size = sizeof(__u32),
+        .max_entries = 1,
+};
+
+/* Which traffic goes to AF_XDP, filled in by af_xdp_user from the
+ * selected packet handler */
+struct bpf_map_def SEC("maps") classifier_map = {
+        .type = BPF_MAP_TYPE_HASH,
+        .key_size = sizeof(struct classifier_key),
+        .value_size = sizeof(__u32),
+        .max_entries = CLASSIFIER_MAX_ENTRIES,
+};
+
+static __always_inline __u32 classify(__u8 proto, __be16 port)
+{
+    struct classifier_key key = {.proto = proto, .port = port};
+    __u32 *action;
+
+    action = bpf_map_lookup_elem(&classifier_map, &key);
+    if (action)
+        return *action;
+
+    if (port) {
+        key.port = 0;
+        action = bpf_map_lookup_elem(&classifier_map, &key);
+        if (action)
+            return *action;
+    }
+
+    key.proto = 0;
+    action = bpf_map_lookup_elem(&classifier_map, &key);
+    if (action)
+        return *action;
+
+    return CLASSIFIER_PASS;
+}
+
+/* Timestamp the packet for the latency histograms of af_xdp_user. This
+ * invalidates every packet pointer, so it's done right before redirect. */
+static __always_inline void stamp_rx_meta(struct xdp_md *ctx)
+{
+    struct xdp_rx_meta *meta;
+    void *data;
+
+    if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+        return; /* No metadata support in this driver */
+
+    meta = (void *)(long)ctx->data_meta;
+    data = (void *)(long)ctx->data;
+    if ((void *)(meta + 1) > data)
+        return;
+
+    meta->rx_ts = bpf_ktime_get_ns();
+    meta->pad = 0;
+    meta->magic = XDP_RX_META_MAGIC;
+}
+
+/* murmur3 finalizer, spreads the bits of a weak hash over the word */
+static __always_inline __u32 hash_mix(__u32 h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static __always_inline __u32 flow_hash(struct iphdr *ip, void *l4, void *data_end)
+{
+    __u32 h = ip->saddr * 0x9e3779b1 ^ ip->daddr ^ ip->protocol;
+
+    /* Ports sit at the same offset in the UDP and TCP headers */
+    if ((ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_TCP) &&
+        l4 + sizeof(struct udphdr) <= data_end) {
+        struct udphdr *udp = l4;
+
+        h = h * 0x9e3779b1 ^ ((__u32)udp->source << 16 | udp->dest);
+    }
+    return hash_mix(h);
+}
+
+#define STEER_KEY_MAX 250 /* memcached's key length limit */
+
+/* FNV-1a of the first key of a memcached UDP "get"/"set" request, the
+ * hash mc_table.c uses, falls back to the flow hash for anything else */
+static __always_inline __u32 mckey_hash(struct iphdr *ip, void *l4, void *data_end)
+{
+    char *p = l4 + sizeof(struct udphdr) + 8; /* memcached UDP frame header */
+    __u64 h = 0xcbf29ce484222325ULL;
+    int i;
+
+    if (ip->protocol != IPPROTO_UDP || (void *)(p + 4) > data_end ||
+        (p[0] != 'g' && p[0] != 's') || p[1] != 'e' || p[2] != 't' || p[3] != ' ')
+        return flow_hash(ip, l4, data_end);
+    p += 4;
+
+    for (i = 0; i < STEER_KEY_MAX; i++) {
+        if ((void *)(p + i + 1) > data_end || p[i] == ' ' || p[i] == '\r')
+            break;
+        h ^= (__u8)p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return hash_mix(h ^ h >> 32);
+}
+
+/* Socket slot of the queue for the packet, or -1 with cpu set to the
+ * CPU to hand it to when that socket is busy */
+static __always_inline int steer(struct xdp_md *ctx, struct iphdr *ip,
+                                 void *l4, void *data_end, __u32 *cpu)
+{
+    __u32 zero = 0, hash, key, *slot, *busy;
+    struct steer_cfg *cfg;
+
+    cfg = bpf_map_lookup_elem(&steer_cfg_map, &zero);
+    if (!cfg || cfg->mode == STEER_OFF)
+        return 0;
+
+    hash = cfg->mode == STEER_MCKEY ? mckey_hash(ip, l4, data_end) :
+                                      flow_hash(ip, l4, data_end);
+    key = STEER_TABLE_KEY(ctx->rx_queue_index, hash);
+    slot = bpf_map_lookup_elem(&steer_map, &key);
+    if (!slot)
+        return 0;
+
+    key = XSKS_MAP_KEY(ctx->rx_queue_index, *slot);
+    busy = bpf_map_lookup_elem(&xsk_busy_map, &key);
+    if (busy && *busy && cfg->nr_cpus) {
+        /* Other bits than the table index, so one CPU doesn't get all
+         * flows of the busy socket */
+        *cpu = (hash >> 16) % cfg->nr_cpus;
+        return -1;
+    }
+    return *slot;
+}
+
+/* Only the first buffer of a multi-buffer packet is directly accessible,
+ * which is fine, the headers we look at are always in it */
+static __always_inline int xdp_sock_redirect(struct xdp_md *ctx)
 {
     __u32 off;
     void *data_end = (void *)(long)ctx->data_end;
@@ -23,24 +205,64 @@ int xdp_sock_prog(struct xdp_md *ctx)
 
     struct ethhdr *eth = data;
     struct iphdr *ip = data + sizeof(*eth);
+    __be16 port = 0;
+    void *l4;
+    __u32 cpu;
+    int slot;
 
     off = sizeof(struct ethhdr);
     if (data + off > data_end)
         return XDP_PASS;
 
-    if (bpf_htons(eth->h_proto) == ETH_P_IP) {
-        off += sizeof(struct iphdr);
-        if (data + off > data_end)
+    if (bpf_htons(eth->h_proto) != ETH_P_IP)
+        return XDP_PASS;
+
+    off += sizeof(struct iphdr);
+    if (data + off > data_end)
+        return XDP_PASS;
+    if (ip->ihl < 5)
+        return XDP_PASS;
+
+    /* Only the destination port is needed, which sits at the same offset
+     * in the UDP and TCP headers */
+    l4 = (void *)ip + ip->ihl * 4;
+    if (ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_TCP) {
+        struct udphdr *udp = l4;
+
+        if ((void *)(udp + 1) > data_end)
             return XDP_PASS;
-        /* We process IPv4 ICMP ping pkts only. */
-        if (ip->protocol == IPPROTO_ICMP) {
-            int idx = ctx->rx_queue_index;
-            if (bpf_map_lookup_elem(&xsks_map, &idx)) {
-                return bpf_redirect_map(&xsks_map, idx, 0);
-            }
+        port = udp->dest;
+    }
+
+    if (classify(ip->protocol, port) == CLASSIFIER_REDIRECT) {
+        int idx;
+
+        slot = steer(ctx, ip, l4, data_end, &cpu);
+        if (slot < 0)
+            return bpf_redirect_map(&cpu_map, cpu, XDP_PASS);
+
+        idx = XSKS_MAP_KEY(ctx->rx_queue_index, slot);
+        if (bpf_map_lookup_elem(&xsks_map, &idx)) {
+            stamp_rx_meta(ctx);
+            return bpf_redirect_map(&xsks_map, idx, 0);
         }
     }
     return XDP_PASS;
 }
 
+SEC("xdp")
+int xdp_sock_prog(struct xdp_md *ctx)
+{
+    return xdp_sock_redirect(ctx);
+}
+
+/* Same for af_xdp_user --multi-buffer. Loading it with BPF_F_XDP_HAS_FRAGS
+ * (libbpf does that for this section name) lets the driver hand over
+ * packets larger than a page, e.g. with a 9000 byte MTU. */
+SEC("xdp.frags")
+int xdp_sock_prog_frags(struct xdp_md *ctx)
+{
+    return xdp_sock_redirect(ctx);
+}
+
 char _license[] SEC("license") = "GPL";
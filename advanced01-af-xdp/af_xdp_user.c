@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <locale.h>
 #include <poll.h>
 #include <pthread.h>
@@ -14,7 +15,19 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+/* Multi-buffer AF_XDP, linux 6.6 */
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -27,25 +40,62 @@
 #include <linux/ip.h>
 #include <linux/icmp.h>
 
+#include "autotune.h"
+#include "capture.h"
+#include "common.h"
+#include "hist.h"
+#include "pkt_handler.h"
+#include "txgen.h"
+#include "xsk_frame_pool.h"
+#include "xsk_loop.h"
+#include "xsk_stats.h"
+
 /* Global macros */
 
+/* Defaults of --frames (for 4K frames) and of the ring sizes */
 #define NUM_FRAMES         4096
-/* 为便于理解，我们可以先把UMEM中帧数量设置小一点 */
+/* 为便于理解，我们可以先把UMEM中帧数量设置小一点，或者直接用--frames 64 */
 //#define NUM_FRAMES         64
-#define XSK_RING_PROD_NUM_DESCS NUM_FRAMES >> 1
-#define XSK_RING_CONS_NUM_DESCS NUM_FRAMES >> 1
-/* 默认帧大小为4096 */
+#define XSK_RING_PROD_NUM_DESCS (NUM_FRAMES >> 1)
+#define XSK_RING_CONS_NUM_DESCS (NUM_FRAMES >> 1)
+/* 默认帧大小为4096，可用-f/--frame-size改为2048，UMEM总大小不变，帧数量翻倍 */
 #define FRAME_SIZE         XSK_UMEM__DEFAULT_FRAME_SIZE
+#define MIN_FRAME_SIZE     2048
+#define UMEM_SIZE          ((uint64_t) NUM_FRAMES * FRAME_SIZE)
+
+/* Threads (one frame cache each) allowed to share the UMEM */
+#define MAX_FRAME_CACHES   64
+
+/* One AF_XDP socket and one worker thread per queue, --workers of them
+ * with --steer */
+#define MAX_QUEUES         16
+#define MAX_WORKERS        32 /* MAX_FRAME_CACHES / MAX_PORTS */
 
-#define RX_BATCH_SIZE      64
-/* 为便于理解，我们可以先把RX_BATCH_SIZE设置小一点 */
-//#define RX_BATCH_SIZE      4
+/* --steer: packets the CPUMAP fallback queues per CPU */
+#define STEER_CPUMAP_QSIZE 2048
 
-#define INVALID_UMEM_FRAME UINT64_MAX
+/* --dev and --fwd */
+#define MAX_PORTS          2
+
+/* --capture gives every socket a ring of its own */
+#if MAX_WORKERS * MAX_PORTS > CAPTURE_MAX_RINGS
+#error "CAPTURE_MAX_RINGS is below the number of sockets"
+#endif
+
+/* --autotune: time a new batch size gets before, and for, its measurement */
+#define AUTOTUNE_SETTLE_US 250000
+#define AUTOTUNE_WINDOW_US 1000000
+
+/* --handover: where the maps of each port get pinned, how long to wait for
+ * the predecessor and how long to drain our rings after the last packet */
+#define HANDOVER_PIN_ROOT   "/sys/fs/bpf/af_xdp"
+#define HANDOVER_TIMEOUT_MS 5000
+#define DRAIN_TIMEOUT_MS    100
 
 /* Global variables */
 static bool verbose = true;
 static bool global_exit = false;
+static volatile sig_atomic_t handover_exit; /* SIGUSR1 from a successor */
 
 struct config {
     uint32_t xdp_flags;
@@ -54,41 +104,79 @@ struct config {
     char filename[512];
     char progsec[32];
     bool do_unload;
-    __u16 xsk_bind_flags;
+    __u16 xsk_bind_flags; /* XDP_COPY, XDP_ZEROCOPY, XDP_USE_SG */
     int xsk_if_queue;
     bool xsk_poll_mode;
-};
-
-struct xsk_umem_info { // 该结构体是linux源码samples示例中用的
-    struct xsk_ring_prod fq;
-    struct xsk_ring_cons cq;
-    struct xsk_umem *umem;
-    void *buffer;
+    uint32_t frame_size;
+    uint32_t nr_frames; /* 0 for UMEM_SIZE worth of frames */
+    uint32_t fill_size, comp_size, rx_size, tx_size; /* ring sizes, powers of two */
+    /* RX descriptors per round, and with --txonly descriptors per TX ring
+     * reservation and token bucket depth of the rate limiter */
+    uint32_t batch;
+    bool autotune; /* sweep the RX batch size at runtime */
+    bool unaligned; /* XDP_UMEM_UNALIGNED_CHUNK_FLAG */
+    char *handler_name;
+    struct pkt_handler_opts handler_opts;
+    int nr_queues; /* queues xsk_if_queue .. xsk_if_queue + nr_queues - 1 */
+    int nr_slots;  /* sockets and workers per queue, see common.h */
+    enum steer_mode steer;
+    bool txonly;
+    struct txgen_cfg txgen;
+    /* ports[0] is --dev, ports[1] --fwd if given, indexed by egress port
+     * for the MAC rewrite */
+    struct fwd_port ports[MAX_PORTS];
+    int nr_ports;
+    struct capture_cfg capture; /* --capture, path NULL if off */
+    bool handover; /* pin the maps, hand the queues over on SIGUSR1 */
+    bool adopted;  /* took over a predecessor's program and maps */
 };
 
 struct stats_record { // 报文统计信息记录
     uint64_t timestamp;
-    uint64_t rx_packets;
-    uint64_t rx_bytes;
-    uint64_t tx_packets;
-    uint64_t tx_bytes;
+    struct xsk_counters c;
+    struct xdp_statistics xdp; /* kernel side, getsockopt(XDP_STATISTICS) */
 };
 
-struct xsk_socket_info { // 该结构体是linux源码samples示例中用的，有过修改
-    struct xsk_ring_cons rx;
-    struct xsk_ring_prod tx;
-    struct xsk_umem_info *umem;
-    struct xsk_socket *xsk;
-
-    uint64_t umem_frame_addr[NUM_FRAMES];
-    uint32_t umem_frame_free;
+struct worker {
+    pthread_t thread;
+    struct xsk_socket_info *xsk;
+    struct xsk_socket_info *peer; /* --fwd: same queue on the other port */
+    const struct config *cfg;
+    const struct pkt_handler *handler;
+    const struct txgen *gen; /* --txonly */
+};
 
-    uint32_t outstanding_tx;
+static struct worker workers[MAX_WORKERS];
+static int nr_workers;
+
+/* Every socket of every worker, for the stats thread and the xsks_maps */
+static struct xsk_socket_info *sockets[MAX_WORKERS * MAX_PORTS];
+static int nr_sockets;
+
+/* Maps of af_xdp_kern.o we set up, per port */
+enum xdp_map_id {
+    MAP_XSKS,
+    MAP_CLASSIFIER,
+    MAP_STEER_CFG,
+    MAP_STEER,
+    MAP_BUSY,
+    MAP_CPU,
+    MAP_HANDOVER,
+    NR_XDP_MAPS
+};
 
-    struct stats_record stats;
-    struct stats_record prev_stats;
+static const char *const xdp_map_names[NR_XDP_MAPS] = {
+        [MAP_XSKS] = "xsks_map",
+        [MAP_CLASSIFIER] = "classifier_map",
+        [MAP_STEER_CFG] = "steer_cfg_map",
+        [MAP_STEER] = "steer_map",
+        [MAP_BUSY] = "xsk_busy_map",
+        [MAP_CPU] = "cpu_map",
+        [MAP_HANDOVER] = "handover_map",
 };
 
+static int port_maps[MAX_PORTS][NR_XDP_MAPS];
+
 /*************************************************************************
  * Functions
  */
@@ -98,30 +186,131 @@ static int create_xsk_umem(struct xsk_umem **umem,
                            void *umem_area,
                            __u64 size,
                            struct xsk_ring_prod *fill,
-                           struct xsk_ring_cons *comp) {
+                           struct xsk_ring_cons *comp,
+                           struct config *cfg) {
     struct xsk_umem_config umem_config = {0};
 
-    umem_config.fill_size = XSK_RING_PROD_NUM_DESCS;
-    umem_config.comp_size = XSK_RING_CONS_NUM_DESCS;
-    umem_config.frame_size = FRAME_SIZE;
+    umem_config.fill_size = cfg->fill_size;
+    umem_config.comp_size = cfg->comp_size;
+    umem_config.frame_size = cfg->frame_size;
+    if (cfg->unaligned)
+        umem_config.flags |= XDP_UMEM_UNALIGNED_CHUNK_FLAG;
 
     return xsk_umem__create(umem, umem_area, size,
                             fill, comp, &umem_config);
 }
 
-static int create_xsk_socket(struct xsk_socket **xsk_ptr, struct xsk_umem *umem,
-                             struct xsk_ring_cons *rx, struct xsk_ring_prod *tx,
-                             struct config *cfg) {
+/* Unaligned chunks may straddle a page boundary, which zero-copy drivers
+ * only accept if the pages are physically contiguous, so back the UMEM
+ * with hugepages in that mode when we can.
+ */
+static void *alloc_umem_area(uint64_t size, bool hugepages) {
+    void *buf;
+
+    if (hugepages) {
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED)
+            return buf;
+        fprintf(stderr, "Warning: no hugepages for unaligned umem (%s), "
+                        "using normal pages\n", strerror(errno));
+    }
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return buf == MAP_FAILED ? NULL : buf;
+}
+
+static int create_xsk_socket(struct xsk_socket_info *xsk, struct config *cfg) {
     struct xsk_socket_config xsk_cfg = {0};
 
-    xsk_cfg.rx_size = XSK_RING_PROD_NUM_DESCS;
-    xsk_cfg.tx_size = XSK_RING_CONS_NUM_DESCS;
+    xsk_cfg.rx_size = cfg->rx_size;
+    xsk_cfg.tx_size = cfg->tx_size;
+    /* We load and attach af_xdp_kern.o ourselves, don't let libbpf
+     * install its default redirect-everything program */
+    xsk_cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
     xsk_cfg.xdp_flags = 0;
-    xsk_cfg.bind_flags = 0;
+    xsk_cfg.bind_flags = cfg->xsk_bind_flags;
+
+    /* A txonly socket has no RX ring, nothing gets redirected to it */
+    return xsk_socket__create_shared(&xsk->xsk, xsk->port->ifname, xsk->queue,
+                                     xsk->umem->umem,
+                                     cfg->txonly ? NULL : &xsk->rx, &xsk->tx,
+                                     xsk->fq, xsk->cq, &xsk_cfg);
+}
+
+/* Create the socket of one queue of port. Every socket shares umem, also
+ * across ports, the first one uses the fill/completion rings created along
+ * with it. With --steer the sockets after the first one of a queue (the
+ * leader) share its fill/completion rings. */
+static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
+                                                    struct xsk_umem_info *umem,
+                                                    const struct fwd_port *port,
+                                                    int queue, bool first,
+                                                    struct xsk_socket_info *leader,
+                                                    int slot) {
+    struct xsk_socket_info *xsk;
+    int err;
+
+    /* Cache line aligned for stats_pub */
+    xsk = aligned_alloc(CACHE_LINE_SIZE, sizeof(*xsk));
+    if (!xsk) {
+        fprintf(stderr, "Error: Cannot alloc memory for xsk_info: \"%s\"\n", strerror(errno));
+        return NULL;
+    }
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->umem = umem;
+    xsk->port = port;
+    xsk->queue = queue;
+    xsk->slot = slot;
+    xsk->rx_batch = cfg->batch;
+    xsk->fwd = xsk;
+    xsk->fq = first ? &umem->fq : &xsk->fq_ring;
+    xsk->cq = first ? &umem->cq : &xsk->cq_ring;
+    if (leader) {
+        xsk->fq = leader->fq;
+        xsk->cq = leader->cq;
+        xsk->share = leader->share;
+    } else if (cfg->nr_slots > 1) {
+        xsk->share = calloc(1, sizeof(*xsk->share));
+        if (!xsk->share) {
+            fprintf(stderr, "Error: Cannot alloc memory for ring share\n");
+            free(xsk);
+            return NULL;
+        }
+        pthread_spin_init(&xsk->share->lock, PTHREAD_PROCESS_PRIVATE);
+    }
+    xsk->frames = xsk_frame_cache__create(umem->pool);
+    if (!xsk->frames) {
+        fprintf(stderr, "Error: Can't create umem frame cache\n");
+        if (!leader)
+            free(xsk->share);
+        free(xsk);
+        return NULL;
+    }
 
-    return xsk_socket__create(xsk_ptr, cfg->ifname,
-                              cfg->xsk_if_queue, umem, rx,
-                              tx, &xsk_cfg);
+    err = create_xsk_socket(xsk, cfg);
+    /* --handover: the predecessor's pool may still be bound to the queue
+     * for a moment after its sockets are gone */
+    for (uint64_t deadline = gettime() + (uint64_t) HANDOVER_TIMEOUT_MS * 1000000;
+         err == -EBUSY && cfg->adopted && gettime() < deadline;) {
+        usleep(1000);
+        err = create_xsk_socket(xsk, cfg);
+    }
+    if (err) {
+        fprintf(stderr, "Error: Can't create xsk socket on %s queue %d: \"%s\"\n",
+                port->ifname, queue, strerror(-err));
+        if (err == -EINVAL && (cfg->xsk_bind_flags & XDP_USE_SG))
+            fprintf(stderr, "Hint: --multi-buffer needs linux 6.6 and, for"
+                            " zero-copy, driver support\n");
+        xsk_frame_cache__destroy(xsk->frames);
+        if (!leader)
+            free(xsk->share);
+        free(xsk);
+        return NULL;
+    }
+    xsk->fd = xsk_socket__fd(xsk->xsk);
+    return xsk;
 }
 
 
@@ -129,6 +318,12 @@ static void IntHandler(int signal) {
     global_exit = true;
 } /* End of IntHandler */
 
+/* --handover: a successor is ready to take our queues */
+static void HandoverHandler(int signal) {
+    handover_exit = true;
+    global_exit = true;
+}
+
 /*
 static inline __u16 compute_ip_checksum(struct iphdr *ip) {
     __u32 csum = 0;
@@ -144,45 +339,6 @@ static inline __u16 compute_ip_checksum(struct iphdr *ip) {
 }
 */
 
-static inline __u16 compute_icmp_checksum(struct iphdr *ip, struct icmphdr *icmp) {
-    __u32 csum = 0;
-    __u16 *next_icmp_u16 = (__u16 *) icmp;
-    icmp->checksum = 0;
-    int tmp = ((ntohs(ip->tot_len) - (ip->ihl << 2)) >> 1);
-    for (int i = 0; i < tmp; i++) {
-        csum += *next_icmp_u16++;
-    }
-    return ~((csum & 0xffff) + (csum >> 16));
-}
-
-static uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk) {
-    uint64_t frame;
-    if (xsk->umem_frame_free == 0)
-        return INVALID_UMEM_FRAME;
-
-    frame = xsk->umem_frame_addr[--xsk->umem_frame_free];
-    // --xsk->umem_frame_free就是从后往前分配，
-    // frame就是某个帧chunk的字节偏移量，每分配一个就将umem_frame_free
-    // 即空闲的umem_frame数量减一，（问题：用完了就没了？-不，后面会释放的）
-    xsk->umem_frame_addr[xsk->umem_frame_free] = INVALID_UMEM_FRAME;
-    // 用了以后再把下一个帧chunk置为INVALID_UMEM_FRAME（why?）
-    return frame;
-}
-
-#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
-
-static uint64_t gettime(void) {
-    struct timespec t;
-    int res;
-
-    res = clock_gettime(CLOCK_MONOTONIC, &t);
-    if (res < 0) {
-        fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
-        exit(1);
-    }
-    return (uint64_t) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
-}
-
 static double calc_period(struct stats_record *r, struct stats_record *p) {
     double period_ = 0;
     __u64 period = 0;
@@ -196,6 +352,7 @@ static double calc_period(struct stats_record *r, struct stats_record *p) {
 
 static void stats_print(struct stats_record *stats_rec,
                         struct stats_record *stats_prev) {
+    struct xsk_counters *cur = &stats_rec->c, *prev = &stats_prev->c;
     uint64_t packets, bytes;
     double period;
     double pps; /* packets per sec */
@@ -209,87 +366,689 @@ static void stats_print(struct stats_record *stats_rec,
     if (period == 0)
         period = 1;
 
-    packets = stats_rec->rx_packets - stats_prev->rx_packets;
+    packets = cur->rx_packets - prev->rx_packets;
     pps = packets / period;
 
-    bytes = stats_rec->rx_bytes - stats_prev->rx_bytes;
+    bytes = cur->rx_bytes - prev->rx_bytes;
     bps = (bytes * 8) / period / 1000000;
 
-    printf(fmt, "AF_XDP RX:", stats_rec->rx_packets, pps,
-           stats_rec->rx_bytes / 1000, bps,
+    printf(fmt, "AF_XDP RX:", cur->rx_packets, pps,
+           cur->rx_bytes / 1000, bps,
            period);
 
-    packets = stats_rec->tx_packets - stats_prev->tx_packets;
+    packets = cur->tx_packets - prev->tx_packets;
 
     pps = packets / period;
 
-    bytes = stats_rec->tx_bytes - stats_prev->tx_bytes;
+    bytes = cur->tx_bytes - prev->tx_bytes;
     bps = (bytes * 8) / period / 1000000;
 
-    printf(fmt, "       TX:", stats_rec->tx_packets, pps,
-           stats_rec->tx_bytes / 1000, bps,
+    printf(fmt, "       TX:", cur->tx_packets, pps,
+           cur->tx_bytes / 1000, bps,
            period);
 
+    printf("%-12s %'11lu drops (%'10.0f pps)  tx ring full %'lu"
+           "  fill starved %'lu  wakeups %'lu (%'.0f/s)\n", "",
+           cur->drops, (cur->drops - prev->drops) / period,
+           cur->tx_ring_full, cur->fill_starved,
+           cur->wakeups, (cur->wakeups - prev->wakeups) / period);
+    if (cur->capture_drops)
+        printf("%-12s %'11lu packets missing from the capture\n", "",
+               cur->capture_drops);
+
+    printf("%-12s rx dropped %'lu  rx ring full %'lu  fill ring empty %'lu"
+           "  rx/tx invalid %'lu/%'lu  tx ring empty %'lu\n", "Kernel:",
+           (unsigned long) stats_rec->xdp.rx_dropped,
+           (unsigned long) stats_rec->xdp.rx_ring_full,
+           (unsigned long) stats_rec->xdp.rx_fill_ring_empty_descs,
+           (unsigned long) stats_rec->xdp.rx_invalid_descs,
+           (unsigned long) stats_rec->xdp.tx_invalid_descs,
+           (unsigned long) stats_rec->xdp.tx_ring_empty_descs);
+
+    printf("\n");
+}
+
+/* Totals over every socket */
+static void stats_collect(struct stats_record *rec) {
+    memset(rec, 0, sizeof(*rec));
+    rec->timestamp = gettime();
+    for (int i = 0; i < nr_sockets; i++) {
+        struct xsk_socket_info *xsk = sockets[i];
+        struct xdp_statistics xdp = {0};
+        socklen_t optlen = sizeof(xdp);
+        struct xsk_counters c;
+        uint64_t *sum = (uint64_t *) &rec->c;
+
+        xsk_stats_read(&xsk->stats_pub, &c);
+        for (unsigned int j = 0; j < XSK_COUNTERS_NR; j++)
+            sum[j] += ((uint64_t *) &c)[j];
+
+        /* Older kernels only fill in the first three fields */
+        if (!getsockopt(xsk_socket__fd(xsk->xsk), SOL_XDP, XDP_STATISTICS,
+                        &xdp, &optlen)) {
+            rec->xdp.rx_dropped += xdp.rx_dropped;
+            rec->xdp.rx_invalid_descs += xdp.rx_invalid_descs;
+            rec->xdp.tx_invalid_descs += xdp.tx_invalid_descs;
+            rec->xdp.rx_ring_full += xdp.rx_ring_full;
+            rec->xdp.rx_fill_ring_empty_descs += xdp.rx_fill_ring_empty_descs;
+            rec->xdp.tx_ring_empty_descs += xdp.tx_ring_empty_descs;
+        }
+    }
+}
+
+static void stats_print_latency(const char *name, const struct hist_snapshot *s) {
+    if (!s->total) {
+        printf("%-12s no samples\n", name);
+        return;
+    }
+    printf("%-12s p50 %'9.1f us  p99 %'9.1f us  p99.9 %'9.1f us  (%'lu samples)\n",
+           name, hist_percentile(s, 50) / 1000.0, hist_percentile(s, 99) / 1000.0,
+           hist_percentile(s, 99.9) / 1000.0, (unsigned long) s->total);
+}
+
+/* Latency samples recorded since the previous call */
+static void latency_collect_print(void) {
+    static struct hist_snapshot prev_rx, prev_tx, cur, delta;
+
+    memset(&cur, 0, sizeof(cur));
+    for (int i = 0; i < nr_sockets; i++)
+        hist_snapshot_add(&cur, &sockets[i]->rx_lat);
+    hist_snapshot_sub(&delta, &cur, &prev_rx);
+    prev_rx = cur;
+    stats_print_latency("Latency RX:", &delta);
+
+    memset(&cur, 0, sizeof(cur));
+    for (int i = 0; i < nr_sockets; i++)
+        hist_snapshot_add(&cur, &sockets[i]->tx_lat);
+    hist_snapshot_sub(&delta, &cur, &prev_tx);
+    prev_tx = cur;
+    stats_print_latency("    RX->TX:", &delta);
+
     printf("\n");
 }
 
 static void *stats_poll(void *arg) {
     unsigned int interval = 2;
-    struct xsk_socket_info *xsk = arg;
+    struct stats_record stats;
     static struct stats_record previous_stats = {0};
+    const struct config *cfg = arg;
 
-    previous_stats.timestamp = gettime();
+    stats_collect(&previous_stats);
 
     /* Trick to pretty printf with thousands separators use %' */
     setlocale(LC_NUMERIC, "en_US");
 
     while (!global_exit) {
         sleep(interval);
-        xsk->stats.timestamp = gettime();
-        stats_print(&xsk->stats, &previous_stats);
-        previous_stats = xsk->stats;
+        stats_collect(&stats);
+        stats_print(&stats, &previous_stats);
+        previous_stats = stats;
+        /* Nothing is stamped in txonly mode */
+        if (!cfg->txonly)
+            latency_collect_print();
+    }
+    return NULL;
+}
+
+static uint64_t rx_packets_total(void) {
+    uint64_t sum = 0;
+
+    for (int i = 0; i < nr_sockets; i++) {
+        struct xsk_counters c;
+
+        xsk_stats_read(&sockets[i]->stats_pub, &c);
+        sum += c.rx_packets;
+    }
+    return sum;
+}
+
+static void rx_lat_snapshot(struct hist_snapshot *s) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < nr_sockets; i++)
+        hist_snapshot_add(s, &sockets[i]->rx_lat);
+}
+
+/* --autotune: run each RX batch size candidate on every socket for a
+ * window, then stay with the winner until the rate moves, see autotune.h */
+static void *autotune_poll(void *arg) {
+    static struct hist_snapshot before, after, delta;
+    const struct config *cfg = arg;
+    struct autotune at;
+    uint64_t rx, start;
+    uint32_t batch;
+    double pps;
+    bool settled;
+
+    /* A multi-buffer packet has to fit in one batch, see XSK_MAX_FRAGS */
+    autotune_init(&at, (cfg->xsk_bind_flags & XDP_USE_SG) ? XSK_MAX_FRAGS : 1,
+                  RX_BATCH_MAX, cfg->batch);
+    batch = autotune_start(&at);
+
+    while (!global_exit) {
+        for (int i = 0; i < nr_sockets; i++)
+            atomic_store_explicit(&sockets[i]->rx_batch, batch, memory_order_relaxed);
+        /* Let the rings adapt to the new batch size */
+        usleep(AUTOTUNE_SETTLE_US);
+
+        rx = rx_packets_total();
+        rx_lat_snapshot(&before);
+        start = gettime();
+        usleep(AUTOTUNE_WINDOW_US);
+        rx = rx_packets_total() - rx;
+        rx_lat_snapshot(&after);
+        pps = (double) rx * NANOSEC_PER_SEC / (gettime() - start);
+        hist_snapshot_sub(&delta, &after, &before);
+
+        settled = autotune_settled(&at);
+        batch = autotune_update(&at, pps, hist_percentile(&delta, 99));
+        if (verbose && !settled && autotune_settled(&at) && at.best.pps > 0)
+            printf("Autotune: RX batch %u, %'.0f pps, p99 %'.1f us\n\n",
+                   at.best.batch, at.best.pps, at.best.p99 / 1000.0);
     }
     return NULL;
 }
 
-static void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame) {
-    assert(xsk->umem_frame_free < NUM_FRAMES); // 所以assert是个啥：assert(expression):
-    // 如果expression为错误，则终止程序运行（是终止这个function吧），一般用于不会发生的非法情况
+/* Serves the queue's socket, and with --fwd the same queue on the other
+ * port too, so each TX ring still has a single producer */
+static void *rx_worker(void *arg) {
+    struct worker *w = arg;
+    struct xsk_socket_info *xsks[MAX_PORTS] = {w->xsk, w->peer};
+    int nr = w->peer ? 2 : 1;
+    struct pollfd fds[MAX_PORTS];
+    int err;
+
+    memset(fds, 0, sizeof(fds));
+    for (int i = 0; i < nr; i++) {
+        fds[i].fd = xsk_socket__fd(xsks[i]->xsk);
+        fds[i].events = POLLIN;
+    }
+
+    while (!global_exit) {
+        if (w->cfg->xsk_poll_mode) {
+            /* Time out now and then to notice global_exit */
+            err = poll(fds, nr, 1000);
+            w->xsk->stats.wakeups++;
+            if (err <= 0)
+                continue;
+        }
+        for (int i = 0; i < nr; i++)
+            handle_receive_packets(xsks[i], w->handler);
 
-    xsk->umem_frame_addr[xsk->umem_frame_free++] = frame;
+        /* Do we need to wake up the kernel for transmission */
+        for (int i = 0; i < nr; i++) {
+            complete_tx(xsks[i]);
+            xsk_stats_publish(&xsks[i]->stats_pub, &xsks[i]->stats);
+        }
+    }
+    return NULL;
 }
 
-/* Check if TX is done */
-static void complete_tx(struct xsk_socket_info *xsk) {
-    unsigned int completed;
-    uint32_t idx_cq;
+/* --txonly: send gen's templates as fast as the TX ring drains, or at
+ * rate / nr_workers packets per second through a token bucket holding at
+ * most --batch tokens */
+static void *tx_worker(void *arg) {
+    struct worker *w = arg;
+    struct xsk_socket_info *xsk = w->xsk;
+    double rate = (double) w->cfg->txgen.rate / nr_workers / NANOSEC_PER_SEC;
+    unsigned int max_batch = w->cfg->batch;
+    double tokens = max_batch;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (xsk->queue + 1);
+    uint64_t now, last = gettime();
+    unsigned int batch = max_batch;
+
+    while (!global_exit) {
+        if (rate > 0) {
+            now = gettime();
+            tokens += (now - last) * rate;
+            if (tokens > max_batch)
+                tokens = max_batch;
+            last = now;
+            batch = tokens;
+        }
+        if (batch)
+            tokens -= tx_only_batch(xsk, w->gen, &rng, batch);
+
+        /* Kicks the kernel and reaps completions, TX frames are static */
+        complete_tx(xsk);
+        xsk_stats_publish(&xsk->stats_pub, &xsk->stats);
+    }
+    return NULL;
+}
+
+static int get_ifmac(const char *ifname, uint8_t *mac) {
+    struct ifreq ifr = {0};
+    int fd, err;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+    strncpy(ifr.ifr_name, ifname, IF_NAMESIZE - 1);
+    err = ioctl(fd, SIOCGIFHWADDR, &ifr);
+    close(fd);
+    if (err)
+        return -1;
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    return 0;
+}
+
+/* Map fds of af_xdp_kern.o on port, from the object we loaded or, taking
+ * over from a predecessor with --handover, from its pins */
+static int find_xdp_maps(struct bpf_object *obj, int *maps) {
+    for (int i = 0; i < NR_XDP_MAPS; i++) {
+        maps[i] = bpf_object__find_map_fd_by_name(obj, xdp_map_names[i]);
+        if (maps[i] < 0) {
+            fprintf(stderr, "ERROR: no %s found, rebuild af_xdp_kern.o\n", xdp_map_names[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* <HANDOVER_PIN_ROOT>/<ifname>[/<name>] */
+static void handover_pin_path(char *buf, size_t len, const struct fwd_port *port,
+                              const char *name) {
+    if (name)
+        snprintf(buf, len, "%s/%s/%s", HANDOVER_PIN_ROOT, port->ifname, name);
+    else
+        snprintf(buf, len, "%s/%s", HANDOVER_PIN_ROOT, port->ifname);
+}
+
+static int pin_xdp_maps(const struct fwd_port *port, const int *maps) {
+    char path[PATH_MAX];
+
+    if (mkdir(HANDOVER_PIN_ROOT, 0700) && errno != EEXIST)
+        goto err;
+    handover_pin_path(path, sizeof(path), port, NULL);
+    if (mkdir(path, 0700) && errno != EEXIST)
+        goto err;
+    for (int i = 0; i < NR_XDP_MAPS; i++) {
+        handover_pin_path(path, sizeof(path), port, xdp_map_names[i]);
+        if (bpf_obj_pin(maps[i], path))
+            goto err;
+    }
+    return 0;
+
+err:
+    fprintf(stderr, "Error: can't pin %s: %s (is bpffs mounted?)\n", path, strerror(errno));
+    return -1;
+}
+
+static void unpin_xdp_maps(const struct fwd_port *port) {
+    char path[PATH_MAX];
+
+    for (int i = 0; i < NR_XDP_MAPS; i++) {
+        handover_pin_path(path, sizeof(path), port, xdp_map_names[i]);
+        unlink(path);
+    }
+    handover_pin_path(path, sizeof(path), port, NULL);
+    rmdir(path);
+}
+
+/* 0 and the fds in maps, 1 if nothing is pinned for port, -1 on errors */
+static int open_pinned_maps(const struct fwd_port *port, int *maps) {
+    char path[PATH_MAX];
+
+    for (int i = 0; i < NR_XDP_MAPS; i++) {
+        handover_pin_path(path, sizeof(path), port, xdp_map_names[i]);
+        maps[i] = bpf_obj_get(path);
+        if (maps[i] >= 0)
+            continue;
+        if (i == 0 && errno == ENOENT)
+            return 1;
+        fprintf(stderr, "Error: can't open pinned %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-    if (!xsk->outstanding_tx) {// No TX happened, return
+/* First line of a /proc file, without the newline, "" if it can't be read */
+static void read_proc_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+
+    buf[0] = '\0';
+    if (!f)
         return;
+    if (fgets(buf, len, f))
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(f);
+}
+
+/* The pid in handover_map is only still our predecessor if it runs the
+ * same program: after a crash its pins stay behind and the pid may have
+ * been reused by anything, SIGUSR1 would kill it */
+static bool handover_owner_alive(uint32_t pid) {
+    char path[64], comm[32], self[32];
+
+    if (!pid || pid == (uint32_t) getpid())
+        return false;
+    snprintf(path, sizeof(path), "/proc/%u/comm", pid);
+    read_proc_line(path, comm, sizeof(comm));
+    read_proc_line("/proc/self/comm", self, sizeof(self));
+    return comm[0] && !strcmp(comm, self);
+}
+
+/* The predecessor died without handing over: its sockets are gone from
+ * xsks_map with it, drop the traffic classes it asked for, ours are set
+ * up again by setup_xdp_maps() */
+static void handover_reclaim(const struct config *cfg) {
+    struct classifier_key key;
+    uint32_t zero = 0, pid = 0;
+
+    for (int p = 0; p < cfg->nr_ports; p++) {
+        int fd = port_maps[p][MAP_CLASSIFIER];
+
+        while (!bpf_map_get_next_key(fd, NULL, &key))
+            if (bpf_map_delete_elem(fd, &key))
+                break;
+        bpf_map_update_elem(port_maps[p][MAP_HANDOVER], &zero, &pid, BPF_ANY);
+    }
+}
+
+/* --handover: if a predecessor left its maps pinned, ask it to hand the
+ * queues over and wait until it has closed its sockets. Its XDP program
+ * stays attached, we only swap our sockets into its xsks_map. */
+static int handover_takeover(struct config *cfg) {
+    uint32_t zero = 0, pid = 0;
+    uint64_t deadline;
+    int err;
+
+    for (int p = 0; p < cfg->nr_ports; p++) {
+        err = open_pinned_maps(&cfg->ports[p], port_maps[p]);
+        if (err < 0 || (err > 0 && p > 0)) {
+            fprintf(stderr, "Error: pinned state of %s doesn't match, use --unload\n",
+                    cfg->ports[p].ifname);
+            return -1;
+        }
+        if (err > 0)
+            return 0; /* Nobody to take over from, load our own program */
+    }
+
+    bpf_map_lookup_elem(port_maps[0][MAP_HANDOVER], &zero, &pid);
+    if (!handover_owner_alive(pid)) {
+        if (pid)
+            printf("Pid %u is gone, taking over its maps\n", pid);
+        handover_reclaim(cfg);
+        pid = 0;
     }
+    if (pid && kill(pid, SIGUSR1) == 0) {
+        printf("Taking over from pid %u\n", pid);
+        deadline = gettime() + (uint64_t) HANDOVER_TIMEOUT_MS * 1000000;
+        /* It clears the pid once its sockets are closed */
+        while (!bpf_map_lookup_elem(port_maps[0][MAP_HANDOVER], &zero, &pid) && pid &&
+               kill(pid, 0) == 0) {
+            if (gettime() > deadline) {
+                fprintf(stderr, "Error: pid %u didn't hand over in %d ms\n",
+                        pid, HANDOVER_TIMEOUT_MS);
+                return -1;
+            }
+            usleep(1000);
+        }
+    }
+    cfg->adopted = true;
+    return 0;
+}
 
-    /* ? */
-    sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+/* Publish our pid to successors, or clear it after handing over */
+static void handover_set_owner(const struct config *cfg, uint32_t pid) {
+    uint32_t zero = 0;
+
+    for (int p = 0; p < cfg->nr_ports; p++)
+        bpf_map_update_elem(port_maps[p][MAP_HANDOVER], &zero, &pid, BPF_ANY);
+}
 
+/* --steer: spread the flows of each queue over its sockets through the
+ * indirection table, hand them to other CPUs' kernel stack while their
+ * socket is busy */
+static int setup_steering(const struct config *cfg, const int *maps,
+                          const struct fwd_port *port) {
+    int cfg_fd = maps[MAP_STEER_CFG], table_fd = maps[MAP_STEER];
+    int busy_fd = maps[MAP_BUSY], cpu_fd = maps[MAP_CPU], err;
+    struct steer_cfg steer_cfg = {.mode = cfg->steer};
+    uint32_t qsize = STEER_CPUMAP_QSIZE, zero = 0;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t busy_size;
+    uint32_t *busy;
+
+    for (int q = cfg->xsk_if_queue; q < cfg->xsk_if_queue + cfg->nr_queues; q++) {
+        for (uint32_t i = 0; i < STEER_TABLE_SIZE; i++) {
+            uint32_t key = STEER_TABLE_KEY(q, i), slot = i % cfg->nr_slots;
+
+            err = bpf_map_update_elem(table_fd, &key, &slot, BPF_ANY);
+            if (err) {
+                fprintf(stderr, "Error: Failed to update steer map: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+    }
 
-    /* Collect/free completed TX buffers */
-    completed = xsk_ring_cons__peek(&xsk->umem->cq,
-                                    XSK_RING_CONS_NUM_DESCS,
-                                    &idx_cq);
+    /* Workers flag themselves busy right in the map */
+    busy_size = STEER_MAX_QUEUES * STEER_MAX_SOCKETS * sizeof(uint32_t);
+    busy = mmap(NULL, busy_size, PROT_READ | PROT_WRITE, MAP_SHARED, busy_fd, 0);
+    if (busy == MAP_FAILED) {
+        fprintf(stderr, "Warning: can't mmap xsk_busy_map (%s), no CPUMAP fallback\n",
+                strerror(errno));
+        nr_cpus = 0;
+    } else {
+        for (int i = 0; i < nr_sockets; i++) {
+            if (sockets[i]->port == port)
+                sockets[i]->busy = &busy[XSKS_MAP_KEY(sockets[i]->queue, sockets[i]->slot)];
+        }
+    }
+
+    if (nr_cpus > STEER_MAX_CPUS)
+        nr_cpus = STEER_MAX_CPUS;
+    for (uint32_t cpu = 0; cpu < nr_cpus; cpu++) {
+        if (bpf_map_update_elem(cpu_fd, &cpu, &qsize, BPF_ANY)) {
+            fprintf(stderr, "Warning: can't add CPU %u to cpu_map (%s), no CPUMAP fallback\n",
+                    cpu, strerror(errno));
+            nr_cpus = 0;
+        }
+    }
+    steer_cfg.nr_cpus = nr_cpus;
+
+    err = bpf_map_update_elem(cfg_fd, &zero, &steer_cfg, BPF_ANY);
+    if (err) {
+        fprintf(stderr, "Error: Failed to update steer config: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Point xsks_map at every socket bound to port, set up the classifier
+ * rule for handler and the steering maps. Each xsks_map update swaps one
+ * socket in atomically, the program never sees a half written entry. */
+static int setup_xdp_maps(struct config *cfg, const struct fwd_port *port,
+                          const struct pkt_handler *handler, uint16_t handler_port) {
+    const int *maps = port_maps[port - cfg->ports];
+    int xsks_map_fd = maps[MAP_XSKS], classifier_map_fd = maps[MAP_CLASSIFIER], err;
+
+    for (int i = 0; i < nr_sockets; i++) {
+        int xsk_fd = xsk_socket__fd(sockets[i]->xsk);
+        int key = XSKS_MAP_KEY(sockets[i]->queue, sockets[i]->slot);
+
+        if (sockets[i]->port != port)
+            continue;
+        err = bpf_map_update_elem(xsks_map_fd, &key, &xsk_fd, BPF_ANY);
+        if (err) {
+            fprintf(stderr, "Error: Failed to update map: %d (%s)\n",
+                    xsks_map_fd, strerror(errno));
+            return -1;
+        }
+    }
+    printf("Success: map updated!\n");
+
+    if (cfg->steer != STEER_OFF && setup_steering(cfg, maps, port))
+        return -1;
+
+    /* Tell the XDP program which packets the handler wants */
+    struct classifier_key ckey = {
+            .proto = handler->proto,
+            .port = handler->proto ? htons(handler_port) : 0,
+    };
+    __u32 action = CLASSIFIER_REDIRECT;
+    err = bpf_map_update_elem(classifier_map_fd, &ckey, &action, BPF_ANY);
+    if (err) {
+        fprintf(stderr, "Error: Failed to update classifier map: %d (%s)\n",
+                classifier_map_fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Load cfg->filename, set up its maps for port and attach the program to
+ * the port. Each port gets its own copy of the object and maps, pinned
+ * for a successor with --handover. */
+static int load_xdp_prog(struct config *cfg, const struct fwd_port *port,
+                         const struct pkt_handler *handler, uint16_t handler_port) {
+    int *maps = port_maps[port - cfg->ports];
+    struct bpf_object *obj;
+    struct bpf_program *bpf_prog;
+    int prog_fd, err;
+
+    /* open obj */
+    obj = bpf_object__open(cfg->filename);
+    if (!obj) {
+        fprintf(stderr, "Error: bpf_object__open failed\n");
+        return -1;
+    }
+
+    /* find program by section name and set prog type to XDP */
+    bpf_prog = bpf_object__find_program_by_title(obj, cfg->progsec);
+    if (!bpf_prog) {
+        fprintf(stderr, "Error: bpf_object__find_program_by_title failed\n");
+        return -1;
+    }
+    bpf_program__set_type(bpf_prog, BPF_PROG_TYPE_XDP);
+
+    /* Only load the program we attach, kernels without multi-buffer XDP
+     * reject the xdp.frags one */
+    struct bpf_program *other;
+    bpf_object__for_each_program(other, obj) {
+        if (other != bpf_prog)
+            bpf_program__set_autoload(other, false);
+    }
+
+    /* Load obj into kernel */
+    err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "Error: bpf_object__load failed\n");
+        return -1;
+    }
+
+    /* Get file descriptor for program */
+    prog_fd = bpf_program__fd(bpf_prog);
+    if (prog_fd < 0) {
+        fprintf(stderr, "Error: Couldn't get file descriptor for program\n");
+        return -1;
+    }
+
+    /* We also need the xsks_map and friends */
+    if (find_xdp_maps(obj, maps))
+        return -1;
+    if (cfg->handover && pin_xdp_maps(port, maps))
+        return -1;
+    if (setup_xdp_maps(cfg, port, handler, handler_port))
+        return -1;
+
+    /* load xdp prog in the specified interface */
+    err = bpf_set_link_xdp_fd(port->ifindex, prog_fd, cfg->xdp_flags);
+    if (err == -EEXIST && !(cfg->xdp_flags & XDP_FLAGS_UPDATE_IF_NOEXIST)) {
+        /* Force mode didn't work, probably because a program of the
+         * opposite type is loaded. Let's unload that and try loading
+         * again.
+         */
+        uint32_t old_flags = cfg->xdp_flags;
+
+        cfg->xdp_flags &= ~XDP_FLAGS_MODES;
+        cfg->xdp_flags |= (old_flags & XDP_FLAGS_SKB_MODE) ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+        err = bpf_set_link_xdp_fd(port->ifindex, -1, cfg->xdp_flags);
+        if (!err)
+            err = bpf_set_link_xdp_fd(port->ifindex, prog_fd, old_flags);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Error: ifindex(%d) link set xdp fd failed (%d): %s\n",
+                port->ifindex, -err, strerror(-err));
+        switch (-err) {
+            case EBUSY:
+            case EEXIST:
+                fprintf(stderr, "Hint: XDP already loaded on device"
+                                " use --force or -F to swap/replace\n");
+                break;
+            case EOPNOTSUPP:
+                fprintf(stderr, "Hint: Native-XDP not supported"
+                                " use --skb-mode or -S\n");
+                break;
+            default:
+                break;
+        }
+        return -1;
+    }
+
+    printf("Success: XDP prog loaded on device:%s(ifindex:%d)\n",
+           port->ifname, port->ifindex);
+    return 0;
+}
+
+/* Stop redirecting to our sockets. Handing over only takes them out of
+ * xsks_map, the program stays attached for the successor, otherwise the
+ * program is detached. Either way the queues' packets take the kernel
+ * path until the successor's sockets are in xsks_map. */
+static int stop_redirect(const struct config *cfg) {
+    int err;
 
-    /* 也就是内核生产了comp ring即代表发送完成，我们要逐一确认好（应该是非必须的吧？） */
-    if (completed > 0) {
-        for (int i = 0; i < completed; i++)
-            xsk_free_umem_frame(xsk,
-                                *xsk_ring_cons__comp_addr(&xsk->umem->cq,
-                                                          idx_cq++));
+    for (int p = 0; p < cfg->nr_ports; p++) {
+        const struct fwd_port *port = &cfg->ports[p];
 
-        xsk_ring_cons__release(&xsk->umem->cq, completed);
+        if (handover_exit) {
+            for (int i = 0; i < nr_sockets; i++) {
+                int key = XSKS_MAP_KEY(sockets[i]->queue, sockets[i]->slot);
 
-        /* 按道理这里的completed是应该要等于xsk->outstanding_tx的 */
-        xsk->outstanding_tx -= completed < xsk->outstanding_tx ?
-                               completed : xsk->outstanding_tx;
+                if (sockets[i]->port == port)
+                    bpf_map_delete_elem(port_maps[p][MAP_XSKS], &key);
+            }
+            continue;
+        }
+        err = bpf_set_link_xdp_fd(port->ifindex, -1, cfg->xdp_flags);
+        if (err) {
+            fprintf(stderr, "Error: %s() link set xdp failed (err=%d): %s\n",
+                    __func__, err, strerror(-err));
+            return -1;
+        }
+        printf("Success: XDP prog detached from device:%s(ifindex:%d)\n",
+               port->ifname, port->ifindex);
+        if (cfg->handover)
+            unpin_xdp_maps(port);
     }
+    return 0;
+}
+
+/* With the workers gone and nothing new redirected to us, finish what is
+ * in the RX rings and wait for the kernel to complete our TX, so neither
+ * requests nor replies get lost on the way out */
+static void drain_sockets(const struct config *cfg) {
+    uint64_t deadline = gettime() + (uint64_t) DRAIN_TIMEOUT_MS * 1000000;
+    bool pending;
+
+    do {
+        pending = false;
+        for (int i = 0; i < nr_workers; i++) {
+            struct xsk_socket_info *xsks[MAX_PORTS] = {workers[i].xsk, workers[i].peer};
+
+            for (int j = 0; j < MAX_PORTS && xsks[j]; j++) {
+                if (!cfg->txonly)
+                    handle_receive_packets(xsks[j], workers[i].handler);
+                complete_tx(xsks[j]);
+            }
+        }
+        for (int i = 0; i < nr_sockets; i++) {
+            if ((!cfg->txonly && xsk_cons_nb_avail(&sockets[i]->rx, 1)) ||
+                xsk_tx_in_flight(sockets[i]))
+                pending = true;
+        }
+    } while (pending && gettime() < deadline);
+
+    if (pending)
+        fprintf(stderr, "Warning: sockets not drained after %d ms\n", DRAIN_TIMEOUT_MS);
 }
 
 static struct option long_options[] = {{"dev",         required_argument, 0, 'd'},
@@ -305,7 +1064,42 @@ static struct option long_options[] = {{"dev",         required_argument, 0, 'd'
                                        {"zero-copy",   no_argument,       0, 'z'},
                                        {"queue",       required_argument, 0, 'Q'},
                                        {"poll-mode",   no_argument,       0, 'p'},
-                                       {"quiet",       no_argument,       0, 'q'}
+                                       {"quiet",       no_argument,       0, 'q'},
+                                       {"frame-size",  required_argument, 0, 'f'},
+                                       {"unaligned",   no_argument,       0, 'u'},
+                                       {"handler",     required_argument, 0, 'H'},
+                                       {"port",        required_argument, 0, 'P'},
+                                       {"queues",      required_argument, 0, 'n'},
+                                       {"txonly",      no_argument,       0, 'T'},
+                                       {"template",    required_argument, 0, '1'},
+                                       {"src-mac",     required_argument, 0, '2'},
+                                       {"dst-mac",     required_argument, 0, '3'},
+                                       {"src-ip",      required_argument, 0, '4'},
+                                       {"dst-ip",      required_argument, 0, '5'},
+                                       {"pkt-size",    required_argument, 0, '6'},
+                                       {"rate",        required_argument, 0, '7'},
+                                       {"keys",        required_argument, 0, '8'},
+                                       {"zipf",        required_argument, 0, '9'},
+                                       {"fwd",         required_argument, 0, 'w'},
+                                       {"dev-nexthop", required_argument, 0, 'm'},
+                                       {"fwd-nexthop", required_argument, 0, 'M'},
+                                       {"multi-buffer", no_argument,      0, 'B'},
+                                       {"capture",     required_argument, 0, 'C'},
+                                       {"capture-size", required_argument, 0, 'Z'},
+                                       {"capture-files", required_argument, 0, 'W'},
+                                       {"snaplen",     required_argument, 0, 'L'},
+                                       {"mc-preload",  required_argument, 0, 'K'},
+                                       {"frames",      required_argument, 0, 'k'},
+                                       {"fill-size",   required_argument, 0, 'i'},
+                                       {"comp-size",   required_argument, 0, 'j'},
+                                       {"rx-size",     required_argument, 0, 'r'},
+                                       {"tx-size",     required_argument, 0, 't'},
+                                       {"batch",       required_argument, 0, 'b'},
+                                       {"autotune",    no_argument,       0, 'a'},
+                                       {"steer",       required_argument, 0, 'e'},
+                                       {"workers",     required_argument, 0, 'x'},
+                                       {"handover",    no_argument,       0, 'g'},
+                                       {0, 0, 0, 0}
 };
 
 static void usage(char *name) {
@@ -320,33 +1114,128 @@ static void usage(char *name) {
            "-F, --force\t\tForce install, replacing existing program on interface\n"
            "-U, --unload\t\tUnload XDP program instead of loading\n"
            "-o, --obj <objname>\tSpecify the obj filename <objname>, default af-xdp-kern.o\n"
-           "-s, --sec <secname>\tSpecify the section name <secname>, default xdp\n"
+           "-s, --sec <secname>\tSpecify the section name <secname>, default xdp,\n"
+           "\t\t\txdp.frags with --multi-buffer\n"
            "-c, --copy\t\tForce copy mode\n"
            "-z, --zero-copy\t\tForce zero-copy mode\n"
            "-Q, --queue <queue_id>\tConfigure interface receive queue for AF_XDP, default is 0\n"
            "-p, --poll-mode\t\tUse the poll() API waiting for packets to arrive\n"
-           "-q, --quiet\t\tQuiet mode (no output)\n", name);
+           "-q, --quiet\t\tQuiet mode (no output)\n"
+           "-f, --frame-size <size>\tUMEM frame size, 2048 or 4096 (default), any size\n"
+           "\t\t\tin between with --unaligned. UMEM size stays the same\n"
+           "-u, --unaligned\t\tUse unaligned chunk mode (XDP_UMEM_UNALIGNED_CHUNK_FLAG)\n"
+           "--multi-buffer\t\tBind with XDP_USE_SG, packets larger than a frame\n"
+           "\t\t\t(jumbo MTU) span several frames\n"
+           "--frames <n>\t\tUMEM frames, default as many as fit in %u MiB\n"
+           "--fill-size <n>\t\tFill ring size, power of 2, default %u\n"
+           "--comp-size <n>\t\tCompletion ring size, power of 2, default %u\n"
+           "--rx-size <n>\t\tRX ring size, power of 2, default %u\n"
+           "--tx-size <n>\t\tTX ring size, power of 2, default %u\n"
+           "-b, --batch <n>\t\tRX descriptors per round, 1..%u, default %u. With\n"
+           "\t\t\t--txonly TX descriptors per round\n"
+           "--autotune\t\tSweep the RX batch size while running and keep the\n"
+           "\t\t\tone with the best rate, then latency\n"
+           "-H, --handler <name>\tPacket handler, one of:\n", name,
+           (unsigned int) (UMEM_SIZE >> 20), XSK_RING_PROD_NUM_DESCS, XSK_RING_CONS_NUM_DESCS,
+           XSK_RING_PROD_NUM_DESCS, XSK_RING_CONS_NUM_DESCS, RX_BATCH_MAX, RX_BATCH_SIZE);
+    pkt_handler_list(stdout);
+    printf("-P, --port <port>\tL4 port the handler serves, if it has one\n"
+           "\t\t\t(destination port of the generated packets with --txonly)\n"
+           "--mc-preload <n>\tmemcached: store the first n keys of --template\n"
+           "\t\t\tmemcached at startup\n"
+           "-n, --queues <n>\tUse n queues starting at --queue, one socket and\n"
+           "\t\t\tthread each, default 1\n"
+           "--workers <n>\t\tSockets and threads per queue, 1..%d, default 1\n"
+           "--steer <hash>\t\tflow (5-tuple, default with --workers) or mckey\n"
+           "\t\t\t(memcached key): spread each queue's packets over its\n"
+           "\t\t\tworkers by this hash, busy workers' flows go to the\n"
+           "\t\t\tkernel stack of another CPU (CPUMAP)\n"
+           "--handover\t\tPin the maps under " HANDOVER_PIN_ROOT "/<ifname>; a\n"
+           "\t\t\tlater --handover run takes the queues over without\n"
+           "\t\t\treloading the XDP program, this one drains and exits.\n"
+           "\t\t\tIn between their packets go to the kernel stack\n\n"
+
+           "Forwarding:\n"
+           "-w, --fwd <ifname>\tAlso open the same queues on <ifname>, sharing the\n"
+           "\t\t\tUMEM, and forward between it and --dev (handler fwd)\n"
+           "--dev-nexthop <mac>\tRewrite frames leaving --dev to this destination\n"
+           "\t\t\tand the MAC of --dev as source, default no rewrite\n"
+           "--fwd-nexthop <mac>\tSame for frames leaving --fwd\n\n"
+
+           "Capture:\n"
+           "--capture <file>\tWrite every packet redirected to AF_XDP to a\n"
+           "\t\t\tpcapng file, rotating to <file>.1, <file>.2, ...\n"
+           "--capture-size <MiB>\tSize of each file, default %u\n"
+           "--capture-files <n>\tFiles to rotate through, oldest is overwritten,\n"
+           "\t\t\tdefault %u\n"
+           "--snaplen <bytes>\tBytes captured per packet, default %u\n\n"
+
+           "Traffic generator:\n"
+           "-T, --txonly\t\tOnly transmit packets built from a template, no XDP\n"
+           "\t\t\tprogram is loaded\n"
+           "--template <name>\ticmp, udp (default) or memcached (\"get <key>\")\n"
+           "--src-mac <mac>\t\tDefault is the MAC address of --dev\n"
+           "--dst-mac <mac>\t\tDefault ff:ff:ff:ff:ff:ff\n"
+           "--src-ip <addr>\t\tDefault %s\n"
+           "--dst-ip <addr>\t\tDefault %s\n"
+           "--pkt-size <bytes>\ticmp/udp frame size without FCS, default %u\n"
+           "--rate <pps>\t\tPackets per second over all queues, default unlimited\n"
+           "--keys <n>\t\tmemcached key space, default %u\n"
+           "--zipf <s>\t\tmemcached key popularity exponent, default %.2f, 0 is uniform\n",
+           STEER_MAX_SOCKETS,
+           CAPTURE_DEFAULT_SIZE, CAPTURE_DEFAULT_FILES, CAPTURE_DEFAULT_SNAPLEN,
+           TXGEN_DEFAULT_SRC_IP, TXGEN_DEFAULT_DST_IP, TXGEN_DEFAULT_PKT_SIZE,
+           TXGEN_DEFAULT_KEYS, TXGEN_DEFAULT_ZIPF);
 } /* End of usage */
 
 int main(int argc, char **argv) {
     int err;
     uint64_t packet_buffer_size;
+    uint32_t num_frames;
     void *packet_buffer; // start address of UMEM
 
     struct rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY}; // Resource LIMIT, for setrlimit()
     struct xsk_umem_info *umem_info = NULL;
-    struct xsk_socket_info *xsk_info = NULL;
+    struct txgen *gen = NULL;
+    struct capture *cap = NULL;
 
     struct config cfg = { /* xdp prog loading related config options */
             .ifindex   = -1,
             .do_unload = false,
             .filename = "af-xdp-kern.o",
-            .progsec = "xdp"
+            .progsec = "xdp",
+            .frame_size = FRAME_SIZE,
+            .fill_size = XSK_RING_PROD_NUM_DESCS,
+            .comp_size = XSK_RING_CONS_NUM_DESCS,
+            .rx_size = XSK_RING_PROD_NUM_DESCS,
+            .tx_size = XSK_RING_CONS_NUM_DESCS,
+            .batch = RX_BATCH_SIZE,
+            .nr_queues = 1,
+            .nr_slots = 1,
+            .nr_ports = 1,
+            .capture = {
+                    .snaplen = CAPTURE_DEFAULT_SNAPLEN,
+                    .file_size = (uint64_t) CAPTURE_DEFAULT_SIZE << 20,
+                    .nr_files = CAPTURE_DEFAULT_FILES,
+            },
+            .txgen = {
+                    .tmpl = TXGEN_UDP,
+                    .dst_mac = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+                    .src_port = TXGEN_DEFAULT_SRC_PORT,
+                    .pkt_size = TXGEN_DEFAULT_PKT_SIZE,
+                    .nr_keys = TXGEN_DEFAULT_KEYS,
+                    .zipf_s = TXGEN_DEFAULT_ZIPF,
+            },
     };
+    const struct pkt_handler *handler = NULL;
+    uint16_t handler_port;
+
+    inet_pton(AF_INET, TXGEN_DEFAULT_SRC_IP, &cfg.txgen.src_ip);
+    inet_pton(AF_INET, TXGEN_DEFAULT_DST_IP, &cfg.txgen.dst_ip);
 
     /* Parse args */
     int c, option_index;
-    while ((c = getopt_long(argc, argv, "d:hSNFUo:s:czQ:pq", long_options, &option_index)) != EOF) {
+    while ((c = getopt_long(argc, argv, "d:hSNFUo:s:czQ:pqf:uH:P:n:Tw:b:", long_options, &option_index)) != EOF) {
         switch (c) {
             case 'd':
                 if (strlen(optarg) >= IF_NAMESIZE) {
@@ -367,7 +1256,7 @@ int main(int argc, char **argv) {
             case 'S':
                 cfg.xdp_flags &= ~XDP_FLAGS_MODES;    /* Clear flags */
                 cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;  /* Set   flag */
-                cfg.xsk_bind_flags &= XDP_ZEROCOPY;
+                cfg.xsk_bind_flags &= ~XDP_ZEROCOPY;
                 cfg.xsk_bind_flags |= XDP_COPY;
                 break;
             case 'N':
@@ -387,11 +1276,11 @@ int main(int argc, char **argv) {
                 strncpy((char *) &cfg.progsec, optarg, sizeof(cfg.progsec));
                 break;
             case 'c':
-                cfg.xsk_bind_flags &= XDP_ZEROCOPY;
+                cfg.xsk_bind_flags &= ~XDP_ZEROCOPY;
                 cfg.xsk_bind_flags |= XDP_COPY;
                 break;
             case 'z':
-                cfg.xsk_bind_flags &= XDP_COPY;
+                cfg.xsk_bind_flags &= ~XDP_COPY;
                 cfg.xsk_bind_flags |= XDP_ZEROCOPY;
                 break;
             case 'Q':
@@ -403,6 +1292,164 @@ int main(int argc, char **argv) {
             case 'q':
                 verbose = false;
                 break;
+            case 'f':
+                cfg.frame_size = atoi(optarg);
+                break;
+            case 'u':
+                cfg.unaligned = true;
+                break;
+            case 'H':
+                cfg.handler_name = optarg;
+                break;
+            case 'P':
+                cfg.handler_opts.port = atoi(optarg);
+                break;
+            case 'n':
+                cfg.nr_queues = atoi(optarg);
+                if (cfg.nr_queues < 1 || cfg.nr_queues > MAX_QUEUES) {
+                    fprintf(stderr, "Error: --queues must be 1..%d\n", MAX_QUEUES);
+                    return -1;
+                }
+                break;
+            case 'T':
+                cfg.txonly = true;
+                break;
+            case '1':
+                if (txgen_parse_template(optarg, &cfg.txgen.tmpl)) {
+                    fprintf(stderr, "Error: unknown template %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case '2':
+            case '3':
+                if (txgen_parse_mac(optarg, c == '2' ? cfg.txgen.src_mac : cfg.txgen.dst_mac)) {
+                    fprintf(stderr, "Error: invalid MAC address %s\n", optarg);
+                    return -1;
+                }
+                if (c == '2')
+                    cfg.txgen.src_mac_set = true;
+                break;
+            case '4':
+            case '5':
+                if (inet_pton(AF_INET, optarg, c == '4' ? &cfg.txgen.src_ip : &cfg.txgen.dst_ip) != 1) {
+                    fprintf(stderr, "Error: invalid IPv4 address %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case '6':
+                cfg.txgen.pkt_size = atoi(optarg);
+                break;
+            case '7':
+                cfg.txgen.rate = strtoull(optarg, NULL, 0);
+                break;
+            case '8':
+                cfg.txgen.nr_keys = strtoul(optarg, NULL, 0);
+                break;
+            case '9':
+                cfg.txgen.zipf_s = strtod(optarg, NULL);
+                break;
+            case 'w':
+                if (strlen(optarg) >= IF_NAMESIZE) {
+                    fprintf(stderr, "Error: fwd dev name is too long\n");
+                    return -1;
+                }
+                cfg.ports[1].ifname = optarg;
+                cfg.ports[1].ifindex = if_nametoindex(optarg);
+                if (cfg.ports[1].ifindex == 0) {
+                    fprintf(stderr, "ERR: fwd dev name unknown err\n");
+                    return -1;
+                }
+                cfg.nr_ports = 2;
+                break;
+            case 'm':
+            case 'M':
+                if (txgen_parse_mac(optarg, cfg.ports[c == 'M'].nexthop)) {
+                    fprintf(stderr, "Error: invalid MAC address %s\n", optarg);
+                    return -1;
+                }
+                cfg.ports[c == 'M'].rewrite = true;
+                break;
+            case 'B':
+                cfg.xsk_bind_flags |= XDP_USE_SG;
+                break;
+            case 'K':
+                cfg.handler_opts.mc_preload = strtoul(optarg, NULL, 0);
+                break;
+            case 'k':
+                cfg.nr_frames = strtoul(optarg, NULL, 0);
+                if (!cfg.nr_frames) {
+                    fprintf(stderr, "Error: --frames must be at least 1\n");
+                    return -1;
+                }
+                break;
+            case 'i':
+            case 'j':
+            case 'r':
+            case 't': {
+                uint32_t size = strtoul(optarg, NULL, 0);
+
+                if (!size || (size & (size - 1))) {
+                    fprintf(stderr, "Error: ring sizes must be a power of 2\n");
+                    return -1;
+                }
+                *(c == 'i' ? &cfg.fill_size : c == 'j' ? &cfg.comp_size :
+                  c == 'r' ? &cfg.rx_size : &cfg.tx_size) = size;
+                break;
+            }
+            case 'b':
+                cfg.batch = atoi(optarg);
+                if (cfg.batch < 1 || cfg.batch > RX_BATCH_MAX) {
+                    fprintf(stderr, "Error: --batch must be 1..%d\n", RX_BATCH_MAX);
+                    return -1;
+                }
+                break;
+            case 'a':
+                cfg.autotune = true;
+                break;
+            case 'e':
+                if (!strcmp(optarg, "flow")) {
+                    cfg.steer = STEER_FLOW;
+                } else if (!strcmp(optarg, "mckey")) {
+                    cfg.steer = STEER_MCKEY;
+                } else {
+                    fprintf(stderr, "Error: --steer must be flow or mckey\n");
+                    return -1;
+                }
+                break;
+            case 'x':
+                cfg.nr_slots = atoi(optarg);
+                if (cfg.nr_slots < 1 || cfg.nr_slots > STEER_MAX_SOCKETS) {
+                    fprintf(stderr, "Error: --workers must be 1..%d\n", STEER_MAX_SOCKETS);
+                    return -1;
+                }
+                break;
+            case 'g':
+                cfg.handover = true;
+                break;
+            case 'C':
+                cfg.capture.path = optarg;
+                break;
+            case 'Z':
+                cfg.capture.file_size = strtoull(optarg, NULL, 0) << 20;
+                if (!cfg.capture.file_size) {
+                    fprintf(stderr, "Error: --capture-size must be at least 1 MiB\n");
+                    return -1;
+                }
+                break;
+            case 'W':
+                cfg.capture.nr_files = atoi(optarg);
+                if (cfg.capture.nr_files < 1) {
+                    fprintf(stderr, "Error: --capture-files must be at least 1\n");
+                    return -1;
+                }
+                break;
+            case 'L':
+                cfg.capture.snaplen = atoi(optarg);
+                if (cfg.capture.snaplen < sizeof(struct ethhdr) || cfg.capture.snaplen > 65535) {
+                    fprintf(stderr, "Error: --snaplen must be 14..65535\n");
+                    return -1;
+                }
+                break;
             default:
                 usage(argv[0]);
                 return -1;
@@ -416,18 +1463,108 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    /* Frames larger than a UMEM frame come in several buffers, only
+     * programs flagged as frags-aware may see them */
+    if ((cfg.xsk_bind_flags & XDP_USE_SG) && !strcmp(cfg.progsec, "xdp"))
+        strcpy(cfg.progsec, "xdp.frags");
+    /* An RX batch smaller than a packet would put its tail back forever */
+    if ((cfg.xsk_bind_flags & XDP_USE_SG) && !cfg.txonly && cfg.batch < XSK_MAX_FRAGS) {
+        fprintf(stderr, "Error: --batch must be at least %d with --multi-buffer\n", XSK_MAX_FRAGS);
+        return -1;
+    }
+
+    cfg.ports[0].ifname = cfg.ifname;
+    cfg.ports[0].ifindex = cfg.ifindex;
+    if (cfg.nr_ports > 1 && cfg.txonly) {
+        fprintf(stderr, "Error: --fwd and --txonly don't go together\n");
+        return -1;
+    }
+    if (cfg.nr_slots > 1 && cfg.steer == STEER_OFF)
+        cfg.steer = STEER_FLOW;
+    if (cfg.steer != STEER_OFF && cfg.txonly) {
+        fprintf(stderr, "Error: --steer and --workers need RX, not --txonly\n");
+        return -1;
+    }
+    if (cfg.nr_queues * cfg.nr_slots > MAX_WORKERS) {
+        fprintf(stderr, "Error: --queues times --workers must be at most %d\n", MAX_WORKERS);
+        return -1;
+    }
+    if (cfg.xsk_if_queue < 0 || cfg.xsk_if_queue + cfg.nr_queues > STEER_MAX_QUEUES) {
+        fprintf(stderr, "Error: queues must be below %d\n", STEER_MAX_QUEUES);
+        return -1;
+    }
+    if (cfg.handover && cfg.txonly) {
+        fprintf(stderr, "Error: --handover swaps sockets in xsks_map, no XDP with --txonly\n");
+        return -1;
+    }
+    if (cfg.autotune && cfg.txonly) {
+        fprintf(stderr, "Error: --autotune tunes the RX batch, no RX with --txonly\n");
+        return -1;
+    }
+    if (cfg.capture.path && cfg.txonly) {
+        fprintf(stderr, "Error: nothing to --capture with --txonly\n");
+        return -1;
+    }
+    if (cfg.ports[1].rewrite && cfg.nr_ports < 2) {
+        fprintf(stderr, "Error: --fwd-nexthop needs --fwd\n");
+        return -1;
+    }
+    for (int i = 0; i < cfg.nr_ports; i++) {
+        if (cfg.ports[i].rewrite && get_ifmac(cfg.ports[i].ifname, cfg.ports[i].mac)) {
+            fprintf(stderr, "Error: can't get MAC address of %s\n", cfg.ports[i].ifname);
+            return -1;
+        }
+    }
+    if (!cfg.handler_name)
+        cfg.handler_name = cfg.nr_ports > 1 ? "fwd" : "icmp_echo";
+
+    /* Aligned chunks must be a power of two between 2K and the page size */
+    if (cfg.frame_size < MIN_FRAME_SIZE || cfg.frame_size > getpagesize() ||
+        (!cfg.unaligned && (cfg.frame_size & (cfg.frame_size - 1)))) {
+        fprintf(stderr, "Error: invalid frame size %u%s\n", cfg.frame_size,
+                cfg.unaligned ? "" : " (use --unaligned for non power of 2)");
+        return -1;
+    }
+
+    if (cfg.txonly) {
+        cfg.txgen.dst_port = cfg.handler_opts.port;
+        if (!cfg.txgen.dst_port)
+            cfg.txgen.dst_port = cfg.txgen.tmpl == TXGEN_MEMCACHED ?
+                                 TXGEN_DEFAULT_MC_PORT : TXGEN_DEFAULT_UDP_PORT;
+        if (!cfg.txgen.src_mac_set && get_ifmac(cfg.ifname, cfg.txgen.src_mac)) {
+            fprintf(stderr, "Error: can't get MAC address of %s, use --src-mac\n",
+                    cfg.ifname);
+            return -1;
+        }
+    } else {
+        handler = pkt_handler_find(cfg.handler_name);
+        if (!handler) {
+            fprintf(stderr, "Error: unknown packet handler %s\n", cfg.handler_name);
+            usage(argv[0]);
+            return -1;
+        }
+        if (handler->init && handler->init(&cfg.handler_opts)) {
+            fprintf(stderr, "Error: packet handler %s init failed\n", handler->name);
+            return -1;
+        }
+        handler_port = cfg.handler_opts.port ? cfg.handler_opts.port : handler->default_port;
+    }
+
     /* Unload XDP program */
     if (cfg.do_unload) {
-        err = bpf_set_link_xdp_fd(cfg.ifindex, -1, cfg.xdp_flags);
-        if (err) {
-            fprintf(stderr, "Error: %s() link set xdp failed (err=%d): %s\n",
-                    __func__, err, strerror(-err));
-            return 1;
-        } else {
+        for (int i = 0; i < cfg.nr_ports; i++) {
+            err = bpf_set_link_xdp_fd(cfg.ports[i].ifindex, -1, cfg.xdp_flags);
+            if (err) {
+                fprintf(stderr, "Error: %s() link set xdp failed (err=%d): %s\n",
+                        __func__, err, strerror(-err));
+                return 1;
+            }
             printf("Success: XDP prog detached from device: %s (ifindex:%d)\n",
-                   cfg.ifname, cfg.ifindex);
-            return 0;
+                   cfg.ports[i].ifname, cfg.ports[i].ifindex);
+            if (cfg.handover)
+                unpin_xdp_maps(&cfg.ports[i]);
         }
+        return 0;
     }
 
     /* Allow unlimited locking of memory, so all memory needed for packet
@@ -444,15 +1581,20 @@ int main(int argc, char **argv) {
     struct sigaction act;
     act.sa_handler = IntHandler;
     sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
     sigaction(SIGINT, &act, 0);
+    sigaction(SIGTERM, &act, 0);
+    if (cfg.handover) {
+        act.sa_handler = HandoverHandler;
+        sigaction(SIGUSR1, &act, 0);
+    }
 
-    /* Allocate memory for NUM_FRAMES of the default XDP frame size */
-    packet_buffer_size = NUM_FRAMES * FRAME_SIZE; /* FRAME_SIZE应该UMEM规定的数据帧的默认大小，
-												   * NUM_FRAMES就是我们设置的UMEM中数据帧数量 */
-    err = posix_memalign(&packet_buffer, /* 分配UMEM的内存到void* packet_buffer，并按pagesize(linux默认4K（4096B）)对齐 */
-                         getpagesize(),
-                         packet_buffer_size);
-    if (err) {
+    /* Allocate UMEM_SIZE bytes, i.e. NUM_FRAMES of the default XDP frame
+     * size, or twice as many 2K frames, unless --frames says otherwise */
+    num_frames = cfg.nr_frames ? cfg.nr_frames : UMEM_SIZE / cfg.frame_size;
+    packet_buffer_size = (uint64_t) num_frames * cfg.frame_size;
+    packet_buffer = alloc_umem_area(packet_buffer_size, cfg.unaligned); /* mmap按页对齐 */
+    if (!packet_buffer) {
         fprintf(stderr, "Error: Can't allocate buffer memory \"%s\"\n",
                 strerror(errno));
         return -1;
@@ -464,26 +1606,110 @@ int main(int argc, char **argv) {
 	 */
     umem_info = calloc(1, sizeof(*umem_info));
     err = create_xsk_umem(&umem_info->umem, packet_buffer, packet_buffer_size,
-                          &umem_info->fq, &umem_info->cq);
+                          &umem_info->fq, &umem_info->cq, &cfg);
     if (err) {
         fprintf(stderr, "Error: Can't create umem: \"%s\"\n", strerror(errno));
         return -1;
     }
     umem_info->buffer = packet_buffer;
+    umem_info->buffer_size = packet_buffer_size;
+    umem_info->frame_size = cfg.frame_size;
+    umem_info->unaligned = cfg.unaligned;
+    umem_info->rx_ts = calloc(num_frames, sizeof(*umem_info->rx_ts));
+    if (!umem_info->rx_ts) {
+        fprintf(stderr, "Error: Can't allocate frame timestamps\n");
+        return -1;
+    }
 
-    /* Open and configure the AF_XDP socket (xsk) */
-    xsk_info = calloc(1, sizeof(*xsk_info));
-    if (!xsk_info) {
-        fprintf(stderr, "Error: Cannot alloc memory for xsk_info: \"%s\"\n", strerror(errno));
-        return 1;
+    /* Frames are handed out by a pool shared by every socket using this
+     * umem, each thread allocates through its own frame cache. */
+    umem_info->pool = xsk_frame_pool__create(num_frames, cfg.frame_size,
+                                             MAX_FRAME_CACHES);
+    if (!umem_info->pool) {
+        fprintf(stderr, "Error: Can't create umem frame pool\n");
+        return -1;
     }
-    xsk_info->umem = umem_info;
 
-    err = create_xsk_socket(&xsk_info->xsk, umem_info->umem, &xsk_info->rx,
-                            &xsk_info->tx, &cfg);
-    if (err) {
-        fprintf(stderr, "Error: Can't create xsk socket: \"%s\"\n", strerror(-err));
+    /* Everything up to binding the sockets is ready, only now make the
+     * predecessor let go of the queues */
+    if (cfg.handover && handover_takeover(&cfg))
         return -1;
+
+    /* Open and configure one AF_XDP socket (xsk) per queue, port and
+     * --workers slot. With --fwd the two sockets of a worker forward to
+     * each other. */
+    for (int i = 0; i < cfg.nr_queues; i++) {
+        struct xsk_socket_info *leaders[MAX_PORTS] = {0};
+
+        for (int slot = 0; slot < cfg.nr_slots; slot++) {
+            struct worker *w = &workers[nr_workers];
+
+            for (int p = 0; p < cfg.nr_ports; p++) {
+                struct xsk_socket_info *xsk;
+
+                xsk = xsk_configure_socket(&cfg, umem_info, &cfg.ports[p],
+                                           cfg.xsk_if_queue + i, nr_sockets == 0,
+                                           leaders[p], slot);
+                if (!xsk)
+                    return -1;
+                sockets[nr_sockets++] = xsk;
+                if (!leaders[p])
+                    leaders[p] = xsk;
+                if (p == 0)
+                    w->xsk = xsk;
+                else
+                    w->peer = xsk;
+            }
+            if (w->peer) {
+                w->xsk->fwd = w->peer;
+                w->peer->fwd = w->xsk;
+            }
+            w->cfg = &cfg;
+            w->handler = handler;
+            nr_workers++;
+        }
+    }
+
+    if (cfg.txonly) {
+        /* Templates live in frames of the first cache, every queue sends
+         * the same read only frames */
+        gen = txgen_create(&cfg.txgen, workers[0].xsk->frames, packet_buffer,
+                           cfg.frame_size);
+        if (!gen)
+            return -1;
+        for (int i = 0; i < nr_workers; i++) {
+            workers[i].gen = gen;
+            workers[i].xsk->static_tx = true;
+        }
+    } else {
+        /* 填充FILL ring, 好让kernel消费 */
+        /* Stuff the receive path with buffers, split between the sockets
+         * and, with --workers, between those sharing a fill ring */
+        for (int i = 0; i < nr_sockets; i++)
+            xsk_prefill_fill_ring(sockets[i],
+                                  num_frames / nr_sockets / 2 < cfg.fill_size / cfg.nr_slots ?
+                                  num_frames / nr_sockets / 2 : cfg.fill_size / cfg.nr_slots);
+    }
+
+    /* One capture ring per socket, all drained by one writer thread */
+    if (cfg.capture.path) {
+        cap = capture_open(&cfg.capture);
+        if (!cap) {
+            fprintf(stderr, "Error: Can't allocate capture\n");
+            return -1;
+        }
+        for (int i = 0; i < cfg.nr_ports; i++)
+            capture_add_iface(cap, cfg.ports[i].ifname);
+        for (int i = 0; i < nr_sockets; i++) {
+            sockets[i]->cap = capture_add_ring(cap, sockets[i]->port - cfg.ports);
+            if (!sockets[i]->cap) {
+                fprintf(stderr, "Error: Can't allocate capture ring\n");
+                return -1;
+            }
+        }
+        if (capture_start(cap))
+            return -1;
+        printf("Capturing to %s\n", cfg.capture.path);
     }
 
     /* 后面又用不上prog_id, 要这块干啥? */
@@ -495,37 +1721,11 @@ int main(int argc, char **argv) {
 //        return 1;
 //    }
 
-    /* Initialize umem frame allocation */
-    for (int i = 0; i < NUM_FRAMES; i++) { // 把UMEM中每个数据帧的地址都指定好？但这个地址是以FRAME_SIZE也就是4096为单位的，emm
-        xsk_info->umem_frame_addr[i] = i * FRAME_SIZE;
-    }
-    xsk_info->umem_frame_free = NUM_FRAMES; // 剩余能操作的数据帧数量
-
-    /* 填充FILL ring, 好让kernel消费 */
-    /* Stuff the receive path with buffers, we assume we have enough */
-    uint32_t idx; // 下标
-    err = xsk_ring_prod__reserve(&xsk_info->umem->fq,
-                                 XSK_RING_PROD_NUM_DESCS,
-                                 &idx);
-    if (err != XSK_RING_PROD_NUM_DESCS) {
-        fprintf(stderr, "Error: xsk_ring_prod__reserve failed.\n");
-        return -1;
-    }
-
-    for (int i = 0; i < XSK_RING_PROD_NUM_DESCS; i++) {
-        *xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx++) =
-                xsk_alloc_umem_frame(xsk_info);
-    }
-
-    // 数据更新完毕，更新生产者下标
-    xsk_ring_prod__submit(&xsk_info->umem->fq, XSK_RING_PROD_NUM_DESCS);
-    /* 注：生产者下标永远指向下一个可填充数据位置 */
-
     /* Start thread to do statistics display */
     pthread_t stats_poll_thread;
     if (verbose) {
         err = pthread_create(&stats_poll_thread, NULL, stats_poll,
-                             xsk_info); // 总之就是另开一个线程跑stats_poll
+                             &cfg); // 总之就是另开一个线程跑stats_poll
         if (err) {
             fprintf(stderr, "ERROR: Failed creating statistics thread "
                             "\"%s\"\n", strerror(errno));
@@ -533,223 +1733,78 @@ int main(int argc, char **argv) {
         }
     }
 
-    /* open obj */
-    struct bpf_object *obj;
-    obj = bpf_object__open(cfg.filename);
-    if (!obj) {
-        fprintf(stderr, "Error: bpf_object__open failed\n");
-        return 1;
-    }
-
-    /* find program by section name and set prog type to XDP */
-    struct bpf_program *bpf_prog;
-    bpf_prog = bpf_object__find_program_by_title(obj, cfg.progsec);
-    if (!bpf_prog) {
-        fprintf(stderr, "Error: bpf_object__find_program_by_title failed\n");
-        return 1;
-    }
-    bpf_program__set_type(bpf_prog, BPF_PROG_TYPE_XDP);
-
-    /* Load obj into kernel */
-    err = bpf_object__load(obj);
-    if (err) {
-        fprintf(stderr, "Error: bpf_object__load failed\n");
-        return 1;
-    }
-
-    /* Get file descriptor for program */
-    int prog_fd;
-    prog_fd = bpf_program__fd(bpf_prog);
-    if (prog_fd < 0) {
-        fprintf(stderr, "Error: Couldn't get file descriptor for program\n");
-        return 1;
-    }
-
-    int xsks_map_fd;
-    /* We also need to load the xsks_map */
-    xsks_map_fd = bpf_object__find_map_fd_by_name(obj, "xsks_map");
-    if (xsks_map_fd < 0) {
-        fprintf(stderr, "ERROR: no xsks map found: %s\n",
-                strerror(xsks_map_fd));
-        exit(EXIT_FAILURE);
-    }
-    int xsk_fd = xsk_socket__fd(xsk_info->xsk);
-    err = bpf_map_update_elem(xsks_map_fd, &cfg.xsk_if_queue, &xsk_fd, BPF_ANY);
-    if (err) {
-        fprintf(stderr, "Error: Failed to update map: %d (%s)\n",
-                xsks_map_fd, strerror(errno));
-        return -1;
-    } else {
-        printf("Success: map updated!\n");
-    }
-
-    /* load xdp prog in the specified interface */
-    err = bpf_set_link_xdp_fd(cfg.ifindex, prog_fd, cfg.xdp_flags);
-    if (err == -EEXIST && !(cfg.xdp_flags & XDP_FLAGS_UPDATE_IF_NOEXIST)) {
-        /* Force mode didn't work, probably because a program of the
-         * opposite type is loaded. Let's unload that and try loading
-         * again.
-         */
-        uint32_t old_flags = cfg.xdp_flags;
-
-        cfg.xdp_flags &= ~XDP_FLAGS_MODES;
-        cfg.xdp_flags |= (old_flags & XDP_FLAGS_SKB_MODE) ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
-        err = bpf_set_link_xdp_fd(cfg.ifindex, -1, cfg.xdp_flags);
-        if (!err)
-            err = bpf_set_link_xdp_fd(cfg.ifindex, prog_fd, old_flags);
-    }
-    if (err < 0) {
-        fprintf(stderr, "Error: ifindex(%d) link set xdp fd failed (%d): %s\n",
-                cfg.ifindex, -err, strerror(-err));
-        switch (-err) {
-            case EBUSY:
-            case EEXIST:
-                fprintf(stderr, "Hint: XDP already loaded on device"
-                                " use --force or -F to swap/replace\n");
-                break;
-            case EOPNOTSUPP:
-                fprintf(stderr, "Hint: Native-XDP not supported"
-                                " use --skb-mode or -S\n");
-                break;
-            default:
-                break;
+    pthread_t autotune_thread;
+    if (cfg.autotune) {
+        err = pthread_create(&autotune_thread, NULL, autotune_poll, &cfg);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed creating autotune thread "
+                            "\"%s\"\n", strerror(err));
+            exit(1);
         }
-        return 1;
     }
 
-    printf("Success: XDP prog loaded on device:%s(ifindex:%d)\n",
-           cfg.ifname, cfg.ifindex);
-
-
-    /* Receive and count packets */
-    struct pollfd fds[2];
-    int nfds = 1;
-    memset(fds, 0, sizeof(fds));
-    fds[0].fd = xsk_socket__fd(xsk_info->xsk);
-    fds[0].events = POLLIN;
+    /* The generator only transmits, nothing needs redirecting to it */
+    for (int i = 0; i < cfg.nr_ports && !cfg.txonly; i++) {
+        if (cfg.adopted)
+            err = setup_xdp_maps(&cfg, &cfg.ports[i], handler, handler_port);
+        else
+            err = load_xdp_prog(&cfg, &cfg.ports[i], handler, handler_port);
+        if (err)
+            return 1;
+    }
+    if (cfg.handover)
+        handover_set_owner(&cfg, getpid());
+    if (cfg.nr_ports > 1)
+        printf("Forwarding between %s and %s\n", cfg.ports[0].ifname, cfg.ports[1].ifname);
+
+    if (cfg.txonly)
+        printf("Sending %s packets on %s queue %d..%d, %s\n",
+               cfg.txgen.tmpl == TXGEN_ICMP ? "icmp" :
+               cfg.txgen.tmpl == TXGEN_UDP ? "udp" : "memcached",
+               cfg.ifname, cfg.xsk_if_queue, cfg.xsk_if_queue + nr_workers - 1,
+               cfg.txgen.rate ? "rate limited" : "no rate limit");
 
     /**************************************************
-    * Main loop
+    * Main loop, one thread per queue
     */
 
-    while (!global_exit) {
-        if (cfg.xsk_poll_mode) {
-            err = poll(fds, nfds, -1);
-            if (err <= 0 || err > 1)
-                continue;
-        }
-        ///////////////handle_receive_packets(xsk_socket);//////////////////
-        unsigned int rcvd, stock_frames, i;
-        uint32_t idx_rx = 0, idx_fq = 0;
-
-        /* peek for descs to cons in batch_size, idx_rx use later */
-        rcvd = xsk_ring_cons__peek(&xsk_info->rx, RX_BATCH_SIZE, &idx_rx);
-        if (!rcvd) {
-            continue;
-        }
-
-        /* Stuff the ring with as much frames as possible
-         * 发现空闲desc了马上处理；
-         */
-
-        /* 查看xsk所属umem的fill ring是否有足够本xsk空闲frame数量的空闲desc，有的话就填充 */
-        stock_frames = xsk_prod_nb_free(&xsk_info->umem->fq, xsk_info->umem_frame_free);
-        if (stock_frames > 0) {
-            err = xsk_ring_prod__reserve(&xsk_info->umem->fq, stock_frames, &idx_fq);
-
-            /* This should not happen, but just in case */
-            /* 但是不至于一直while吧？应该不至于出错，就放这吧，虽然不知道为什么 */
-            while (err != stock_frames) {
-                fprintf(stderr, "Error: This should not happen!!!\n");
-                err = xsk_ring_prod__reserve(&xsk_info->umem->fq, rcvd, &idx_fq);
-            }
-
-            for (i = 0; i < stock_frames; i++) {
-                *xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx_fq++) =
-                        xsk_alloc_umem_frame(xsk_info);
-            }
-
-            xsk_ring_prod__submit(&xsk_info->umem->fq, stock_frames);
-        }
-
-        /* Process received packets */
-        for (i = 0; i < rcvd; i++) {
-            uint64_t addr = xsk_ring_cons__rx_desc(&xsk_info->rx, idx_rx)->addr;
-            uint32_t len = xsk_ring_cons__rx_desc(&xsk_info->rx, idx_rx++)->len;
-
-            /* addr只是对应的偏移量；取具体地址就是用这个函数 */
-            uint8_t *pkt = xsk_umem__get_data(xsk_info->umem->buffer, addr);
-            // 不懂为什么是uint8_t，对应的不是unsigned char吗？
-
-            uint8_t tmp_mac[ETH_ALEN];
-            __be32 tmp_ip;
-            struct ethhdr *eth = (struct ethhdr *) pkt;
-            struct iphdr *ip = (struct iphdr *) (eth + 1);
-            struct icmphdr *icmp = (struct icmphdr *) (ip + 1);
-
-            memcpy(tmp_mac, eth->h_dest, ETH_ALEN);
-            memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
-            memcpy(eth->h_source, tmp_mac, ETH_ALEN);
-
-            memcpy(&tmp_ip, &ip->saddr, sizeof(tmp_ip));
-            memcpy(&ip->saddr, &ip->daddr, sizeof(tmp_ip));
-            memcpy(&ip->daddr, &tmp_ip, sizeof(tmp_ip));
-
-            icmp->type = ICMP_ECHOREPLY;
-
-            /* ip checksum not affected. ignore */
-            // ip->check = compute_ip_checksum(ip);
-
-            icmp->checksum = compute_icmp_checksum(ip, icmp);
-
-            /* Here we sent the packet out of the receive port. Note that
-             * we allocate one entry and schedule it. Your design would be
-             * faster if you do batch processing/transmission */
-
-            uint32_t tx_idx = 0; // 操作tx ring用的，不发送可以不用
-
-            err = xsk_ring_prod__reserve(&xsk_info->tx, 1, &tx_idx);
-            if (err != 1) {
-                /* No more transmit slots, drop the packet */
-                fprintf(stderr, "ERROR: No more transmit slots, drop the packet\n");
-                xsk_free_umem_frame(xsk_info, addr);
-            }
-
-            /* 我们这里直接返回修改后的接收报文，所以复用接收报文的地址和长度即可 */
-            xsk_ring_prod__tx_desc(&xsk_info->tx, tx_idx)->addr = addr;
-            xsk_ring_prod__tx_desc(&xsk_info->tx, tx_idx)->len = len;
-            xsk_ring_prod__submit(&xsk_info->tx, 1);
-
-            /* submit后即成功生产一个TX ring的desc，内核会自动(吧?)消费，即发送该desc */
-
-            xsk_info->outstanding_tx++; // 也就是成功发送的数据包+1
-            xsk_info->stats.tx_bytes += len;
-            xsk_info->stats.tx_packets++;
-            xsk_info->stats.rx_bytes += len;
+    for (int i = 0; i < nr_workers; i++) {
+        err = pthread_create(&workers[i].thread, NULL,
+                             cfg.txonly ? tx_worker : rx_worker, &workers[i]);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed creating worker thread "
+                            "\"%s\"\n", strerror(err));
+            exit(1);
         }
-
-        /* 其实就是移动cons指针 */
-        xsk_ring_cons__release(&xsk_info->rx, rcvd);
-
-
-        xsk_info->stats.rx_packets += rcvd;
-
-        /* Do we need to wake up the kernel for transmission */
-        complete_tx(xsk_info);
-    } // End of while
+    }
+    for (int i = 0; i < nr_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+    /* It still reads the sockets */
+    if (cfg.autotune)
+        pthread_join(autotune_thread, NULL);
+    if (!cfg.txonly && stop_redirect(&cfg))
+        return -1;
+    drain_sockets(&cfg);
+    capture_close(cap);
 
     /* Cleanup */
-    xsk_socket__delete(xsk_info->xsk);
+    for (int i = 0; i < nr_sockets; i++)
+        xsk_socket__delete(sockets[i]->xsk);
+    txgen_destroy(gen, workers[0].xsk->frames);
+    for (int i = 0; i < nr_sockets; i++) {
+        xsk_frame_cache__destroy(sockets[i]->frames);
+        if (sockets[i]->share && !sockets[i]->slot)
+            free(sockets[i]->share);
+        free(sockets[i]);
+    }
     xsk_umem__delete(umem_info->umem);
-    err = bpf_set_link_xdp_fd(cfg.ifindex, -1, cfg.xdp_flags);
-    if (err) {
-        fprintf(stderr, "Error: %s() link set xdp failed (err=%d): %s\n",
-                __func__, err, strerror(-err));
-        return -1;
-    } else {
-        printf("Success: XDP prog detached from device:%s(ifindex:%d)\n",
-               cfg.ifname, cfg.ifindex);
-        return 0;
+    xsk_frame_pool__destroy(umem_info->pool);
+    munmap(umem_info->buffer, umem_info->buffer_size);
+    free(umem_info->rx_ts);
+    /* Our sockets are closed, the successor can bind to the queues */
+    if (handover_exit) {
+        handover_set_owner(&cfg, 0);
+        printf("Handed over\n");
     }
 
     return 0;
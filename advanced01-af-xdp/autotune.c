@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include "autotune.h"
+
+void autotune_init(struct autotune *at, uint32_t min_batch, uint32_t max_batch,
+                   uint32_t fallback) {
+    at->nr_steps = 0;
+    for (uint32_t b = AUTOTUNE_MIN_BATCH; b <= max_batch && at->nr_steps < AUTOTUNE_MAX_STEPS; b <<= 1) {
+        if (b >= min_batch)
+            at->steps[at->nr_steps++].batch = b;
+    }
+    if (!at->nr_steps)
+        at->steps[at->nr_steps++].batch = max_batch;
+    at->fallback = fallback;
+    at->step = 0;
+    at->best = (struct autotune_result) { .batch = fallback };
+}
+
+uint32_t autotune_start(struct autotune *at) {
+    at->step = 0;
+    return at->steps[0].batch;
+}
+
+/* Fastest candidates first, then the lowest latency among them */
+static void autotune_pick(struct autotune *at) {
+    double max_pps = 0;
+
+    for (int i = 0; i < at->nr_steps; i++) {
+        if (at->steps[i].pps > max_pps)
+            max_pps = at->steps[i].pps;
+    }
+
+    at->best = (struct autotune_result) { .batch = at->fallback };
+    if (max_pps <= 0)
+        return;
+    for (int i = 0, found = 0; i < at->nr_steps; i++) {
+        const struct autotune_result *r = &at->steps[i];
+        bool better;
+
+        if (r->pps < max_pps * (1 - AUTOTUNE_PPS_SLACK))
+            continue;
+        if (!found)
+            better = true;
+        else if (r->p99 && at->best.p99)
+            better = r->p99 < at->best.p99;
+        else /* Without samples latency can't break the tie */
+            better = r->pps > at->best.pps;
+        if (better)
+            at->best = *r;
+        found = 1;
+    }
+}
+
+uint32_t autotune_update(struct autotune *at, double pps, uint64_t p99) {
+    if (autotune_settled(at)) {
+        double base = at->best.pps;
+
+        /* Idle since the sweep, or the load changed: measure again */
+        if (!base || pps > base * (1 + AUTOTUNE_DRIFT) || pps < base * (1 - AUTOTUNE_DRIFT))
+            return autotune_start(at);
+        return at->best.batch;
+    }
+
+    at->steps[at->step].pps = pps;
+    at->steps[at->step].p99 = p99;
+    if (++at->step < at->nr_steps)
+        return at->steps[at->step].batch;
+
+    autotune_pick(at);
+    at->step = -1;
+    return at->best.batch;
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _AUTOTUNE_H
+#define _AUTOTUNE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* RX batch size tuning for af_xdp_user --autotune.
+ *
+ * A sweep runs every candidate batch size for one measurement window and
+ * records the packet rate and the p99 RX latency it got. The fastest
+ * candidates, those within AUTOTUNE_PPS_SLACK of the best rate, are then
+ * told apart by latency: under light load every size keeps up, and the
+ * smaller batch that doesn't wait for packets wins. Once settled the rate
+ * keeps being watched, a change of more than AUTOTUNE_DRIFT (the offered
+ * load moved) starts another sweep.
+ *
+ * Only the decisions live here, the caller measures and applies them.
+ */
+
+#define AUTOTUNE_MIN_BATCH  8
+#define AUTOTUNE_MAX_STEPS  16
+#define AUTOTUNE_PPS_SLACK  0.05
+#define AUTOTUNE_DRIFT      0.25
+
+struct autotune_result {
+    uint32_t batch;
+    double pps;
+    uint64_t p99; /* ns, 0 without latency samples */
+};
+
+struct autotune {
+    struct autotune_result steps[AUTOTUNE_MAX_STEPS];
+    int nr_steps;
+    int step;           /* candidate being measured, -1 once settled */
+    uint32_t fallback;  /* used while there is no traffic to measure */
+    struct autotune_result best;
+};
+
+/* Candidates are the powers of two from AUTOTUNE_MIN_BATCH to max_batch,
+ * leaving out those below min_batch */
+void autotune_init(struct autotune *at, uint32_t min_batch, uint32_t max_batch,
+                   uint32_t fallback);
+/* Batch size to measure first */
+uint32_t autotune_start(struct autotune *at);
+/* Result of the window just run, returns the batch size for the next one */
+uint32_t autotune_update(struct autotune *at, double pps, uint64_t p99);
+
+static inline bool autotune_settled(const struct autotune *at) {
+    return at->step < 0;
+}
+
+#endif /* _AUTOTUNE_H */
@@ -0,0 +1,292 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "capture.h"
+
+/* pcapng block types and options, draft-ietf-opsawg-pcapng */
+#define PCAPNG_SHB         0x0A0D0D0A
+#define PCAPNG_IDB         0x00000001
+#define PCAPNG_EPB         0x00000006
+#define PCAPNG_BYTE_ORDER  0x1A2B3C4D
+#define PCAPNG_OPT_END     0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_TSRESOL 9
+#define LINKTYPE_ETHERNET  1
+
+#define PAD4(x) (((x) + 3) & ~3U)
+
+/* Writer publishes its progress to the producer this often */
+#define CAPTURE_TAIL_BATCH 64
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint8_t *put_bytes(uint8_t *p, const void *data, uint32_t len) {
+    memcpy(p, data, len);
+    memset(p + len, 0, PAD4(len) - len);
+    return p + PAD4(len);
+}
+
+static uint64_t clock_ns(clockid_t clk) {
+    struct timespec t;
+
+    clock_gettime(clk, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Space for a block of len bytes in the current file, NULL if there is
+ * no file to write to */
+static uint8_t *capture_reserve(struct capture *cap, uint32_t len) {
+    uint8_t *p;
+
+    if (!cap->map || cap->used + len > cap->cfg.file_size)
+        return NULL;
+    p = cap->map + cap->used;
+    cap->used += len;
+    return p;
+}
+
+static void capture_write_shb(struct capture *cap) {
+    const uint32_t len = 28;
+    uint8_t *p = capture_reserve(cap, len);
+
+    p = put32(p, PCAPNG_SHB);
+    p = put32(p, len);
+    p = put32(p, PCAPNG_BYTE_ORDER);
+    p = put16(p, 1); /* version 1.0 */
+    p = put16(p, 0);
+    p = put32(p, UINT32_MAX); /* section length unknown, -1 */
+    p = put32(p, UINT32_MAX);
+    put32(p, len);
+}
+
+static void capture_write_idb(struct capture *cap, const char *ifname) {
+    uint32_t name_len = strlen(ifname);
+    uint32_t len = 20 + 4 + PAD4(name_len) + 8 + 4;
+    uint8_t tsresol = 9; /* timestamps in ns */
+    uint8_t *p = capture_reserve(cap, len);
+
+    p = put32(p, PCAPNG_IDB);
+    p = put32(p, len);
+    p = put16(p, LINKTYPE_ETHERNET);
+    p = put16(p, 0);
+    p = put32(p, cap->cfg.snaplen);
+    p = put16(p, PCAPNG_OPT_IF_NAME);
+    p = put16(p, name_len);
+    p = put_bytes(p, ifname, name_len);
+    p = put16(p, PCAPNG_OPT_TSRESOL);
+    p = put16(p, 1);
+    p = put_bytes(p, &tsresol, 1);
+    p = put32(p, PCAPNG_OPT_END);
+    put32(p, len);
+}
+
+static int capture_file_open(struct capture *cap) {
+    char path[PATH_MAX];
+    int err;
+
+    if (cap->file_idx)
+        snprintf(path, sizeof(path), "%s.%u", cap->cfg.path, cap->file_idx);
+    else
+        snprintf(path, sizeof(path), "%s", cap->cfg.path);
+
+    cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (cap->fd < 0) {
+        fprintf(stderr, "Error: can't open capture file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    /* Allocate the blocks up front, so writing through the mapping never
+     * waits for the filesystem to find space (or SIGBUSes on ENOSPC) */
+    err = posix_fallocate(cap->fd, 0, cap->cfg.file_size);
+    if (err && err != EOPNOTSUPP) {
+        fprintf(stderr, "Error: can't allocate capture file %s: %s\n", path, strerror(err));
+        goto err;
+    }
+    if (err && ftruncate(cap->fd, cap->cfg.file_size)) {
+        fprintf(stderr, "Error: can't size capture file %s: %s\n", path, strerror(errno));
+        goto err;
+    }
+
+    cap->map = mmap(NULL, cap->cfg.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+    if (cap->map == MAP_FAILED) {
+        fprintf(stderr, "Error: can't mmap capture file %s: %s\n", path, strerror(errno));
+        cap->map = NULL;
+        goto err;
+    }
+    madvise(cap->map, cap->cfg.file_size, MADV_SEQUENTIAL);
+
+    cap->used = 0;
+    capture_write_shb(cap);
+    for (int i = 0; i < cap->nr_ifaces; i++)
+        capture_write_idb(cap, cap->ifnames[i]);
+    return 0;
+
+err:
+    close(cap->fd);
+    cap->fd = -1;
+    return -1;
+}
+
+/* Cut the file down to what was written */
+static void capture_file_close(struct capture *cap) {
+    if (!cap->map)
+        return;
+    munmap(cap->map, cap->cfg.file_size);
+    cap->map = NULL;
+    if (ftruncate(cap->fd, cap->used))
+        fprintf(stderr, "Warning: can't trim capture file: %s\n", strerror(errno));
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+static void capture_write_epb(struct capture *cap, uint32_t if_id,
+                              const struct capture_slot *slot) {
+    uint32_t len = 28 + PAD4(slot->caplen) + 4;
+    uint64_t ts = slot->ts + cap->mono_to_real;
+    uint8_t *p;
+
+    p = capture_reserve(cap, len);
+    if (!p && cap->map) {
+        capture_file_close(cap);
+        cap->file_idx = (cap->file_idx + 1) % cap->cfg.nr_files;
+        if (!capture_file_open(cap))
+            p = capture_reserve(cap, len);
+    }
+    if (!p)
+        return; /* Couldn't open the next file, already reported */
+
+    p = put32(p, PCAPNG_EPB);
+    p = put32(p, len);
+    p = put32(p, if_id);
+    p = put32(p, ts >> 32);
+    p = put32(p, ts);
+    p = put32(p, slot->caplen);
+    p = put32(p, slot->len);
+    p = put_bytes(p, slot->data, slot->caplen);
+    put32(p, len);
+    cap->packets++;
+}
+
+static unsigned int capture_drain(struct capture *cap, struct capture_ring *r) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int n = 0;
+
+    while (tail != head) {
+        const struct capture_slot *slot =
+                (struct capture_slot *) (r->slots + (size_t) (tail & r->mask) * r->slot_size);
+
+        capture_write_epb(cap, r->if_id, slot);
+        tail++;
+        if (++n % CAPTURE_TAIL_BATCH == 0)
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+    return n;
+}
+
+static void *capture_writer(void *arg) {
+    struct capture *cap = arg;
+    unsigned int n;
+    bool stop;
+
+    do {
+        /* Checked before draining, so whatever was committed before
+         * capture_close() makes it into the file */
+        stop = atomic_load(&cap->stop);
+        n = 0;
+        for (int i = 0; i < cap->nr_rings; i++)
+            n += capture_drain(cap, cap->rings[i]);
+        if (!n && !stop)
+            usleep(100);
+    } while (!stop);
+    return NULL;
+}
+
+struct capture *capture_open(const struct capture_cfg *cfg) {
+    struct capture *cap;
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+        return NULL;
+    cap->cfg = *cfg;
+    if (!cap->cfg.nr_files)
+        cap->cfg.nr_files = 1;
+    cap->fd = -1;
+    return cap;
+}
+
+int capture_add_iface(struct capture *cap, const char *ifname) {
+    if (cap->nr_ifaces == CAPTURE_MAX_IFACES)
+        return -1;
+    cap->ifnames[cap->nr_ifaces] = ifname;
+    return cap->nr_ifaces++;
+}
+
+struct capture_ring *capture_add_ring(struct capture *cap, int if_id) {
+    struct capture_ring *r;
+
+    if (cap->nr_rings == CAPTURE_MAX_RINGS)
+        return NULL;
+    r = aligned_alloc(CACHE_LINE_SIZE, sizeof(*r));
+    if (!r)
+        return NULL;
+    memset(r, 0, sizeof(*r));
+    r->mask = CAPTURE_RING_SLOTS - 1;
+    r->snaplen = cap->cfg.snaplen;
+    /* Keep every slot 8 byte aligned for the timestamp */
+    r->slot_size = (sizeof(struct capture_slot) + r->snaplen + 7) & ~7U;
+    r->if_id = if_id;
+    r->slots = malloc((size_t) CAPTURE_RING_SLOTS * r->slot_size);
+    if (!r->slots) {
+        free(r);
+        return NULL;
+    }
+    cap->rings[cap->nr_rings++] = r;
+    return r;
+}
+
+int capture_start(struct capture *cap) {
+    int err;
+
+    cap->mono_to_real = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+    if (capture_file_open(cap))
+        return -1;
+    err = pthread_create(&cap->thread, NULL, capture_writer, cap);
+    if (err) {
+        capture_file_close(cap);
+        return -err;
+    }
+    cap->running = true;
+    return 0;
+}
+
+void capture_close(struct capture *cap) {
+    if (!cap)
+        return;
+    if (cap->running) {
+        atomic_store(&cap->stop, true);
+        pthread_join(cap->thread, NULL);
+        capture_file_close(cap);
+    }
+    for (int i = 0; i < cap->nr_rings; i++) {
+        free(cap->rings[i]->slots);
+        free(cap->rings[i]);
+    }
+    free(cap);
+}
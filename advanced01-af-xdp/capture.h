@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xsk_frame_pool.h" /* CACHE_LINE_SIZE */
+
+/* pcapng capture for af_xdp_user --capture.
+ *
+ * tcpdump never sees packets redirected to AF_XDP, so the RX loop copies
+ * them (up to snaplen bytes) into a single producer single consumer ring
+ * of its own, and one writer thread drains every ring into a pcapng file
+ * that is preallocated and mmap'd. A full ring drops the capture, never
+ * the packet, so the RX loop doesn't wait for the disk. When the file is
+ * full the writer moves on to the next of nr_files files, overwriting the
+ * oldest one like tcpdump -C/-W does.
+ */
+
+#define CAPTURE_MAX_RINGS    64 /* one per socket, MAX_WORKERS * MAX_PORTS */
+#define CAPTURE_MAX_IFACES   2
+#define CAPTURE_RING_SLOTS   1024 /* per ring, power of two */
+
+#define CAPTURE_DEFAULT_SNAPLEN 2048
+#define CAPTURE_DEFAULT_SIZE    64 /* MiB per file */
+#define CAPTURE_DEFAULT_FILES   4
+
+struct capture_cfg {
+    const char *path;  /* first file, the others get .1, .2, ... appended */
+    uint32_t snaplen;
+    uint64_t file_size; /* bytes */
+    uint32_t nr_files;
+};
+
+struct capture_slot {
+    uint64_t ts;      /* CLOCK_MONOTONIC ns */
+    uint32_t caplen;
+    uint32_t len;     /* on the wire, all buffers of a multi-buffer packet */
+    uint8_t data[];   /* snaplen bytes */
+};
+
+struct capture_ring {
+    /* Producer (RX thread) side */
+    uint32_t prod;       /* next slot to fill, published by capture_commit() */
+    uint32_t cons_cache; /* last tail seen */
+    uint32_t mask;
+    uint32_t snaplen;
+    uint32_t slot_size;
+    uint32_t if_id;      /* pcapng interface */
+    uint8_t *slots;
+
+    _Atomic uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+struct capture {
+    struct capture_cfg cfg;
+    struct capture_ring *rings[CAPTURE_MAX_RINGS];
+    int nr_rings;
+    const char *ifnames[CAPTURE_MAX_IFACES];
+    int nr_ifaces;
+
+    /* Writer thread state */
+    pthread_t thread;
+    bool running;
+    _Atomic bool stop;
+    int fd;
+    uint8_t *map;
+    uint64_t used;
+    uint32_t file_idx;
+    uint64_t mono_to_real; /* CLOCK_REALTIME - CLOCK_MONOTONIC, ns */
+    uint64_t packets;
+};
+
+struct capture *capture_open(const struct capture_cfg *cfg);
+/* pcapng interface id of ifname, interfaces must be added before start */
+int capture_add_iface(struct capture *cap, const char *ifname);
+/* Ring for one RX thread, packets captured on it belong to interface if_id */
+struct capture_ring *capture_add_ring(struct capture *cap, int if_id);
+int capture_start(struct capture *cap);
+/* Drain the rings, trim the current file to its content and free it all */
+void capture_close(struct capture *cap);
+
+/* Copy a packet into the ring, false if the ring is full. Only becomes
+ * visible to the writer with the next capture_commit(). */
+static inline bool capture_packet(struct capture_ring *r, uint64_t ts,
+                                  const uint8_t *data, uint32_t caplen,
+                                  uint32_t len) {
+    struct capture_slot *slot;
+
+    if (r->prod - r->cons_cache > r->mask) {
+        r->cons_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (r->prod - r->cons_cache > r->mask)
+            return false;
+    }
+
+    slot = (struct capture_slot *) (r->slots + (size_t) (r->prod & r->mask) * r->slot_size);
+    if (caplen > r->snaplen)
+        caplen = r->snaplen;
+    slot->ts = ts;
+    slot->caplen = caplen;
+    slot->len = len;
+    memcpy(slot->data, data, caplen);
+    r->prod++;
+    return true;
+}
+
+/* Publish the packets added since the last call, once per RX batch */
+static inline void capture_commit(struct capture_ring *r) {
+    atomic_store_explicit(&r->head, r->prod, memory_order_release);
+}
+
+#endif /* _CAPTURE_H */
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _COMMON_H
+#define _COMMON_H
+
+#include <linux/types.h>
+
+/* Shared by af_xdp_kern.c and the userspace side */
+
+/* classifier_map key. af_xdp_kern.c looks up {proto, dport} first, then
+ * {proto, 0} (any port) and finally {0, 0} (any IPv4 packet).
+ */
+struct classifier_key {
+    __u8 proto;  /* IPPROTO_* */
+    __u8 pad;
+    __be16 port; /* UDP/TCP destination port, 0 for any */
+};
+
+/* classifier_map value */
+enum classifier_action {
+    CLASSIFIER_PASS = 0,     /* hand to the kernel stack */
+    CLASSIFIER_REDIRECT = 1, /* redirect to the AF_XDP socket of the queue */
+};
+
+#define CLASSIFIER_MAX_ENTRIES 64
+
+/* xsks_map holds STEER_MAX_SOCKETS slots per queue. Without --steer only
+ * slot 0 is used, the socket bound to the queue. With it af_xdp_user binds
+ * up to STEER_MAX_SOCKETS sockets to every queue, sharing its fill and
+ * completion rings, and the XDP program spreads the queue's flows over
+ * them. An AF_XDP socket only takes packets from the queue it is bound
+ * to, so this balances the workers of a queue, never across queues.
+ */
+#define STEER_MAX_QUEUES  64 /* Assume netdev has no more than 64 queues */
+#define STEER_MAX_SOCKETS 8
+#define XSKS_MAP_KEY(queue, slot) ((queue) * STEER_MAX_SOCKETS + (slot))
+
+/* steer_map: the indirection table, STEER_TABLE_SIZE entries per queue
+ * mapping a flow hash to a slot, like the RSS table of a NIC */
+#define STEER_TABLE_SIZE  64
+#define STEER_TABLE_KEY(queue, hash) ((queue) * STEER_TABLE_SIZE + ((hash) & (STEER_TABLE_SIZE - 1)))
+
+enum steer_mode {
+    STEER_OFF = 0,
+    STEER_FLOW,  /* hash of the 5-tuple */
+    STEER_MCKEY, /* hash of the memcached key, a key always hits the same worker */
+};
+
+/* steer_cfg_map value, a single entry */
+#define STEER_MAX_CPUS 128 /* cpu_map entries */
+
+struct steer_cfg {
+    __u32 mode;    /* enum steer_mode */
+    __u32 nr_cpus; /* cpu_map entries 0 .. nr_cpus - 1 */
+};
+
+/* XDP metadata af_xdp_kern.c puts in front of every redirected packet,
+ * i.e. at data - sizeof(struct xdp_rx_meta) in the UMEM frame. Drivers
+ * without metadata support leave whatever was there before, so userspace
+ * checks the magic and clears it after reading.
+ */
+#define XDP_RX_META_MAGIC 0xaf0d7a3eU
+
+struct xdp_rx_meta {
+    __u32 magic;
+    __u32 pad;
+    __u64 rx_ts; /* bpf_ktime_get_ns(), CLOCK_MONOTONIC */
+};
+
+#endif /* _COMMON_H */
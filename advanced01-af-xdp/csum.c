@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <string.h>
+
+#include "csum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+/* Fold a 64-bit one's complement accumulator to 32 bits */
+static inline uint32_t fold64(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return (uint32_t) sum;
+}
+
+/* Sum of the tail, len < 8. An odd last byte is padded with zero on the
+ * right in network order, i.e. it is the first byte of a 16-bit word. */
+static inline uint64_t csum_tail(const uint8_t *p, size_t len) {
+    uint64_t sum = 0;
+    uint32_t w32;
+    uint16_t w16 = 0;
+
+    if (len & 4) {
+        memcpy(&w32, p, 4);
+        sum += w32;
+        p += 4;
+    }
+    if (len & 2) {
+        memcpy(&w16, p, 2);
+        sum += w16;
+        p += 2;
+    }
+    if (len & 1) {
+        w16 = 0;
+        memcpy(&w16, p, 1);
+        sum += w16;
+    }
+    return sum;
+}
+
+/* 32-bit words into a 64-bit accumulator, carries are folded back at the
+ * end. Good enough for short headers and non-x86 targets. */
+static uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum) {
+    const uint8_t *p = buf;
+    uint64_t acc = sum;
+    uint32_t w[2];
+
+    while (len >= 8) {
+        memcpy(w, p, 8);
+        acc += (uint64_t) w[0] + w[1];
+        p += 8;
+        len -= 8;
+    }
+    acc += csum_tail(p, len);
+
+    return fold64(acc);
+}
+
+static int csum_supported_always(void) {
+    return 1;
+}
+
+#ifdef CSUM_X86
+
+/* The SIMD kernels zero-extend 16-bit words into 32-bit lanes. A lane
+ * overflows after 65537 additions, flush to 64 bits well before that. */
+#define CSUM_SIMD_FLUSH 32768
+
+__attribute__((target("sse2")))
+static uint64_t hsum_epi32_sse2(__m128i v) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i v64 = _mm_add_epi64(_mm_unpacklo_epi32(v, zero),
+                                _mm_unpackhi_epi32(v, zero));
+    uint64_t lanes[2];
+
+    _mm_storeu_si128((__m128i *) lanes, v64);
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("sse2")))
+static uint32_t csum_partial_sse2(const void *buf, size_t len, uint32_t sum) {
+    const uint8_t *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t acc = sum;
+
+    while (len >= 16) {
+        __m128i lo = zero, hi = zero;
+        size_t n = 0;
+
+        for (; len >= 64 && n < CSUM_SIMD_FLUSH; n += 4, p += 64, len -= 64) {
+            __m128i a = _mm_loadu_si128((const __m128i *) p);
+            __m128i b = _mm_loadu_si128((const __m128i *) (p + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *) (p + 32));
+            __m128i d = _mm_loadu_si128((const __m128i *) (p + 48));
+
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(a, zero));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(a, zero));
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(b, zero));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(b, zero));
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(c, zero));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(c, zero));
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(d, zero));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(d, zero));
+        }
+        for (; len >= 16 && n < CSUM_SIMD_FLUSH; n++, p += 16, len -= 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *) p);
+
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(a, zero));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(a, zero));
+        }
+        acc += hsum_epi32_sse2(lo) + hsum_epi32_sse2(hi);
+    }
+
+    return csum_partial_scalar(p, len, fold64(acc));
+}
+
+static int csum_supported_sse2(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2")))
+static uint64_t hsum_epi32_avx2(__m256i v) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i v64 = _mm256_add_epi64(_mm256_unpacklo_epi32(v, zero),
+                                   _mm256_unpackhi_epi32(v, zero));
+    uint64_t lanes[4];
+
+    _mm256_storeu_si256((__m256i *) lanes, v64);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+static uint32_t csum_partial_avx2(const void *buf, size_t len, uint32_t sum) {
+    const uint8_t *p = buf;
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t acc = sum;
+
+    while (len >= 32) {
+        __m256i lo = zero, hi = zero;
+        size_t n = 0;
+
+        for (; len >= 128 && n < CSUM_SIMD_FLUSH; n += 4, p += 128, len -= 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) p);
+            __m256i b = _mm256_loadu_si256((const __m256i *) (p + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *) (p + 64));
+            __m256i d = _mm256_loadu_si256((const __m256i *) (p + 96));
+
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(a, zero));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(a, zero));
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(b, zero));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(b, zero));
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(c, zero));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(c, zero));
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(d, zero));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(d, zero));
+        }
+        for (; len >= 32 && n < CSUM_SIMD_FLUSH; n++, p += 32, len -= 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) p);
+
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(a, zero));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(a, zero));
+        }
+        acc += hsum_epi32_avx2(lo) + hsum_epi32_avx2(hi);
+    }
+    /* Avoid the AVX to SSE transition penalty in the tail code */
+    _mm256_zeroupper();
+
+    return csum_partial_scalar(p, len, fold64(acc));
+}
+
+static int csum_supported_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* CSUM_X86 */
+
+const struct csum_impl csum_impls[] = {
+#ifdef CSUM_X86
+        {"avx2",   csum_partial_avx2,   csum_supported_avx2},
+        {"sse2",   csum_partial_sse2,   csum_supported_sse2},
+#endif
+        {"scalar", csum_partial_scalar, csum_supported_always},
+        {NULL, NULL, NULL}
+};
+
+static const struct csum_impl *csum_selected;
+
+static const struct csum_impl *csum_select(void) {
+    const struct csum_impl *impl;
+
+    for (impl = csum_impls; impl->name; impl++) {
+        if (impl->supported())
+            break;
+    }
+    /* Benign race: every thread would pick the same kernel */
+    __atomic_store_n(&csum_selected, impl, __ATOMIC_RELAXED);
+    return impl;
+}
+
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum) {
+    const struct csum_impl *impl = __atomic_load_n(&csum_selected, __ATOMIC_RELAXED);
+
+    if (!impl)
+        impl = csum_select();
+    return impl->partial(buf, len, sum);
+}
+
+const char *csum_impl_name(void) {
+    const struct csum_impl *impl = __atomic_load_n(&csum_selected, __ATOMIC_RELAXED);
+
+    return (impl ? impl : csum_select())->name;
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _CSUM_H
+#define _CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+
+/* Internet checksum (RFC 1071) for the AF_XDP userspace.
+ *
+ * The one's complement sum doesn't depend on byte order, so data is summed
+ * as host order 16-bit words and the folded result can be stored straight
+ * into a header field. csum_partial() picks the widest SIMD kernel the CPU
+ * supports the first time it is called.
+ */
+
+typedef uint32_t (*csum_partial_fn)(const void *buf, size_t len, uint32_t sum);
+
+struct csum_impl {
+    const char *name;
+    csum_partial_fn partial;
+    int (*supported)(void);
+};
+
+/* Every kernel built in, in order of preference, NULL terminated */
+extern const struct csum_impl csum_impls[];
+
+/* Unfolded 32-bit sum of buf, added to sum */
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum);
+const char *csum_impl_name(void);
+
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+/* Checksum field value for buf, e.g. an ICMP message or an IPv4 header */
+static inline uint16_t ip_compute_csum(const void *buf, size_t len) {
+    return csum_fold(csum_partial(buf, len, 0));
+}
+
+/* RFC 1624 incremental update, eqn. 3: HC' = ~(~HC + ~m + m'), for a
+ * 16-bit word of the covered data changing from old to new. */
+static inline void csum_replace2(uint16_t *sum, uint16_t old, uint16_t new) {
+    uint32_t s = (uint16_t) ~*sum + (uint16_t) ~old + new;
+
+    *sum = csum_fold(s);
+}
+
+static inline void csum_replace4(uint16_t *sum, uint32_t old, uint32_t new) {
+    uint32_t s = (uint16_t) ~*sum;
+
+    s += (uint16_t) ~old + (uint16_t) ~(old >> 16);
+    s += (new & 0xffff) + (new >> 16);
+    *sum = csum_fold(s);
+}
+
+/* Unfolded sum of the IPv4 pseudo header of a TCP/UDP checksum, pass it
+ * as the initial sum when summing the L4 header and payload. Addresses
+ * and len are in network byte order */
+static inline uint32_t csum_ipv4_pseudo(uint32_t saddr, uint32_t daddr,
+                                        uint8_t proto, uint16_t len) {
+    uint64_t sum = (uint64_t) saddr + daddr + htons(proto) + len;
+
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return (uint32_t) sum;
+}
+
+#endif /* _CSUM_H */
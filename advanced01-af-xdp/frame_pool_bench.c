@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Microbenchmark of UMEM frame alloc/free throughput under contention.
+ *
+ * Every thread repeatedly allocates a burst of frames and frees them again,
+ * the way an RX loop refills the fill ring and a completion loop returns
+ * TX frames. The magazine based xsk_frame_pool is compared against the
+ * obvious way of sharing the old LIFO array between threads: a mutex.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xsk_frame_pool.h"
+
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+#define MAX_THREADS     64
+#define MAX_BURST       4096
+
+enum impl {
+    IMPL_POOL,
+    IMPL_MUTEX,
+};
+
+struct config {
+    uint32_t nr_frames;
+    uint32_t frame_size;
+    uint32_t max_threads;
+    uint32_t burst;
+    double duration;
+};
+
+/* The single-threaded LIFO from af_xdp_user.c behind one lock */
+struct mutex_lifo {
+    pthread_mutex_t lock;
+    uint64_t *addr;
+    uint32_t free;
+};
+
+struct bench_ctx {
+    enum impl impl;
+    struct xsk_frame_pool *pool;
+    struct mutex_lifo *lifo;
+    uint32_t burst;
+    volatile bool *stop;
+    pthread_barrier_t *barrier;
+    uint64_t ops;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static uint64_t gettime(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
+}
+
+static uint64_t lifo_alloc(struct mutex_lifo *lifo) {
+    uint64_t frame = INVALID_UMEM_FRAME;
+
+    pthread_mutex_lock(&lifo->lock);
+    if (lifo->free)
+        frame = lifo->addr[--lifo->free];
+    pthread_mutex_unlock(&lifo->lock);
+    return frame;
+}
+
+static void lifo_free(struct mutex_lifo *lifo, uint64_t frame) {
+    pthread_mutex_lock(&lifo->lock);
+    lifo->addr[lifo->free++] = frame;
+    pthread_mutex_unlock(&lifo->lock);
+}
+
+static void *bench_thread(void *arg) {
+    struct bench_ctx *ctx = arg;
+    struct xsk_frame_cache *cache = NULL;
+    uint64_t frames[MAX_BURST];
+    uint64_t ops = 0;
+    uint32_t i, n;
+
+    if (ctx->impl == IMPL_POOL) {
+        cache = xsk_frame_cache__create(ctx->pool);
+        if (!cache)
+            exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(ctx->barrier);
+
+    while (!*ctx->stop) {
+        for (n = 0; n < ctx->burst; n++) {
+            frames[n] = ctx->impl == IMPL_POOL ?
+                        xsk_frame_cache__alloc(cache) : lifo_alloc(ctx->lifo);
+            if (frames[n] == INVALID_UMEM_FRAME)
+                break;
+        }
+        for (i = 0; i < n; i++) {
+            if (ctx->impl == IMPL_POOL)
+                xsk_frame_cache__free(cache, frames[i]);
+            else
+                lifo_free(ctx->lifo, frames[i]);
+        }
+        ops += 2 * n;
+    }
+
+    xsk_frame_cache__destroy(cache);
+    ctx->ops = ops;
+    return NULL;
+}
+
+/* After a run every frame must be back in the pool exactly once */
+static int pool_verify(struct xsk_frame_pool *pool) {
+    struct xsk_frame_cache *cache = xsk_frame_cache__create(pool);
+    uint8_t *seen = calloc(pool->nr_frames, 1);
+    uint32_t count = 0;
+    uint64_t frame;
+    int err = 0;
+
+    if (!cache || !seen) {
+        fprintf(stderr, "Error: verify setup failed\n");
+        return -1;
+    }
+
+    while ((frame = xsk_frame_cache__alloc(cache)) != INVALID_UMEM_FRAME) {
+        uint64_t idx = frame / pool->frame_size;
+
+        if (frame % pool->frame_size || idx >= pool->nr_frames || seen[idx]) {
+            fprintf(stderr, "Error: bad or duplicated frame 0x%lx\n", frame);
+            err = -1;
+            break;
+        }
+        seen[idx] = 1;
+        count++;
+    }
+    if (!err && count != pool->nr_frames) {
+        fprintf(stderr, "Error: lost frames, got %u of %u\n",
+                count, pool->nr_frames);
+        err = -1;
+    }
+
+    free(seen);
+    xsk_frame_cache__destroy(cache);
+    return err;
+}
+
+static int run(struct config *cfg, enum impl impl, uint32_t nr_threads) {
+    struct bench_ctx ctx[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    pthread_barrier_t barrier;
+    struct mutex_lifo lifo = {0};
+    struct xsk_frame_pool *pool = NULL;
+    volatile bool stop = false;
+    uint64_t start, end, ops = 0;
+    uint32_t i;
+    int err = 0;
+
+    if (impl == IMPL_POOL) {
+        pool = xsk_frame_pool__create(cfg->nr_frames, cfg->frame_size,
+                                      nr_threads + 1);
+        if (!pool) {
+            fprintf(stderr, "Error: Can't create frame pool\n");
+            return -1;
+        }
+    } else {
+        pthread_mutex_init(&lifo.lock, NULL);
+        lifo.addr = calloc(cfg->nr_frames, sizeof(*lifo.addr));
+        for (i = 0; i < cfg->nr_frames; i++)
+            lifo.addr[i] = (uint64_t) i * cfg->frame_size;
+        lifo.free = cfg->nr_frames;
+    }
+
+    pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+    for (i = 0; i < nr_threads; i++) {
+        ctx[i] = (struct bench_ctx) {
+                .impl = impl,
+                .pool = pool,
+                .lifo = &lifo,
+                .burst = cfg->burst,
+                .stop = &stop,
+                .barrier = &barrier,
+        };
+        if (pthread_create(&threads[i], NULL, bench_thread, &ctx[i])) {
+            fprintf(stderr, "Error: pthread_create failed \"%s\"\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = gettime();
+    usleep(cfg->duration * 1000000);
+    stop = true;
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+        ops += ctx[i].ops;
+    }
+    end = gettime();
+
+    printf("%-6s threads:%-3u burst:%-5u %'10.2f Mops/s\n",
+           impl == IMPL_POOL ? "pool" : "mutex", nr_threads, cfg->burst,
+           (double) ops / (end - start) * NANOSEC_PER_SEC / 1000000);
+
+    if (impl == IMPL_POOL) {
+        err = pool_verify(pool);
+        xsk_frame_pool__destroy(pool);
+    } else {
+        free(lifo.addr);
+        pthread_mutex_destroy(&lifo.lock);
+    }
+    pthread_barrier_destroy(&barrier);
+    return err;
+}
+
+static void usage(char *name) {
+    printf("usage %s [options] \n\n"
+           "-t, --threads <n>\tRun with 1, 2, 4 ... up to <n> threads, default nproc\n"
+           "-b, --burst <n>\t\tFrames allocated then freed per round, default 64\n"
+           "-n, --frames <n>\tFrames in the pool, default 4096\n"
+           "-f, --frame-size <n>\tFrame size, default 4096\n"
+           "-D, --duration <sec>\tSeconds per run, default 1\n"
+           "-h, --help\t\tthis text you see right here\n", name);
+}
+
+int main(int argc, char **argv) {
+    struct config cfg = {
+            .nr_frames = 4096,
+            .frame_size = 4096,
+            .max_threads = sysconf(_SC_NPROCESSORS_ONLN),
+            .burst = 64,
+            .duration = 1,
+    };
+    struct option long_options[] = {{"threads",    required_argument, 0, 't'},
+                                    {"burst",      required_argument, 0, 'b'},
+                                    {"frames",     required_argument, 0, 'n'},
+                                    {"frame-size", required_argument, 0, 'f'},
+                                    {"duration",   required_argument, 0, 'D'},
+                                    {"help",       no_argument,       0, 'h'},
+                                    {0, 0, 0, 0}
+    };
+    uint32_t threads;
+    int c, option_index;
+
+    while ((c = getopt_long(argc, argv, "t:b:n:f:D:h", long_options, &option_index)) != EOF) {
+        switch (c) {
+            case 't':
+                cfg.max_threads = atoi(optarg);
+                break;
+            case 'b':
+                cfg.burst = atoi(optarg);
+                break;
+            case 'n':
+                cfg.nr_frames = atoi(optarg);
+                break;
+            case 'f':
+                cfg.frame_size = atoi(optarg);
+                break;
+            case 'D':
+                cfg.duration = atof(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (cfg.max_threads < 1 || cfg.max_threads > MAX_THREADS ||
+        cfg.burst < 1 || cfg.burst > MAX_BURST || !cfg.nr_frames ||
+        !cfg.frame_size || cfg.duration <= 0) {
+        fprintf(stderr, "Error: invalid arguments\n");
+        usage(argv[0]);
+        return -1;
+    }
+
+    /* Trick to pretty printf with thousands separators use %' */
+    setlocale(LC_NUMERIC, "en_US");
+
+    for (threads = 1;; threads <<= 1) {
+        if (threads > cfg.max_threads)
+            threads = cfg.max_threads;
+        if (run(&cfg, IMPL_POOL, threads) || run(&cfg, IMPL_MUTEX, threads))
+            return 1;
+        if (threads == cfg.max_threads)
+            break;
+    }
+    return 0;
+}
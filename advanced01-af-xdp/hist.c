@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include "hist.h"
+
+/* Largest value falling into bucket b */
+static uint64_t hist_bucket_max(unsigned int b) {
+    unsigned int e, sub;
+
+    if (b < (1U << HIST_SUB_BITS))
+        return b;
+
+    e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    sub = b & ((1U << HIST_SUB_BITS) - 1);
+    return (((1ULL << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_snapshot_add(struct hist_snapshot *s, const struct hist *h) {
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        uint64_t n = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+
+        s->counts[b] += n;
+        s->total += n;
+    }
+}
+
+void hist_snapshot_sub(struct hist_snapshot *out, const struct hist_snapshot *cur,
+                       const struct hist_snapshot *prev) {
+    out->total = 0;
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        out->counts[b] = cur->counts[b] - prev->counts[b];
+        out->total += out->counts[b];
+    }
+}
+
+uint64_t hist_percentile(const struct hist_snapshot *s, double p) {
+    uint64_t rank, seen = 0;
+    double r;
+
+    if (!s->total)
+        return 0;
+
+    /* Nearest rank, ceil(total * p / 100) */
+    r = s->total * p / 100.0;
+    rank = (uint64_t) r;
+    if (rank < r)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > s->total)
+        rank = s->total;
+
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        seen += s->counts[b];
+        if (seen >= rank)
+            return hist_bucket_max(b);
+    }
+    return hist_bucket_max(HIST_BUCKETS - 1);
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Log-linear latency histogram.
+ *
+ * Values below 2^HIST_SUB_BITS get a bucket each, above that every power
+ * of two is split into 2^HIST_SUB_BITS linear buckets, so a bucket is at
+ * most 1/16 (6.25%) wide relative to its value. Recording is a single
+ * relaxed atomic add, any number of threads may record while another one
+ * takes snapshots.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 40 /* values are clamped to 2^40 - 1, ~18 minutes in ns */
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+};
+
+struct hist_snapshot {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+};
+
+static inline unsigned int hist_bucket(uint64_t v) {
+    unsigned int e;
+
+    if (v < (1ULL << HIST_SUB_BITS))
+        return v;
+    if (v >= (1ULL << HIST_MAX_BITS))
+        v = (1ULL << HIST_MAX_BITS) - 1;
+
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((v >> (e - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+}
+
+static inline void hist_record(struct hist *h, uint64_t v) {
+    atomic_fetch_add_explicit(&h->counts[hist_bucket(v)], 1, memory_order_relaxed);
+}
+
+/* hist_record() for a histogram only the calling thread records into, a
+ * plain load and store instead of a locked add */
+static inline void hist_record_single(struct hist *h, uint64_t v) {
+    _Atomic uint64_t *c = &h->counts[hist_bucket(v)];
+
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+/* Add the current counts of h to s */
+void hist_snapshot_add(struct hist_snapshot *s, const struct hist *h);
+/* out = cur - prev, the samples recorded between two snapshots */
+void hist_snapshot_sub(struct hist_snapshot *out, const struct hist_snapshot *cur,
+                       const struct hist_snapshot *prev);
+/* Upper bound of the bucket holding the p-th percentile (0 < p <= 100),
+ * 0 if there are no samples */
+uint64_t hist_percentile(const struct hist_snapshot *s, double p);
+
+#endif /* _HIST_H */
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "mc_table.h"
+
+/* Items start 8 byte aligned, offset 0 stays unused so that it can mean
+ * "no item" */
+#define MC_ITEM_ALIGN 8
+
+/* FNV-1a, the low bits pick the bucket, the high half is the tag */
+static inline uint64_t mc_hash(const char *key, uint32_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t) key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline uint32_t mc_tag(uint64_t hash) {
+    return (hash >> 32) | 1;
+}
+
+static inline const struct mc_item *mc_item_at(const struct mc_table *t, uint32_t off) {
+    return (const struct mc_item *) (t->arena + off);
+}
+
+struct mc_table *mc_table_create(uint32_t nr_buckets, uint64_t arena_size) {
+    struct mc_table *t;
+    uint32_t n = 1;
+
+    while (n < nr_buckets)
+        n <<= 1;
+    if (arena_size > UINT32_MAX)
+        arena_size = UINT32_MAX;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->mask = n - 1;
+    t->buckets = aligned_alloc(CACHE_LINE_SIZE, (size_t) n * sizeof(*t->buckets));
+    if (!t->buckets)
+        goto err;
+    memset(t->buckets, 0, (size_t) n * sizeof(*t->buckets));
+
+    /* Untouched arena pages cost nothing */
+    t->arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t->arena == MAP_FAILED)
+        goto err;
+    t->arena_size = arena_size;
+    t->arena_used = MC_ITEM_ALIGN;
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+
+err:
+    free(t->buckets);
+    free(t);
+    return NULL;
+}
+
+void mc_table_destroy(struct mc_table *t) {
+    if (!t)
+        return;
+    munmap(t->arena, t->arena_size);
+    free(t->buckets);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+const struct mc_item *mc_table_get(const struct mc_table *t, const char *key,
+                                   uint32_t key_len) {
+    uint64_t hash = mc_hash(key, key_len);
+    uint32_t tag = mc_tag(hash);
+    uint32_t b = hash & t->mask;
+
+    for (uint32_t probe = 0; probe <= t->mask; probe++, b = (b + 1) & t->mask) {
+        struct mc_bucket *bucket = &t->buckets[b];
+
+        for (int i = 0; i < MC_BUCKET_SLOTS; i++) {
+            /* Acquire pairs with the release in mc_table_set(), a tag seen
+             * here means its item is fully written */
+            uint32_t slot_tag = atomic_load_explicit(&bucket->tags[i], memory_order_acquire);
+            const struct mc_item *item;
+
+            if (!slot_tag)
+                return NULL; /* Buckets fill up in order, no deletions */
+            if (slot_tag != tag)
+                continue;
+            item = mc_item_at(t, atomic_load_explicit(&bucket->items[i], memory_order_acquire));
+            if (item->key_len == key_len && !memcmp(item->data, key, key_len))
+                return item;
+        }
+    }
+    return NULL;
+}
+
+/* Render a new item, with t->lock held */
+static uint32_t mc_item_create(struct mc_table *t, const char *key, uint32_t key_len,
+                               uint32_t flags, const void *value, uint32_t value_len) {
+    char hdr[MC_KEY_MAX + 64];
+    struct mc_item *item;
+    uint32_t hdr_len, size, off;
+
+    hdr_len = snprintf(hdr, sizeof(hdr), "VALUE %.*s %u %u\r\n",
+                       (int) key_len, key, flags, value_len);
+    size = sizeof(*item) + key_len + hdr_len + value_len + 2;
+    size = (size + MC_ITEM_ALIGN - 1) & ~(MC_ITEM_ALIGN - 1);
+    if (t->arena_used + size > t->arena_size)
+        return 0;
+
+    off = t->arena_used;
+    t->arena_used += size;
+    item = (struct mc_item *) (t->arena + off);
+    item->key_len = key_len;
+    item->value_len = hdr_len + value_len + 2;
+    memcpy(item->data, key, key_len);
+    memcpy(item->data + key_len, hdr, hdr_len);
+    memcpy(item->data + key_len + hdr_len, value, value_len);
+    memcpy(item->data + key_len + hdr_len + value_len, "\r\n", 2);
+    return off;
+}
+
+int mc_table_set(struct mc_table *t, const char *key, uint32_t key_len,
+                 uint32_t flags, const void *value, uint32_t value_len) {
+    uint64_t hash = mc_hash(key, key_len);
+    uint32_t tag = mc_tag(hash);
+    uint32_t b = hash & t->mask;
+    uint32_t off;
+    int err = -ENOMEM;
+
+    if (!key_len || key_len > MC_KEY_MAX || value_len > MC_VALUE_MAX)
+        return -E2BIG;
+
+    pthread_mutex_lock(&t->lock);
+    off = mc_item_create(t, key, key_len, flags, value, value_len);
+    if (!off)
+        goto out;
+
+    for (uint32_t probe = 0; probe <= t->mask; probe++, b = (b + 1) & t->mask) {
+        struct mc_bucket *bucket = &t->buckets[b];
+
+        for (int i = 0; i < MC_BUCKET_SLOTS; i++) {
+            uint32_t slot_tag = atomic_load_explicit(&bucket->tags[i], memory_order_relaxed);
+            const struct mc_item *old;
+
+            if (!slot_tag) {
+                /* New key, publish the item before the tag */
+                atomic_store_explicit(&bucket->items[i], off, memory_order_relaxed);
+                atomic_store_explicit(&bucket->tags[i], tag, memory_order_release);
+                err = 0;
+                goto out;
+            }
+            if (slot_tag != tag)
+                continue;
+            old = mc_item_at(t, atomic_load_explicit(&bucket->items[i], memory_order_relaxed));
+            if (old->key_len == key_len && !memcmp(old->data, key, key_len)) {
+                atomic_store_explicit(&bucket->items[i], off, memory_order_release);
+                err = 0;
+                goto out;
+            }
+        }
+    }
+    /* Table full, take the item back */
+    t->arena_used = off;
+out:
+    pthread_mutex_unlock(&t->lock);
+    return err;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _MC_TABLE_H
+#define _MC_TABLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "xsk_frame_pool.h" /* CACHE_LINE_SIZE */
+
+/* Key/value store of the memcached handler.
+ *
+ * Open addressing over cache line sized buckets: a bucket holds the 32-bit
+ * hash tags and arena offsets of MC_BUCKET_SLOTS items, so a lookup
+ * usually reads one bucket line and one item. Full buckets spill over to
+ * the next one (linear probing), there are no deletions.
+ *
+ * Items are bump allocated from one arena and never change once
+ * published. An item keeps the key and the complete "VALUE" block of a
+ * get reply, so a hit is answered with a single memcpy. SET allocates a
+ * new item and swaps the offset in the bucket, the old one is leaked
+ * until the process exits. GETs don't lock, SETs take a mutex.
+ */
+
+#define MC_BUCKET_SLOTS 8
+#define MC_KEY_MAX      250  /* memcached's limit */
+#define MC_VALUE_MAX    1024 /* replies must fit into one UMEM frame */
+
+#define MC_DEFAULT_BUCKETS (1U << 16) /* 512K items */
+#define MC_DEFAULT_ARENA   (64ULL << 20)
+
+struct mc_bucket {
+    _Atomic uint32_t tags[MC_BUCKET_SLOTS];  /* 0 is a free slot */
+    _Atomic uint32_t items[MC_BUCKET_SLOTS]; /* offset into the arena */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct mc_item {
+    uint16_t key_len;
+    uint16_t value_len; /* of the VALUE block */
+    char data[];        /* key, then "VALUE <key> <flags> <bytes>\r\n<data>\r\n" */
+};
+
+struct mc_table {
+    struct mc_bucket *buckets;
+    uint32_t mask;
+
+    pthread_mutex_t lock; /* writers */
+    uint8_t *arena;
+    uint64_t arena_size;
+    uint64_t arena_used;
+};
+
+/* nr_buckets is rounded up to a power of two */
+struct mc_table *mc_table_create(uint32_t nr_buckets, uint64_t arena_size);
+void mc_table_destroy(struct mc_table *t);
+
+const struct mc_item *mc_table_get(const struct mc_table *t, const char *key,
+                                   uint32_t key_len);
+/* 0, -E2BIG for keys or values over the limits, -ENOMEM when the arena or
+ * the table is full */
+int mc_table_set(struct mc_table *t, const char *key, uint32_t key_len,
+                 uint32_t flags, const void *value, uint32_t value_len);
+
+static inline const char *mc_item_value(const struct mc_item *item) {
+    return item->data + item->key_len;
+}
+
+#endif /* _MC_TABLE_H */
@@ -0,0 +1,379 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <linux/in.h>
+#include <linux/icmp.h>
+#include <linux/udp.h>
+
+#include "csum.h"
+#include "mc_table.h"
+#include "pkt_handler.h"
+#include "txgen.h" /* TXGEN_KEY_LEN */
+
+/*************************************************************************
+ * icmp_echo: answer IPv4 pings
+ */
+
+static bool icmp_echo_classify(const uint8_t *pkt, uint32_t len, uint32_t pkt_len) {
+    struct icmphdr *icmp;
+    struct iphdr *ip;
+
+    ip = pkt_ipv4(pkt, len, IPPROTO_ICMP, (uint8_t **) &icmp);
+    if (!ip || (uint8_t *) (icmp + 1) > pkt + len)
+        return false;
+    /* Don't echo truncated requests, a large ping goes on in the next
+     * buffers with --multi-buffer */
+    if (sizeof(struct ethhdr) + ntohs(ip->tot_len) > pkt_len)
+        return false;
+
+    return icmp->type == ICMP_ECHO;
+}
+
+static void icmp_echo_process(struct pkt_desc *descs, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        struct ethhdr *eth = (struct ethhdr *) descs[i].data;
+        struct iphdr *ip = (struct iphdr *) (eth + 1);
+        struct icmphdr *icmp = (struct icmphdr *) ((uint8_t *) ip + ip->ihl * 4);
+        uint16_t old_word, new_word;
+
+        swap_mac(eth);
+        swap_ipv4(ip);
+
+        /* Only the type changes, so patch the checksum (RFC 1624) instead
+         * of summing the whole payload again. ip checksum not affected */
+        memcpy(&old_word, icmp, sizeof(old_word));
+        icmp->type = ICMP_ECHOREPLY;
+        memcpy(&new_word, icmp, sizeof(new_word));
+        csum_replace2(&icmp->checksum, old_word, new_word);
+
+        descs[i].verdict = PKT_VERDICT_TX;
+    }
+}
+
+/*************************************************************************
+ * udp_echo: send UDP datagrams back to where they came from
+ */
+
+static uint16_t udp_echo_port;
+
+static int udp_echo_init(const struct pkt_handler_opts *opts) {
+    udp_echo_port = opts->port ? opts->port : 7;
+    return 0;
+}
+
+static bool udp_echo_classify(const uint8_t *pkt, uint32_t len, uint32_t pkt_len) {
+    struct udphdr *udp;
+
+    if (!pkt_ipv4(pkt, len, IPPROTO_UDP, (uint8_t **) &udp) ||
+        (uint8_t *) (udp + 1) > pkt + len)
+        return false;
+
+    return udp->dest == htons(udp_echo_port);
+}
+
+static void udp_echo_process(struct pkt_desc *descs, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        struct ethhdr *eth = (struct ethhdr *) descs[i].data;
+        struct iphdr *ip = (struct iphdr *) (eth + 1);
+        struct udphdr *udp = (struct udphdr *) ((uint8_t *) ip + ip->ihl * 4);
+        __be16 tmp_port;
+
+        swap_mac(eth);
+        swap_ipv4(ip);
+
+        tmp_port = udp->source;
+        udp->source = udp->dest;
+        udp->dest = tmp_port;
+
+        /* Swapping addresses and ports doesn't change the one's complement
+         * sums, both checksums stay valid */
+        descs[i].verdict = PKT_VERDICT_TX;
+    }
+}
+
+/*************************************************************************
+ * drop: count and drop everything, for RX only benchmarks
+ */
+
+static bool drop_classify(const uint8_t *pkt, uint32_t len, uint32_t pkt_len) {
+    return true;
+}
+
+static void drop_process(struct pkt_desc *descs, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++)
+        descs[i].verdict = PKT_VERDICT_DROP;
+}
+
+/*************************************************************************
+ * fwd: hand everything to the forwarding port (--fwd), which rewrites the
+ * MAC addresses if configured to
+ */
+
+static bool fwd_classify(const uint8_t *pkt, uint32_t len, uint32_t pkt_len) {
+    return true;
+}
+
+static void fwd_process(struct pkt_desc *descs, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++)
+        descs[i].verdict = PKT_VERDICT_FWD;
+}
+
+/*************************************************************************
+ * memcached: answer memcached UDP get/set from mc_table, replies are
+ * written over the request in its own frame
+ */
+
+#define MC_DEFAULT_PORT   11211
+#define MC_GET_MAX_KEYS   32
+#define MC_PRELOAD_VALUE  32 /* bytes, like nicache's MAX_VAL_LENGTH */
+
+static uint16_t mc_port;
+static struct mc_table *mc_table;
+
+/* Keys and values --template memcached asks for, so that the two can be
+ * benchmarked against each other */
+static int mc_preload(uint32_t nr) {
+    char key[TXGEN_KEY_LEN + 1], value[MC_PRELOAD_VALUE + 1];
+
+    for (uint32_t k = 0; k < nr; k++) {
+        snprintf(key, sizeof(key), "%0*u", TXGEN_KEY_LEN, k);
+        snprintf(value, sizeof(value), "%0*u", MC_PRELOAD_VALUE, k);
+        if (mc_table_set(mc_table, key, TXGEN_KEY_LEN, 0, value, MC_PRELOAD_VALUE))
+            return -1;
+    }
+    return 0;
+}
+
+static int mc_init(const struct pkt_handler_opts *opts) {
+    mc_port = opts->port ? opts->port : MC_DEFAULT_PORT;
+    mc_table = mc_table_create(MC_DEFAULT_BUCKETS, MC_DEFAULT_ARENA);
+    if (!mc_table)
+        return -1;
+    if (mc_preload(opts->mc_preload)) {
+        fprintf(stderr, "Error: memcached table full after preloading\n");
+        return -1;
+    }
+    return 0;
+}
+
+static bool mc_classify(const uint8_t *pkt, uint32_t len, uint32_t pkt_len) {
+    struct udphdr *udp;
+
+    if (!pkt_ipv4(pkt, len, IPPROTO_UDP, (uint8_t **) &udp) ||
+        (uint8_t *) (udp + 1) + sizeof(struct memcached_udp_header) > pkt + len)
+        return false;
+
+    return udp->dest == htons(mc_port);
+}
+
+/* Next space separated token of [*p, end), NULL if there is none */
+static const char *mc_token(const char **p, const char *end, uint32_t *len) {
+    const char *tok = *p;
+
+    while (tok < end && *tok == ' ')
+        tok++;
+    *p = tok;
+    while (*p < end && **p != ' ')
+        (*p)++;
+    *len = *p - tok;
+    return *len ? tok : NULL;
+}
+
+static bool mc_parse_u32(const char *tok, uint32_t len, uint32_t *val) {
+    uint64_t v = 0;
+
+    if (!tok || !len || len > 10)
+        return false;
+    for (uint32_t i = 0; i < len; i++) {
+        if (tok[i] < '0' || tok[i] > '9')
+            return false;
+        v = v * 10 + tok[i] - '0';
+    }
+    if (v > UINT32_MAX)
+        return false;
+    *val = v;
+    return true;
+}
+
+static uint32_t mc_reply_str(char *out, const char *str) {
+    uint32_t len = strlen(str);
+
+    memcpy(out, str, len);
+    return len;
+}
+
+/* "get <key>*", all keys are looked up before out overwrites them. Hits
+ * that don't fit into the frame are left out. */
+static uint32_t mc_get(const char *args, const char *end, char *out, uint32_t room) {
+    const struct mc_item *items[MC_GET_MAX_KEYS];
+    unsigned int nr = 0;
+    uint32_t len = 0, key_len;
+    const char *key;
+
+    while (nr < MC_GET_MAX_KEYS && (key = mc_token(&args, end, &key_len))) {
+        items[nr] = mc_table_get(mc_table, key, key_len);
+        if (items[nr])
+            nr++;
+    }
+
+    for (unsigned int i = 0; i < nr; i++) {
+        if (len + items[i]->value_len + 5 > room)
+            break;
+        memcpy(out + len, mc_item_value(items[i]), items[i]->value_len);
+        len += items[i]->value_len;
+    }
+    return len + mc_reply_str(out + len, "END\r\n");
+}
+
+/* "set <key> <flags> <exptime> <bytes> [noreply]\r\n<data>\r\n", exptime
+ * is ignored. Returns 0 for noreply. */
+static uint32_t mc_set(const char *args, const char *line_end, const char *end,
+                       char *out) {
+    const char *key, *tok, *data = line_end + 2;
+    uint32_t key_len, len, flags, exptime, bytes;
+    int err;
+
+    key = mc_token(&args, line_end, &key_len);
+    tok = mc_token(&args, line_end, &len);
+    if (!key || !mc_parse_u32(tok, len, &flags))
+        return mc_reply_str(out, "CLIENT_ERROR bad command line format\r\n");
+    tok = mc_token(&args, line_end, &len);
+    if (!mc_parse_u32(tok, len, &exptime))
+        return mc_reply_str(out, "CLIENT_ERROR bad command line format\r\n");
+    tok = mc_token(&args, line_end, &len);
+    if (!mc_parse_u32(tok, len, &bytes))
+        return mc_reply_str(out, "CLIENT_ERROR bad command line format\r\n");
+    if (bytes > end - data || end - data - bytes < 2 || memcmp(data + bytes, "\r\n", 2))
+        return mc_reply_str(out, "CLIENT_ERROR bad data chunk\r\n");
+
+    err = mc_table_set(mc_table, key, key_len, flags, data, bytes);
+    tok = mc_token(&args, line_end, &len);
+    if (tok && len == 7 && !memcmp(tok, "noreply", 7))
+        return 0;
+    if (err == -E2BIG)
+        return mc_reply_str(out, "SERVER_ERROR object too large for cache\r\n");
+    if (err)
+        return mc_reply_str(out, "SERVER_ERROR out of memory storing object\r\n");
+    return mc_reply_str(out, "STORED\r\n");
+}
+
+static void mc_process(struct pkt_desc *descs, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        struct pkt_desc *desc = &descs[i];
+        struct ethhdr *eth = (struct ethhdr *) desc->data;
+        struct iphdr *ip = (struct iphdr *) (eth + 1);
+        struct udphdr *udp = (struct udphdr *) ((uint8_t *) ip + ip->ihl * 4);
+        struct memcached_udp_header *mc = (struct memcached_udp_header *) (udp + 1);
+        char *payload = (char *) (mc + 1), *line_end;
+        uint32_t hdrs = payload - (char *) desc->data, plen, room, len;
+        __be16 tmp_port;
+
+        desc->verdict = PKT_VERDICT_DROP;
+        /* Requests spanning several datagrams or buffers aren't served */
+        if (desc->nr_frags > 1 || mc->num_dgram != htons(1) ||
+            ntohs(udp->len) < sizeof(*udp) + sizeof(*mc) ||
+            (uint8_t *) udp + ntohs(udp->len) > desc->data + desc->len)
+            continue;
+        plen = ntohs(udp->len) - sizeof(*udp) - sizeof(*mc);
+        line_end = memchr(payload, '\n', plen);
+        if (line_end && (line_end == payload || *--line_end != '\r'))
+            line_end = NULL;
+        if (!line_end || desc->room <= hdrs)
+            continue;
+        room = desc->room - hdrs;
+
+        if (line_end - payload >= 4 && !memcmp(payload, "get ", 4))
+            len = mc_get(payload + 4, line_end, payload, room);
+        else if (line_end - payload >= 4 && !memcmp(payload, "set ", 4))
+            len = mc_set(payload + 4, line_end, payload + plen, payload);
+        else
+            len = mc_reply_str(payload, "ERROR\r\n");
+        if (!len)
+            continue; /* noreply */
+
+        swap_mac(eth);
+        swap_ipv4(ip);
+        tmp_port = udp->source;
+        udp->source = udp->dest;
+        udp->dest = tmp_port;
+
+        mc->seq_num = 0;
+        mc->num_dgram = htons(1);
+        udp->len = htons(sizeof(*udp) + sizeof(*mc) + len);
+        udp->check = 0; /* optional over IPv4 */
+        ip->tot_len = htons(ip->ihl * 4 + ntohs(udp->len));
+        ip->check = 0;
+        ip->check = ip_compute_csum(ip, ip->ihl * 4);
+
+        desc->len = hdrs + len;
+        desc->verdict = PKT_VERDICT_TX;
+    }
+}
+
+/*************************************************************************
+ * Registry
+ */
+
+static const struct pkt_handler pkt_handlers[] = {
+        {
+                .name = "icmp_echo",
+                .help = "Reply to ICMP echo requests (default)",
+                .proto = IPPROTO_ICMP,
+                .classify = icmp_echo_classify,
+                .process = icmp_echo_process,
+        },
+        {
+                .name = "udp_echo",
+                .help = "Echo UDP datagrams sent to --port (default 7)",
+                .proto = IPPROTO_UDP,
+                .default_port = 7,
+                .init = udp_echo_init,
+                .classify = udp_echo_classify,
+                .process = udp_echo_process,
+        },
+        {
+                .name = "drop",
+                .help = "Drop every IPv4 packet (RX only benchmark)",
+                .proto = 0,
+                .classify = drop_classify,
+                .process = drop_process,
+        },
+        {
+                .name = "memcached",
+                .help = "Serve memcached UDP get/set on --port (default 11211)",
+                .proto = IPPROTO_UDP,
+                .default_port = MC_DEFAULT_PORT,
+                .init = mc_init,
+                .classify = mc_classify,
+                .process = mc_process,
+        },
+        {
+                .name = "fwd",
+                .help = "Forward every IPv4 packet out the other port (default with --fwd)",
+                .proto = 0,
+                .classify = fwd_classify,
+                .process = fwd_process,
+        },
+};
+
+const struct pkt_handler *pkt_handler_find(const char *name) {
+    for (unsigned int i = 0; i < sizeof(pkt_handlers) / sizeof(pkt_handlers[0]); i++) {
+        if (!strcmp(pkt_handlers[i].name, name))
+            return &pkt_handlers[i];
+    }
+    return NULL;
+}
+
+const struct pkt_handler *pkt_handler_get(unsigned int i) {
+    if (i >= sizeof(pkt_handlers) / sizeof(pkt_handlers[0]))
+        return NULL;
+    return &pkt_handlers[i];
+}
+
+void pkt_handler_list(FILE *out) {
+    for (unsigned int i = 0; i < sizeof(pkt_handlers) / sizeof(pkt_handlers[0]); i++)
+        fprintf(out, "\t\t\t  %-10s %s\n", pkt_handlers[i].name, pkt_handlers[i].help);
+}
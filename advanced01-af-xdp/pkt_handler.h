@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _PKT_HANDLER_H
+#define _PKT_HANDLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+
+/* Packet handlers plugged into the af_xdp_user RX loop.
+ *
+ * For every RX batch the loop calls classify() on each packet, frees the
+ * frames it rejects, then hands the rest to process() in one go. process()
+ * rewrites packets in place and sets a verdict for each descriptor, which
+ * the loop carries out with one TX ring reservation per batch.
+ */
+
+enum pkt_verdict {
+    PKT_VERDICT_TX,   /* send back out of the receive port */
+    PKT_VERDICT_DROP, /* return the frame to the pool */
+    PKT_VERDICT_FWD,  /* send out of the forwarding port */
+};
+
+/* Continuation buffer of a multi-buffer (XDP_USE_SG) packet */
+struct pkt_frag {
+    uint64_t addr;
+    uint32_t len;
+};
+
+/* addr/len/data describe the first buffer, which holds the headers. A
+ * packet larger than a UMEM frame goes on in frags[0 .. nr_frags - 2],
+ * handlers that need the whole payload check nr_frags. */
+struct pkt_desc {
+    uint64_t addr;   /* descriptor addr, handed back to TX as is */
+    uint32_t len;
+    uint8_t *data;
+    enum pkt_verdict verdict;
+    uint32_t nr_frags; /* buffers in the packet, 1 unless multi-buffer */
+    const struct pkt_frag *frags;
+    uint32_t room;     /* len may grow up to this, the end of the frame */
+};
+
+struct pkt_handler_opts {
+    uint16_t port; /* L4 port the handler serves, 0 for its default */
+    uint32_t mc_preload; /* memcached: keys stored at startup */
+};
+
+struct pkt_handler {
+    const char *name;
+    const char *help;
+    /* XDP classifier rule redirecting the handler's traffic to AF_XDP,
+     * proto 0 means every IPv4 packet. port 0 means any port and is
+     * replaced by opts->port when given */
+    uint8_t proto;
+    uint16_t default_port;
+
+    int (*init)(const struct pkt_handler_opts *opts); /* optional */
+    /* len bytes of the first buffer, pkt_len of the whole packet */
+    bool (*classify)(const uint8_t *pkt, uint32_t len, uint32_t pkt_len);
+    void (*process)(struct pkt_desc *descs, unsigned int nr);
+};
+
+const struct pkt_handler *pkt_handler_find(const char *name);
+/* i-th registered handler, NULL past the last one */
+const struct pkt_handler *pkt_handler_get(unsigned int i);
+void pkt_handler_list(FILE *out);
+
+/* Helpers for handlers */
+
+/* Frame header in front of every memcached UDP request and reply, the
+ * same layout nicache_kern.c parses */
+struct memcached_udp_header {
+    __be16 request_id;
+    __be16 seq_num;
+    __be16 num_dgram;
+    __be16 unused;
+} __attribute__((__packed__));
+
+static inline void swap_mac(struct ethhdr *eth) {
+    uint8_t tmp_mac[ETH_ALEN];
+
+    memcpy(tmp_mac, eth->h_dest, ETH_ALEN);
+    memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+    memcpy(eth->h_source, tmp_mac, ETH_ALEN);
+}
+
+static inline void swap_ipv4(struct iphdr *ip) {
+    __be32 tmp_ip;
+
+    memcpy(&tmp_ip, &ip->saddr, sizeof(tmp_ip));
+    memcpy(&ip->saddr, &ip->daddr, sizeof(tmp_ip));
+    memcpy(&ip->daddr, &tmp_ip, sizeof(tmp_ip));
+}
+
+/* Returns the IPv4 header of an untagged IPv4 packet carrying proto, or
+ * NULL. *l4 points past the IP header (options included) */
+static inline struct iphdr *pkt_ipv4(const uint8_t *pkt, uint32_t len,
+                                     uint8_t proto, uint8_t **l4) {
+    struct ethhdr *eth = (struct ethhdr *) pkt;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+
+    if (len < sizeof(*eth) + sizeof(*ip) || eth->h_proto != htons(ETH_P_IP))
+        return NULL;
+    if (ip->ihl < 5 || len < sizeof(*eth) + ip->ihl * 4 ||
+        ip->protocol != proto)
+        return NULL;
+
+    *l4 = (uint8_t *) ip + ip->ihl * 4;
+    return ip;
+}
+
+#endif /* _PKT_HANDLER_H */
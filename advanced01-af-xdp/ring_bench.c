@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Benchmark of the af_xdp_user RX loop without a NIC.
+ *
+ * The rings of a socket live in plain memory and a few lines below play
+ * the kernel: they take frames off the fill ring, copy a txgen packet into
+ * each and post it on the RX ring, and move whatever the loop transmits
+ * straight to the completion ring. The loop itself is the one af_xdp_user
+ * runs (xsk_loop.c), so this measures ring handling, frame recycling and
+ * the packet handler for every handler and RX batch size.
+ *
+ * The cost per packet excludes the time spent in the simulated kernel. It
+ * is in TSC cycles on x86 and in ns elsewhere.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "xsk_loop.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static inline uint64_t bench_clock(void) {
+    return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static inline uint64_t bench_clock(void) {
+    return gettime();
+}
+#endif
+
+#define NUM_FRAMES     4096
+#define FRAME_SIZE     XSK_UMEM__DEFAULT_FRAME_SIZE
+#define RING_SIZE      2048 /* every ring, like af_xdp_user's defaults */
+#define SIM_HEADROOM   256  /* XDP_PACKET_HEADROOM */
+#define MAX_BATCHES    16
+
+struct config {
+    const char *handler; /* NULL for all of them */
+    uint32_t batches[MAX_BATCHES];
+    uint32_t nr_batches;
+    double duration;
+    bool csv;
+};
+
+/* Kernel side of a ring, the part that is mmap'd from the socket */
+struct sim_ring {
+    uint32_t producer;
+    uint32_t consumer;
+    uint32_t flags;
+    void *ring;
+};
+
+/* The simulated kernel of one socket */
+struct sim {
+    struct sim_ring fq, cq, rx, tx;
+    struct xsk_umem_info umem;
+    const struct txgen *gen;
+    uint64_t rng;
+    uint64_t clock; /* bench_clock() spent in here */
+};
+
+static struct sim sim;
+
+static int sim_ring_init(struct sim_ring *r, size_t entry_size) {
+    memset(r, 0, sizeof(*r));
+    r->ring = calloc(RING_SIZE, entry_size);
+    return r->ring ? 0 : -1;
+}
+
+/* Set up the user side of a ring the way xsk_umem__create() and
+ * xsk_socket__create() do after mmap'ing it */
+static void sim_ring_prod(struct xsk_ring_prod *p, struct sim_ring *r) {
+    p->mask = RING_SIZE - 1;
+    p->size = RING_SIZE;
+    p->producer = &r->producer;
+    p->consumer = &r->consumer;
+    p->flags = &r->flags;
+    p->ring = r->ring;
+    p->cached_prod = r->producer;
+    p->cached_cons = r->consumer + RING_SIZE;
+}
+
+static void sim_ring_cons(struct xsk_ring_cons *c, struct sim_ring *r) {
+    c->mask = RING_SIZE - 1;
+    c->size = RING_SIZE;
+    c->producer = &r->producer;
+    c->consumer = &r->consumer;
+    c->flags = &r->flags;
+    c->ring = r->ring;
+    c->cached_prod = r->producer;
+    c->cached_cons = r->consumer;
+}
+
+/* The NIC receives up to n packets into frames from the fill ring */
+static void sim_rx(unsigned int n) {
+    uint64_t *fill = sim.fq.ring;
+    struct xdp_desc *rx = sim.rx.ring;
+    uint32_t fq_cons = sim.fq.consumer;
+    uint32_t rx_prod = sim.rx.producer;
+    uint32_t avail, room;
+
+    avail = __atomic_load_n(&sim.fq.producer, __ATOMIC_ACQUIRE) - fq_cons;
+    room = RING_SIZE - (rx_prod - __atomic_load_n(&sim.rx.consumer, __ATOMIC_ACQUIRE));
+    if (n > avail)
+        n = avail;
+    if (n > room)
+        n = room;
+
+    for (unsigned int i = 0; i < n; i++) {
+        const struct txgen_pkt *pkt = txgen_next(sim.gen, &sim.rng);
+        struct xdp_desc *desc = &rx[rx_prod++ & (RING_SIZE - 1)];
+        uint64_t addr = fill[fq_cons++ & (RING_SIZE - 1)] + SIM_HEADROOM;
+
+        memcpy(xsk_umem__get_data(sim.umem.buffer, addr),
+               xsk_umem__get_data(sim.umem.buffer, pkt->addr), pkt->len);
+        desc->addr = addr;
+        desc->len = pkt->len;
+        desc->options = 0;
+    }
+    __atomic_store_n(&sim.fq.consumer, fq_cons, __ATOMIC_RELEASE);
+    __atomic_store_n(&sim.rx.producer, rx_prod, __ATOMIC_RELEASE);
+}
+
+/* xsk->kick, the NIC sends everything on the TX ring at once */
+static void sim_kick(struct xsk_socket_info *xsk) {
+    struct xdp_desc *tx = sim.tx.ring;
+    uint64_t *comp = sim.cq.ring;
+    uint64_t start = bench_clock();
+    uint32_t tx_cons = sim.tx.consumer;
+    uint32_t cq_prod = sim.cq.producer;
+    uint32_t n, room;
+
+    n = __atomic_load_n(&sim.tx.producer, __ATOMIC_ACQUIRE) - tx_cons;
+    room = RING_SIZE - (cq_prod - __atomic_load_n(&sim.cq.consumer, __ATOMIC_ACQUIRE));
+    if (n > room)
+        n = room;
+
+    for (uint32_t i = 0; i < n; i++)
+        comp[cq_prod++ & (RING_SIZE - 1)] = tx[tx_cons++ & (RING_SIZE - 1)].addr;
+    __atomic_store_n(&sim.tx.consumer, tx_cons, __ATOMIC_RELEASE);
+    __atomic_store_n(&sim.cq.producer, cq_prod, __ATOMIC_RELEASE);
+    sim.clock += bench_clock() - start;
+}
+
+/* Traffic the handler's XDP rule would redirect */
+static void sim_txgen_cfg(const struct pkt_handler *handler, struct txgen_cfg *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    inet_pton(AF_INET, TXGEN_DEFAULT_SRC_IP, &cfg->src_ip);
+    inet_pton(AF_INET, TXGEN_DEFAULT_DST_IP, &cfg->dst_ip);
+    cfg->src_port = TXGEN_DEFAULT_SRC_PORT;
+    cfg->dst_port = handler->default_port ? handler->default_port : TXGEN_DEFAULT_UDP_PORT;
+    cfg->pkt_size = TXGEN_DEFAULT_PKT_SIZE;
+    cfg->nr_keys = TXGEN_DEFAULT_KEYS;
+    cfg->zipf_s = TXGEN_DEFAULT_ZIPF;
+
+    if (handler->proto == IPPROTO_ICMP)
+        cfg->tmpl = TXGEN_ICMP;
+    else if (handler->default_port == TXGEN_DEFAULT_MC_PORT)
+        cfg->tmpl = TXGEN_MEMCACHED;
+    else
+        cfg->tmpl = TXGEN_UDP;
+}
+
+static void run(const struct config *cfg, struct xsk_socket_info *xsk,
+                const struct pkt_handler *handler, uint32_t batch) {
+    uint64_t start, end, clock_start, rx_start, pkts;
+    uint64_t duration = cfg->duration * NANOSEC_PER_SEC;
+    double mpps, cost;
+    unsigned int iter = 0;
+
+    xsk->rx_batch = batch;
+    sim.clock = 0;
+    rx_start = xsk->stats.rx_packets;
+    start = gettime();
+    clock_start = bench_clock();
+
+    do {
+        uint64_t t = bench_clock();
+
+        sim_rx(batch);
+        sim.clock += bench_clock() - t;
+
+        handle_receive_packets(xsk, handler);
+        complete_tx(xsk);
+        end = (++iter & 1023) ? 0 : gettime();
+    } while (!end || end - start < duration);
+
+    pkts = xsk->stats.rx_packets - rx_start;
+    mpps = (double) pkts / (end - start) * NANOSEC_PER_SEC / 1000000;
+    cost = pkts ? (double) (bench_clock() - clock_start - sim.clock) / pkts : 0;
+
+    if (cfg->csv)
+        printf("%s,%u,%.3f,%.1f\n", handler->name, batch, mpps, cost);
+    else
+        printf("%-10s batch:%-4u %'8.2f Mpps %'8.1f %s/pkt\n",
+               handler->name, batch, mpps, cost, BENCH_UNIT);
+}
+
+static int bench_handler(const struct config *cfg, struct xsk_socket_info *xsk,
+                         const struct pkt_handler *handler) {
+    struct pkt_handler_opts opts = { .mc_preload = TXGEN_DEFAULT_KEYS };
+    struct txgen_cfg gen_cfg;
+    struct txgen *gen;
+
+    if (handler->init && handler->init(&opts)) {
+        fprintf(stderr, "Error: handler %s failed to initialize\n", handler->name);
+        return -1;
+    }
+    sim_txgen_cfg(handler, &gen_cfg);
+    gen = txgen_create(&gen_cfg, xsk->frames, sim.umem.buffer, FRAME_SIZE);
+    if (!gen)
+        return -1;
+    sim.gen = gen;
+
+    for (uint32_t i = 0; i < cfg->nr_batches; i++)
+        run(cfg, xsk, handler, cfg->batches[i]);
+
+    /* Let the loop give back every frame still in flight, the templates
+     * of the next handler need some */
+    for (int i = 0; i < RING_SIZE / RX_BATCH_MAX + 1; i++) {
+        handle_receive_packets(xsk, handler);
+        complete_tx(xsk);
+    }
+    txgen_destroy(gen, xsk->frames);
+    return 0;
+}
+
+static int parse_batches(struct config *cfg, char *list) {
+    char *tok, *save = NULL;
+
+    cfg->nr_batches = 0;
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        uint32_t batch = atoi(tok);
+
+        if (cfg->nr_batches == MAX_BATCHES || batch < 1 || batch > RX_BATCH_MAX)
+            return -1;
+        cfg->batches[cfg->nr_batches++] = batch;
+    }
+    return cfg->nr_batches ? 0 : -1;
+}
+
+static void usage(char *name) {
+    printf("usage %s [options] \n\n"
+           "-H, --handler <name>\tOnly benchmark this handler, default all of them\n"
+           "-b, --batch <n,...>\tRX batch sizes, default 1,8,16,32,64,128,256\n"
+           "-D, --duration <sec>\tSeconds per run, default 1\n"
+           "-c, --csv\t\tPrint handler,batch,mpps,cost lines\n"
+           "-h, --help\t\tthis text you see right here\n", name);
+}
+
+int main(int argc, char **argv) {
+    struct config cfg = {
+            .batches = {1, 8, 16, 32, 64, 128, 256},
+            .nr_batches = 7,
+            .duration = 1,
+    };
+    struct option long_options[] = {{"handler",  required_argument, 0, 'H'},
+                                    {"batch",    required_argument, 0, 'b'},
+                                    {"duration", required_argument, 0, 'D'},
+                                    {"csv",      no_argument,       0, 'c'},
+                                    {"help",     no_argument,       0, 'h'},
+                                    {0, 0, 0, 0}
+    };
+    struct fwd_port port = { .ifname = "sim" };
+    struct xsk_socket_info *xsk;
+    const struct pkt_handler *handler;
+    int c, option_index;
+
+    while ((c = getopt_long(argc, argv, "H:b:D:ch", long_options, &option_index)) != EOF) {
+        switch (c) {
+            case 'H':
+                cfg.handler = optarg;
+                break;
+            case 'b':
+                if (parse_batches(&cfg, optarg)) {
+                    fprintf(stderr, "Error: batch sizes must be 1 to %d\n", RX_BATCH_MAX);
+                    return -1;
+                }
+                break;
+            case 'D':
+                cfg.duration = atof(optarg);
+                break;
+            case 'c':
+                cfg.csv = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (cfg.duration <= 0) {
+        fprintf(stderr, "Error: invalid arguments\n");
+        usage(argv[0]);
+        return -1;
+    }
+    if (cfg.handler && !pkt_handler_find(cfg.handler)) {
+        fprintf(stderr, "Error: unknown handler %s\n", cfg.handler);
+        return -1;
+    }
+
+    /* Anonymous memory is zeroed, so no frame starts with a stale
+     * af_xdp_kern.c timestamp */
+    sim.umem.buffer_size = (uint64_t) NUM_FRAMES * FRAME_SIZE;
+    sim.umem.buffer = mmap(NULL, sim.umem.buffer_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    sim.umem.frame_size = FRAME_SIZE;
+    sim.umem.rx_ts = calloc(NUM_FRAMES, sizeof(*sim.umem.rx_ts));
+    sim.umem.pool = xsk_frame_pool__create(NUM_FRAMES, FRAME_SIZE, 1);
+    xsk = aligned_alloc(CACHE_LINE_SIZE, sizeof(*xsk));
+    if (sim.umem.buffer == MAP_FAILED || !sim.umem.rx_ts || !sim.umem.pool || !xsk ||
+        sim_ring_init(&sim.fq, sizeof(uint64_t)) || sim_ring_init(&sim.cq, sizeof(uint64_t)) ||
+        sim_ring_init(&sim.rx, sizeof(struct xdp_desc)) ||
+        sim_ring_init(&sim.tx, sizeof(struct xdp_desc))) {
+        fprintf(stderr, "Error: setup failed \"%s\"\n", strerror(errno));
+        return 1;
+    }
+
+    memset(xsk, 0, sizeof(*xsk));
+    sim_ring_prod(&sim.umem.fq, &sim.fq);
+    sim_ring_cons(&sim.umem.cq, &sim.cq);
+    sim_ring_cons(&xsk->rx, &sim.rx);
+    sim_ring_prod(&xsk->tx, &sim.tx);
+    xsk->umem = &sim.umem;
+    xsk->fq = &sim.umem.fq;
+    xsk->cq = &sim.umem.cq;
+    xsk->fd = -1;
+    xsk->port = &port;
+    xsk->fwd = xsk;
+    xsk->kick = sim_kick;
+    xsk->rx_batch = RX_BATCH_SIZE;
+    xsk->frames = xsk_frame_cache__create(sim.umem.pool);
+    if (!xsk->frames) {
+        fprintf(stderr, "Error: setup failed\n");
+        return 1;
+    }
+    sim.rng = 0x9E3779B97F4A7C15ULL;
+
+    /* Leave room for the memcached templates */
+    xsk_prefill_fill_ring(xsk, RING_SIZE);
+
+    /* Trick to pretty printf with thousands separators use %' */
+    setlocale(LC_NUMERIC, "en_US");
+
+    for (unsigned int i = 0; (handler = pkt_handler_get(i)); i++) {
+        if (cfg.handler && strcmp(cfg.handler, handler->name))
+            continue;
+        if (bench_handler(&cfg, xsk, handler))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/icmp.h>
+#include <linux/udp.h>
+
+#include <bpf/xsk.h>
+
+#include "csum.h"
+#include "pkt_handler.h" /* struct memcached_udp_header */
+#include "txgen.h"
+
+#define HDRS_LEN (sizeof(struct ethhdr) + sizeof(struct iphdr))
+
+int txgen_parse_template(const char *name, enum txgen_template *tmpl) {
+    if (!strcmp(name, "icmp"))
+        *tmpl = TXGEN_ICMP;
+    else if (!strcmp(name, "udp"))
+        *tmpl = TXGEN_UDP;
+    else if (!strcmp(name, "memcached"))
+        *tmpl = TXGEN_MEMCACHED;
+    else
+        return -1;
+    return 0;
+}
+
+int txgen_parse_mac(const char *str, uint8_t *mac) {
+    unsigned int b[ETH_ALEN];
+    char end;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c", &b[0], &b[1], &b[2],
+               &b[3], &b[4], &b[5], &end) != ETH_ALEN)
+        return -1;
+    for (int i = 0; i < ETH_ALEN; i++) {
+        if (b[i] > 0xff)
+            return -1;
+        mac[i] = b[i];
+    }
+    return 0;
+}
+
+static struct iphdr *build_eth_ip(const struct txgen_cfg *cfg, uint8_t *pkt,
+                                  uint8_t proto, uint32_t len) {
+    struct ethhdr *eth = (struct ethhdr *) pkt;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+
+    memcpy(eth->h_dest, cfg->dst_mac, ETH_ALEN);
+    memcpy(eth->h_source, cfg->src_mac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tos = 0;
+    ip->tot_len = htons(len - sizeof(*eth));
+    ip->id = 0;
+    ip->frag_off = htons(0x4000); /* DF */
+    ip->ttl = 64;
+    ip->protocol = proto;
+    ip->check = 0;
+    ip->saddr = cfg->src_ip;
+    ip->daddr = cfg->dst_ip;
+    ip->check = ip_compute_csum(ip, sizeof(*ip));
+
+    return ip;
+}
+
+static void build_udp(const struct txgen_cfg *cfg, struct iphdr *ip,
+                      uint16_t dst_port, uint32_t udp_len) {
+    struct udphdr *udp = (struct udphdr *) (ip + 1);
+    uint16_t check;
+
+    udp->source = htons(cfg->src_port);
+    udp->dest = htons(dst_port);
+    udp->len = htons(udp_len);
+    udp->check = 0;
+    check = csum_fold(csum_partial(udp, udp_len,
+                                   csum_ipv4_pseudo(ip->saddr, ip->daddr,
+                                                    IPPROTO_UDP, udp->len)));
+    udp->check = check ? check : 0xffff;
+}
+
+static uint32_t build_icmp(const struct txgen_cfg *cfg, uint8_t *pkt) {
+    uint32_t len = cfg->pkt_size;
+    struct iphdr *ip = build_eth_ip(cfg, pkt, IPPROTO_ICMP, len);
+    struct icmphdr *icmp = (struct icmphdr *) (ip + 1);
+    uint32_t icmp_len = len - HDRS_LEN;
+    uint8_t *payload = (uint8_t *) (icmp + 1);
+
+    icmp->type = ICMP_ECHO;
+    icmp->code = 0;
+    icmp->un.echo.id = htons(0xaf);
+    icmp->un.echo.sequence = htons(1);
+    for (uint32_t i = 0; i < icmp_len - sizeof(*icmp); i++)
+        payload[i] = i;
+    icmp->checksum = 0;
+    icmp->checksum = ip_compute_csum(icmp, icmp_len);
+
+    return len;
+}
+
+static uint32_t build_udp_pkt(const struct txgen_cfg *cfg, uint8_t *pkt) {
+    uint32_t len = cfg->pkt_size;
+    struct iphdr *ip = build_eth_ip(cfg, pkt, IPPROTO_UDP, len);
+    uint8_t *payload = (uint8_t *) ip + sizeof(*ip) + sizeof(struct udphdr);
+
+    for (uint32_t i = 0; i < len - HDRS_LEN - sizeof(struct udphdr); i++)
+        payload[i] = i;
+    build_udp(cfg, ip, cfg->dst_port, len - HDRS_LEN);
+
+    return len;
+}
+
+static uint32_t build_memcached_get(const struct txgen_cfg *cfg, uint8_t *pkt,
+                                    uint32_t key) {
+    struct memcached_udp_header *mc;
+    struct iphdr *ip;
+    char *payload;
+    uint32_t len, payload_len;
+
+    mc = (struct memcached_udp_header *) (pkt + HDRS_LEN + sizeof(struct udphdr));
+    payload = (char *) (mc + 1);
+    payload_len = sprintf(payload, "get %0*u\r\n", TXGEN_KEY_LEN, key);
+    len = HDRS_LEN + sizeof(struct udphdr) + sizeof(*mc) + payload_len;
+
+    /* The IP header is written after the payload is known */
+    mc->request_id = htons(key & 0xffff);
+    mc->seq_num = 0;
+    mc->num_dgram = htons(1);
+    mc->unused = 0;
+    ip = build_eth_ip(cfg, pkt, IPPROTO_UDP, len);
+    build_udp(cfg, ip, cfg->dst_port, len - HDRS_LEN);
+
+    return len;
+}
+
+static double *zipf_cdf_create(uint32_t n, double s) {
+    double *cdf = malloc(n * sizeof(*cdf));
+    double sum = 0;
+
+    if (!cdf)
+        return NULL;
+    for (uint32_t i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        cdf[i] /= sum;
+    cdf[n - 1] = 1.0;
+    return cdf;
+}
+
+struct txgen *txgen_create(const struct txgen_cfg *cfg,
+                           struct xsk_frame_cache *frames,
+                           void *umem_area, uint32_t frame_size) {
+    uint32_t min_size = HDRS_LEN + (cfg->tmpl == TXGEN_ICMP ?
+                                    sizeof(struct icmphdr) : sizeof(struct udphdr));
+    struct txgen *gen;
+
+    if (cfg->tmpl != TXGEN_MEMCACHED &&
+        (cfg->pkt_size < min_size || cfg->pkt_size > frame_size)) {
+        fprintf(stderr, "Error: packet size must be between %u and %u\n",
+                min_size, frame_size);
+        return NULL;
+    }
+
+    gen = calloc(1, sizeof(*gen));
+    if (!gen)
+        return NULL;
+    gen->cfg = *cfg;
+    gen->nr_pkts = cfg->tmpl == TXGEN_MEMCACHED ? cfg->nr_keys : 1;
+    if (!gen->nr_pkts) {
+        fprintf(stderr, "Error: need at least one key\n");
+        goto err;
+    }
+
+    gen->pkts = calloc(gen->nr_pkts, sizeof(*gen->pkts));
+    if (!gen->pkts)
+        goto err;
+
+    if (cfg->tmpl == TXGEN_MEMCACHED) {
+        gen->zipf_cdf = zipf_cdf_create(gen->nr_pkts, cfg->zipf_s);
+        if (!gen->zipf_cdf)
+            goto err;
+    }
+
+    for (uint32_t i = 0; i < gen->nr_pkts; i++) {
+        struct txgen_pkt *t = &gen->pkts[i];
+        uint8_t *pkt;
+
+        t->addr = xsk_frame_cache__alloc(frames);
+        if (t->addr == INVALID_UMEM_FRAME) {
+            fprintf(stderr, "Error: not enough UMEM frames for %u templates\n",
+                    gen->nr_pkts);
+            goto err;
+        }
+        pkt = xsk_umem__get_data(umem_area, t->addr);
+
+        switch (cfg->tmpl) {
+            case TXGEN_ICMP:
+                t->len = build_icmp(cfg, pkt);
+                break;
+            case TXGEN_UDP:
+                t->len = build_udp_pkt(cfg, pkt);
+                break;
+            case TXGEN_MEMCACHED:
+                t->len = build_memcached_get(cfg, pkt, i);
+                break;
+        }
+    }
+    return gen;
+
+err:
+    txgen_destroy(gen, frames);
+    return NULL;
+}
+
+void txgen_destroy(struct txgen *gen, struct xsk_frame_cache *frames) {
+    if (!gen)
+        return;
+    /* Only templates that were built hold a frame */
+    for (uint32_t i = 0; gen->pkts && i < gen->nr_pkts; i++) {
+        if (gen->pkts[i].len)
+            xsk_frame_cache__free(frames, gen->pkts[i].addr);
+    }
+    free(gen->zipf_cdf);
+    free(gen->pkts);
+    free(gen);
+}
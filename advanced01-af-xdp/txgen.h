@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _TXGEN_H
+#define _TXGEN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/if_ether.h>
+
+#include "xsk_frame_pool.h"
+
+/* Packet templates for af_xdp_user --txonly.
+ *
+ * Every template is built once into its own UMEM frame, the TX loop then
+ * only posts descriptors pointing at them. Frames are read only from
+ * then on, so all queues share the same templates and completed frames
+ * don't go back to the pool.
+ */
+
+enum txgen_template {
+    TXGEN_ICMP,      /* ICMP echo request */
+    TXGEN_UDP,       /* UDP datagram */
+    TXGEN_MEMCACHED, /* memcached UDP "get <key>", key drawn from a zipf */
+};
+
+/* Memcached keys are numbers printed with this many digits, key of rank
+ * 0 is the most popular one */
+#define TXGEN_KEY_LEN 12
+
+#define TXGEN_DEFAULT_SRC_IP   "10.11.0.1"
+#define TXGEN_DEFAULT_DST_IP   "10.11.0.2"
+#define TXGEN_DEFAULT_SRC_PORT 10000
+#define TXGEN_DEFAULT_UDP_PORT 7     /* udp_echo handler */
+#define TXGEN_DEFAULT_MC_PORT  11211
+#define TXGEN_DEFAULT_PKT_SIZE 64
+#define TXGEN_DEFAULT_KEYS     1024
+#define TXGEN_DEFAULT_ZIPF     0.99
+
+struct txgen_cfg {
+    enum txgen_template tmpl;
+    uint8_t src_mac[ETH_ALEN];
+    uint8_t dst_mac[ETH_ALEN];
+    bool src_mac_set;
+    uint32_t src_ip;   /* network byte order */
+    uint32_t dst_ip;   /* network byte order */
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t pkt_size; /* Ethernet frame length without FCS, ICMP/UDP only */
+    uint32_t nr_keys;  /* memcached key space */
+    double zipf_s;     /* memcached zipf exponent, 0 for uniform */
+    uint64_t rate;     /* packets per second over all queues, 0 for no limit */
+};
+
+struct txgen_pkt {
+    uint64_t addr;
+    uint32_t len;
+};
+
+struct txgen {
+    struct txgen_cfg cfg;
+    struct txgen_pkt *pkts;
+    uint32_t nr_pkts;
+    double *zipf_cdf; /* memcached only */
+};
+
+int txgen_parse_template(const char *name, enum txgen_template *tmpl);
+int txgen_parse_mac(const char *str, uint8_t *mac);
+
+/* Build the templates into frames allocated from frames */
+struct txgen *txgen_create(const struct txgen_cfg *cfg,
+                           struct xsk_frame_cache *frames,
+                           void *umem_area, uint32_t frame_size);
+void txgen_destroy(struct txgen *gen, struct xsk_frame_cache *frames);
+
+/* xorshift64*, one state per TX thread */
+static inline uint64_t txgen_rand(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline const struct txgen_pkt *txgen_next(const struct txgen *gen,
+                                                 uint64_t *rng) {
+    uint32_t lo = 0, hi;
+    double u;
+
+    if (!gen->zipf_cdf)
+        return &gen->pkts[0];
+
+    /* Inverse transform sampling, first rank whose CDF reaches u */
+    u = (txgen_rand(rng) >> 11) * (1.0 / (1ULL << 53));
+    hi = gen->nr_pkts - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (gen->zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return &gen->pkts[lo];
+}
+
+#endif /* _TXGEN_H */
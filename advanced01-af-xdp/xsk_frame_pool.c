@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xsk_frame_pool.h"
+
+#define DEPOT_IDX(head) ((uint32_t) (head))
+#define DEPOT_TAG(head) ((uint32_t) ((head) >> 32))
+#define DEPOT_HEAD(tag, idx) (((uint64_t) (tag) << 32) | (idx))
+
+static void depot_init(struct frame_depot *depot) {
+    atomic_init(&depot->head, DEPOT_HEAD(0, FRAME_POOL_NIL));
+}
+
+static void depot_push(struct xsk_frame_pool *pool, struct frame_depot *depot,
+                       struct frame_magazine *mag) {
+    uint32_t idx = mag - pool->mags;
+    uint64_t old, new;
+
+    old = atomic_load_explicit(&depot->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&mag->next, DEPOT_IDX(old), memory_order_relaxed);
+        new = DEPOT_HEAD(DEPOT_TAG(old) + 1, idx);
+    } while (!atomic_compare_exchange_weak_explicit(&depot->head, &old, new,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+static struct frame_magazine *depot_pop(struct xsk_frame_pool *pool,
+                                        struct frame_depot *depot) {
+    uint64_t old, new;
+    uint32_t next;
+
+    old = atomic_load_explicit(&depot->head, memory_order_acquire);
+    do {
+        if (DEPOT_IDX(old) == FRAME_POOL_NIL)
+            return NULL;
+        /* The magazine may be popped and pushed again by another thread
+         * meanwhile, next is then stale but the tag makes the CAS fail */
+        next = atomic_load_explicit(&pool->mags[DEPOT_IDX(old)].next,
+                                    memory_order_relaxed);
+        new = DEPOT_HEAD(DEPOT_TAG(old) + 1, next);
+    } while (!atomic_compare_exchange_weak_explicit(&depot->head, &old, new,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+
+    return &pool->mags[DEPOT_IDX(old)];
+}
+
+static void depot_push_full(struct xsk_frame_pool *pool,
+                            struct frame_magazine *mag) {
+    atomic_fetch_add_explicit(&pool->depot_frames, mag->rounds,
+                              memory_order_relaxed);
+    depot_push(pool, &pool->full, mag);
+}
+
+static struct frame_magazine *depot_pop_full(struct xsk_frame_pool *pool) {
+    struct frame_magazine *mag = depot_pop(pool, &pool->full);
+
+    if (mag)
+        atomic_fetch_sub_explicit(&pool->depot_frames, mag->rounds,
+                                  memory_order_relaxed);
+    return mag;
+}
+
+struct xsk_frame_pool *xsk_frame_pool__create(uint32_t nr_frames,
+                                              uint32_t frame_size,
+                                              uint32_t max_caches) {
+    struct xsk_frame_pool *pool;
+    uint32_t nr_full, i;
+
+    if (!nr_frames || !frame_size || !max_caches)
+        return NULL;
+
+    if (posix_memalign((void **) &pool, CACHE_LINE_SIZE, sizeof(*pool)))
+        return NULL;
+    memset(pool, 0, sizeof(*pool));
+
+    /* Every magazine is either in a depot or held by a cache. A cache
+     * holds two, plus one in flight while it exchanges with the depot, and
+     * at most one partially filled magazine per destroyed cache ends up in
+     * the full depot. Size the empties so a spill can never run dry.
+     */
+    nr_full = (nr_frames + FRAME_POOL_MAG_SIZE - 1) / FRAME_POOL_MAG_SIZE;
+    pool->nr_mags = nr_full + 4 * max_caches + 1;
+    pool->nr_frames = nr_frames;
+    pool->frame_size = frame_size;
+    pool->max_caches = max_caches;
+    atomic_init(&pool->nr_caches, 0);
+    atomic_init(&pool->depot_frames, 0);
+
+    if (posix_memalign((void **) &pool->mags, CACHE_LINE_SIZE,
+                       pool->nr_mags * sizeof(*pool->mags))) {
+        free(pool);
+        return NULL;
+    }
+    memset(pool->mags, 0, pool->nr_mags * sizeof(*pool->mags));
+
+    depot_init(&pool->full);
+    depot_init(&pool->empty);
+
+    /* Frame i lives at offset i * frame_size in the UMEM. Push in reverse
+     * so the first allocations come from the start of the area.
+     */
+    for (i = 0; i < nr_frames; i++) {
+        uint64_t frame = (uint64_t) (nr_frames - 1 - i) * frame_size;
+        struct frame_magazine *mag = &pool->mags[i / FRAME_POOL_MAG_SIZE];
+
+        mag->frames[mag->rounds++] = frame;
+    }
+    for (i = nr_full; i > 0; i--)
+        depot_push_full(pool, &pool->mags[i - 1]);
+    for (i = nr_full; i < pool->nr_mags; i++)
+        depot_push(pool, &pool->empty, &pool->mags[i]);
+
+    return pool;
+}
+
+void xsk_frame_pool__destroy(struct xsk_frame_pool *pool) {
+    if (!pool)
+        return;
+    free(pool->mags);
+    free(pool);
+}
+
+struct xsk_frame_cache *xsk_frame_cache__create(struct xsk_frame_pool *pool) {
+    struct xsk_frame_cache *cache;
+
+    if (atomic_fetch_add(&pool->nr_caches, 1) >= pool->max_caches) {
+        atomic_fetch_sub(&pool->nr_caches, 1);
+        fprintf(stderr, "Error: frame pool supports at most %u caches\n",
+                pool->max_caches);
+        return NULL;
+    }
+
+    if (posix_memalign((void **) &cache, CACHE_LINE_SIZE, sizeof(*cache))) {
+        atomic_fetch_sub(&pool->nr_caches, 1);
+        return NULL;
+    }
+
+    cache->pool = pool;
+    cache->loaded = depot_pop(pool, &pool->empty);
+    cache->prev = depot_pop(pool, &pool->empty);
+    assert(cache->loaded && cache->prev);
+
+    return cache;
+}
+
+static void cache_return_mag(struct xsk_frame_pool *pool,
+                             struct frame_magazine *mag) {
+    if (mag->rounds)
+        depot_push_full(pool, mag);
+    else
+        depot_push(pool, &pool->empty, mag);
+}
+
+void xsk_frame_cache__destroy(struct xsk_frame_cache *cache) {
+    struct xsk_frame_pool *pool;
+
+    if (!cache)
+        return;
+
+    pool = cache->pool;
+    cache_return_mag(pool, cache->loaded);
+    cache_return_mag(pool, cache->prev);
+    atomic_fetch_sub(&pool->nr_caches, 1);
+    free(cache);
+}
+
+uint64_t xsk_frame_cache__refill(struct xsk_frame_cache *cache) {
+    struct xsk_frame_pool *pool = cache->pool;
+    struct frame_magazine *mag;
+
+    /* Both magazines are empty here */
+    mag = depot_pop_full(pool);
+    if (!mag)
+        return INVALID_UMEM_FRAME;
+
+    depot_push(pool, &pool->empty, cache->prev);
+    cache->prev = cache->loaded;
+    cache->loaded = mag;
+
+    return cache->loaded->frames[--cache->loaded->rounds];
+}
+
+void xsk_frame_cache__spill(struct xsk_frame_cache *cache, uint64_t frame) {
+    struct xsk_frame_pool *pool = cache->pool;
+    struct frame_magazine *mag;
+
+    /* Both magazines are full here */
+    mag = depot_pop(pool, &pool->empty);
+    assert(mag); /* Only possible if frames are freed twice */
+
+    depot_push_full(pool, cache->prev);
+    cache->prev = cache->loaded;
+    cache->loaded = mag;
+
+    cache->loaded->frames[cache->loaded->rounds++] = frame;
+}
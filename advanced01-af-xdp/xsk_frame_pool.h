@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _XSK_FRAME_POOL_H
+#define _XSK_FRAME_POOL_H
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* UMEM frame allocator shared by every AF_XDP socket/thread using one UMEM.
+ *
+ * Frames are kept in fixed size magazines. Each thread owns a
+ * struct xsk_frame_cache holding two magazines (loaded and previous), so
+ * alloc/free on the fast path only touch thread local memory. Full and
+ * empty magazines are exchanged with the pool through two lock-free
+ * Treiber stacks (the depot), one magazine (FRAME_POOL_MAG_SIZE frames) at
+ * a time, so the shared cache lines are touched once every
+ * FRAME_POOL_MAG_SIZE operations at most.
+ */
+
+#define INVALID_UMEM_FRAME UINT64_MAX
+
+/* Frames per magazine, same as the default RX batch size */
+#define FRAME_POOL_MAG_SIZE 64
+
+#define FRAME_POOL_NIL UINT32_MAX
+
+#define CACHE_LINE_SIZE 64
+
+struct frame_magazine {
+    _Atomic uint32_t next; /* link in the depot stack, magazine index */
+    uint32_t rounds;       /* number of frames in frames[] */
+    uint64_t frames[FRAME_POOL_MAG_SIZE];
+};
+
+/* Lock-free stack of magazines. head packs a 32-bit ABA tag (high half)
+ * and the index of the top magazine (low half), so a 64-bit CAS is enough.
+ */
+struct frame_depot {
+    _Atomic uint64_t head;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct xsk_frame_pool {
+    struct frame_depot full;
+    struct frame_depot empty;
+    /* Frames currently sitting in the full depot */
+    _Atomic int64_t depot_frames __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    uint32_t nr_frames __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t frame_size;
+    uint32_t nr_mags;
+    uint32_t max_caches;
+    _Atomic uint32_t nr_caches;
+    struct frame_magazine *mags;
+};
+
+/* Per-thread magazine pair, must only be used by its owner thread */
+struct xsk_frame_cache {
+    struct xsk_frame_pool *pool;
+    struct frame_magazine *loaded;
+    struct frame_magazine *prev;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct xsk_frame_pool *xsk_frame_pool__create(uint32_t nr_frames,
+                                              uint32_t frame_size,
+                                              uint32_t max_caches);
+void xsk_frame_pool__destroy(struct xsk_frame_pool *pool);
+
+struct xsk_frame_cache *xsk_frame_cache__create(struct xsk_frame_pool *pool);
+/* Return every cached frame to the pool and release the cache */
+void xsk_frame_cache__destroy(struct xsk_frame_cache *cache);
+
+/* Slow paths, called when both magazines are empty (alloc) or full (free) */
+uint64_t xsk_frame_cache__refill(struct xsk_frame_cache *cache);
+void xsk_frame_cache__spill(struct xsk_frame_cache *cache, uint64_t frame);
+
+static inline void frame_cache_swap(struct xsk_frame_cache *cache) {
+    struct frame_magazine *tmp = cache->loaded;
+
+    cache->loaded = cache->prev;
+    cache->prev = tmp;
+}
+
+static inline uint64_t xsk_frame_cache__alloc(struct xsk_frame_cache *cache) {
+    if (cache->loaded->rounds)
+        return cache->loaded->frames[--cache->loaded->rounds];
+
+    if (cache->prev->rounds) {
+        frame_cache_swap(cache);
+        return cache->loaded->frames[--cache->loaded->rounds];
+    }
+
+    return xsk_frame_cache__refill(cache);
+}
+
+static inline void xsk_frame_cache__free(struct xsk_frame_cache *cache,
+                                         uint64_t frame) {
+    assert(frame != INVALID_UMEM_FRAME);
+
+    if (cache->loaded->rounds < FRAME_POOL_MAG_SIZE) {
+        cache->loaded->frames[cache->loaded->rounds++] = frame;
+        return;
+    }
+
+    if (cache->prev->rounds == 0) {
+        frame_cache_swap(cache);
+        cache->loaded->frames[cache->loaded->rounds++] = frame;
+        return;
+    }
+
+    xsk_frame_cache__spill(cache, frame);
+}
+
+/* Frames this cache could hand out: its own magazines plus whatever is
+ * in the shared depot. The depot part is a relaxed snapshot other threads
+ * may empty right after, so this only sizes a request; callers must still
+ * check each xsk_frame_cache__alloc() for INVALID_UMEM_FRAME.
+ */
+static inline uint32_t xsk_frame_cache__nb_free(struct xsk_frame_cache *cache) {
+    int64_t depot = atomic_load_explicit(&cache->pool->depot_frames,
+                                         memory_order_relaxed);
+
+    return cache->loaded->rounds + cache->prev->rounds +
+           (depot > 0 ? (uint32_t) depot : 0);
+}
+
+#endif /* _XSK_FRAME_POOL_H */
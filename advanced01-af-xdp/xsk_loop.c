@@ -0,0 +1,438 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "common.h"
+#include "xsk_loop.h"
+
+/* frame就是某个帧chunk在UMEM中的字节偏移量，帧池为空时返回INVALID_UMEM_FRAME */
+static uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk) {
+    return xsk_frame_cache__alloc(xsk->frames);
+}
+
+static uint32_t xsk_umem_free_frames(struct xsk_socket_info *xsk) {
+    return xsk_frame_cache__nb_free(xsk->frames);
+}
+
+static void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame) {
+    xsk_frame_cache__free(xsk->frames, frame);
+}
+
+/* Give every buffer of a received packet back to the pool */
+static void xsk_free_pkt(struct xsk_socket_info *xsk, const struct pkt_desc *desc) {
+    xsk_free_umem_frame(xsk, xsk_umem_frame_base(xsk->umem, desc->addr));
+    for (uint32_t i = 1; i < desc->nr_frags; i++)
+        xsk_free_umem_frame(xsk, xsk_umem_frame_base(xsk->umem, desc->frags[i - 1].addr));
+}
+
+static inline uint64_t *xsk_frame_rx_ts(struct xsk_umem_info *umem, uint64_t addr) {
+    return &umem->rx_ts[xsk_umem_frame_base(umem, addr) / umem->frame_size];
+}
+
+/* Timestamp af_xdp_kern.c put in front of the packet at data, 0 if there
+ * is none. The magic is cleared so a later packet in the same frame isn't
+ * taken as stamped when the driver has no metadata support. */
+static inline uint64_t xsk_rx_meta_ts(void *data) {
+    struct xdp_rx_meta *meta = (struct xdp_rx_meta *) data - 1;
+
+    if (meta->magic != XDP_RX_META_MAGIC)
+        return 0;
+    meta->magic = 0;
+    return meta->rx_ts;
+}
+
+static inline void xsk_share_lock(struct xsk_socket_info *xsk) {
+    if (xsk->share)
+        pthread_spin_lock(&xsk->share->lock);
+}
+
+static inline void xsk_share_unlock(struct xsk_socket_info *xsk) {
+    if (xsk->share)
+        pthread_spin_unlock(&xsk->share->lock);
+}
+
+/* Account nr TX descriptors posted to the rings of xsk */
+static inline void xsk_tx_posted(struct xsk_socket_info *xsk, uint32_t nr) {
+    xsk->outstanding_tx += nr;
+    if (xsk->share)
+        atomic_fetch_add_explicit(&xsk->share->outstanding_tx, nr, memory_order_relaxed);
+}
+
+/* Reap up to the whole completion ring, with the share lock held */
+static unsigned int xsk_reap_completions(struct xsk_socket_info *xsk) {
+    unsigned int completed;
+    uint32_t idx_cq;
+
+    /* Collect/free completed TX buffers */
+    completed = xsk_ring_cons__peek(xsk->cq, xsk->cq->size, &idx_cq);
+
+    /* 也就是内核生产了comp ring即代表发送完成，我们要逐一确认好（应该是非必须的吧？） */
+    if (completed > 0) {
+        uint64_t now = gettime();
+
+        for (int i = 0; i < completed && !xsk->static_tx; i++) {
+            uint64_t addr = *xsk_ring_cons__comp_addr(xsk->cq, idx_cq++);
+            uint64_t *ts = xsk_frame_rx_ts(xsk->umem, addr);
+
+            if (*ts) {
+                hist_record_single(&xsk->tx_lat, now - *ts);
+                *ts = 0;
+            }
+            xsk_free_umem_frame(xsk, xsk_umem_frame_base(xsk->umem, addr));
+        }
+
+        xsk_ring_cons__release(xsk->cq, completed);
+    }
+    return completed;
+}
+
+/* complete_tx() of a socket sharing its completion ring. Our own TX ring
+ * needs a kick while the kernel hasn't taken everything posted on it, the
+ * shared ring is reaped as long as anyone in the group has TX in flight. */
+static void complete_tx_shared(struct xsk_socket_info *xsk) {
+    struct xsk_ring_share *share = xsk->share;
+    unsigned int completed;
+
+    if (xsk->outstanding_tx) {
+        if (xsk->kick)
+            xsk->kick(xsk);
+        else
+            sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        xsk->stats.wakeups++;
+        if (xsk->tx.cached_prod == __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE))
+            xsk->outstanding_tx = 0;
+    }
+
+    if (!atomic_load_explicit(&share->outstanding_tx, memory_order_relaxed) ||
+        pthread_spin_trylock(&share->lock))
+        return; /* Someone else is reaping */
+    completed = xsk_reap_completions(xsk);
+    pthread_spin_unlock(&share->lock);
+    if (completed)
+        atomic_fetch_sub_explicit(&share->outstanding_tx, completed, memory_order_relaxed);
+}
+
+void complete_tx(struct xsk_socket_info *xsk) {
+    unsigned int completed;
+
+    if (xsk->share) {
+        complete_tx_shared(xsk);
+        return;
+    }
+
+    if (!xsk->outstanding_tx) {// No TX happened, return
+        return;
+    }
+
+    /* ? */
+    if (xsk->kick)
+        xsk->kick(xsk);
+    else
+        sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    xsk->stats.wakeups++;
+
+    completed = xsk_reap_completions(xsk);
+
+    /* 按道理这里的completed是应该要等于xsk->outstanding_tx的 */
+    xsk->outstanding_tx -= completed < xsk->outstanding_tx ?
+                           completed : xsk->outstanding_tx;
+}
+
+/* Frames handed to the fill ring per reserve, bounds the stack array */
+#define FILL_CHUNK 64
+
+/* Puts up to nr frames on the fill ring and returns how many it got.
+ * xsk_umem_free_frames() is only a snapshot of the shared depot: another
+ * socket of the UMEM may empty it meanwhile, so the frames are taken
+ * first and only those the allocator actually returned are submitted. */
+static unsigned int xsk_fill_frames(struct xsk_socket_info *xsk, unsigned int nr) {
+    uint64_t frames[FILL_CHUNK];
+    unsigned int want, got, i, done = 0;
+    uint32_t idx_fq = 0;
+
+    while (done < nr) {
+        want = nr - done < FILL_CHUNK ? nr - done : FILL_CHUNK;
+        for (got = 0; got < want; got++) {
+            frames[got] = xsk_alloc_umem_frame(xsk);
+            if (frames[got] == INVALID_UMEM_FRAME)
+                break;
+        }
+        if (!got)
+            break;
+        /* Only we produce on this ring, or the share lock says so */
+        if (xsk_ring_prod__reserve(xsk->fq, got, &idx_fq) != got) {
+            for (i = 0; i < got; i++)
+                xsk_free_umem_frame(xsk, frames[i]);
+            break;
+        }
+        for (i = 0; i < got; i++)
+            *xsk_ring_prod__fill_addr(xsk->fq, idx_fq++) = frames[i];
+        xsk_ring_prod__submit(xsk->fq, got);
+        done += got;
+        if (got < want)
+            break;
+    }
+    return done;
+}
+
+/* Stuff the fill ring with as many free frames as possible */
+static void xsk_refill_fill_ring(struct xsk_socket_info *xsk) {
+    unsigned int stock_frames, free_frames;
+    bool starved = false;
+
+    /* 查看xsk所属umem的fill ring是否有足够本xsk空闲frame数量的空闲desc，有的话就填充 */
+    free_frames = xsk_umem_free_frames(xsk);
+    stock_frames = xsk_prod_nb_free(xsk->fq, free_frames);
+    if (stock_frames > free_frames) {
+        stock_frames = free_frames;
+        starved = true;
+    }
+    /* 空闲帧也可能在此期间被共享UMEM的其他线程取走 */
+    if (stock_frames && xsk_fill_frames(xsk, stock_frames) < stock_frames)
+        starved = true;
+    if (starved)
+        xsk->stats.fill_starved++;
+}
+
+/* --steer: tell the XDP program to send this socket's flows elsewhere
+ * while its RX ring is more than 3/4 full, and take them back once it is
+ * down to 1/4 */
+static inline void xsk_update_busy(struct xsk_socket_info *xsk) {
+    uint32_t backlog = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - xsk->rx.cached_cons;
+    uint32_t busy = *xsk->busy;
+
+    if (!busy && backlog >= xsk->rx.size - xsk->rx.size / 4)
+        __atomic_store_n(xsk->busy, 1, __ATOMIC_RELAXED);
+    else if (busy && backlog <= xsk->rx.size / 4)
+        __atomic_store_n(xsk->busy, 0, __ATOMIC_RELAXED);
+}
+
+/* Put nr packets on the TX ring of xsk with a single reservation, returns
+ * how many fit. The caller owns the frames of the rest. A multi-buffer
+ * packet takes one descriptor per buffer, all but the last one flagged
+ * XDP_PKT_CONTD, and is only sent whole. */
+static unsigned int xsk_transmit(struct xsk_socket_info *xsk,
+                                 struct pkt_desc **pkts, unsigned int nr) {
+    unsigned int sent, descs = 0, room, i, j;
+    uint32_t tx_idx = 0;
+
+    if (!nr)
+        return 0;
+    for (i = 0; i < nr; i++)
+        descs += pkts[i]->nr_frags;
+    room = xsk_prod_nb_free(&xsk->tx, descs);
+    if (room >= descs) {
+        sent = nr;
+    } else {
+        xsk->stats.tx_ring_full++;
+        for (sent = 0, descs = 0; descs + pkts[sent]->nr_frags <= room; sent++)
+            descs += pkts[sent]->nr_frags;
+    }
+    if (!sent || xsk_ring_prod__reserve(&xsk->tx, descs, &tx_idx) != descs)
+        return 0;
+
+    for (i = 0; i < sent; i++) {
+        /* 直接返回修改后的接收报文，复用接收报文的地址和长度即可 */
+        struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&xsk->tx, tx_idx++);
+
+        tx_desc->addr = pkts[i]->addr;
+        tx_desc->len = pkts[i]->len;
+        tx_desc->options = pkts[i]->nr_frags > 1 ? XDP_PKT_CONTD : 0;
+        xsk->stats.tx_bytes += pkts[i]->len;
+
+        for (j = 1; j < pkts[i]->nr_frags; j++) {
+            const struct pkt_frag *frag = &pkts[i]->frags[j - 1];
+
+            tx_desc = xsk_ring_prod__tx_desc(&xsk->tx, tx_idx++);
+            tx_desc->addr = frag->addr;
+            tx_desc->len = frag->len;
+            tx_desc->options = j + 1 < pkts[i]->nr_frags ? XDP_PKT_CONTD : 0;
+            xsk->stats.tx_bytes += frag->len;
+        }
+    }
+    xsk_ring_prod__submit(&xsk->tx, descs);
+
+    /* Completions come back per descriptor */
+    xsk_tx_posted(xsk, descs);
+    xsk->stats.tx_packets += sent;
+    return sent;
+}
+
+static inline void fwd_rewrite_mac(const struct fwd_port *out, struct pkt_desc *desc) {
+    struct ethhdr *eth = (struct ethhdr *) desc->data;
+
+    if (!out->rewrite || desc->len < sizeof(*eth))
+        return;
+    memcpy(eth->h_dest, out->nexthop, ETH_ALEN);
+    memcpy(eth->h_source, out->mac, ETH_ALEN);
+}
+
+/* RX descriptors with the FWD verdict go straight onto the TX ring of
+ * xsk->fwd, the frame stays where it is since both sockets share the umem */
+void handle_receive_packets(struct xsk_socket_info *xsk,
+                                   const struct pkt_handler *handler) {
+    struct pkt_desc descs[RX_BATCH_MAX];
+    struct pkt_frag frags[RX_BATCH_MAX];
+    struct pkt_desc *tx[RX_BATCH_MAX], *fwd[RX_BATCH_MAX];
+    unsigned int rcvd, nr = 0, nr_frags = 0, pkts = 0, nr_tx = 0, nr_fwd = 0, sent, i;
+    uint32_t idx_rx = 0, pkt_len = 0;
+    uint64_t now, ts = 0;
+    bool contd = false;
+
+    /* peek for descs to cons in batch_size, idx_rx use later */
+    rcvd = xsk_ring_cons__peek(&xsk->rx,
+                                atomic_load_explicit(&xsk->rx_batch, memory_order_relaxed),
+                                &idx_rx);
+    if (xsk->busy)
+        xsk_update_busy(xsk);
+    if (!rcvd)
+        return;
+
+    /* With XDP_USE_SG a packet ends at the first descriptor without
+     * XDP_PKT_CONTD. One whose tail didn't make it into the batch stays
+     * on the ring for the next round; a packet has at most XSK_MAX_FRAGS
+     * buffers and the batch is never smaller with --multi-buffer. */
+    for (i = rcvd; i > 0; i--) {
+        if (!(xsk_ring_cons__rx_desc(&xsk->rx, idx_rx + i - 1)->options & XDP_PKT_CONTD))
+            break;
+    }
+    if (i < rcvd) {
+        xsk_ring_cons__cancel(&xsk->rx, rcvd - i);
+        rcvd = i;
+        if (!rcvd)
+            return;
+    }
+
+    /* 发现空闲desc了马上处理 */
+    xsk_share_lock(xsk);
+    xsk_refill_fill_ring(xsk);
+    xsk_share_unlock(xsk);
+
+    /* One clock read per batch is close enough for the histogram */
+    now = gettime();
+
+    /* Classify, frames nobody wants go straight back to the pool */
+    for (i = 0; i < rcvd; i++) {
+        const struct xdp_desc *rx_desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+        struct pkt_desc *desc = &descs[nr];
+
+        xsk->stats.rx_bytes += rx_desc->len;
+        pkt_len = contd ? pkt_len + rx_desc->len : rx_desc->len;
+        if (contd) {
+            /* Next buffer of descs[nr], only the first one is stamped */
+            frags[nr_frags].addr = rx_desc->addr;
+            frags[nr_frags++].len = rx_desc->len;
+            desc->nr_frags++;
+            *xsk_frame_rx_ts(xsk->umem, rx_desc->addr) = 0;
+        } else {
+            desc->addr = rx_desc->addr;
+            desc->len = rx_desc->len;
+            /* addr只是对应的偏移量；取具体地址就是用这个函数，非对齐模式下高16位是数据偏移 */
+            desc->data = xsk_umem_frame_data(xsk->umem, desc->addr);
+            desc->nr_frags = 1;
+            desc->frags = &frags[nr_frags];
+            desc->room = xsk_umem_frame_room(xsk->umem, desc->addr);
+
+            ts = xsk_rx_meta_ts(desc->data);
+            if (ts && now > ts)
+                hist_record_single(&xsk->rx_lat, now - ts);
+            *xsk_frame_rx_ts(xsk->umem, desc->addr) = ts;
+        }
+        contd = rx_desc->options & XDP_PKT_CONTD;
+        if (contd)
+            continue;
+
+        pkts++;
+        /* Everything the XDP program redirected, before the handler
+         * rewrites it. Stamped in XDP if the driver allows. */
+        if (xsk->cap && !capture_packet(xsk->cap, ts ? ts : now, desc->data,
+                                        desc->len, pkt_len))
+            xsk->stats.capture_drops++;
+
+        if (handler->classify(desc->data, desc->len, pkt_len)) {
+            nr++;
+        } else {
+            xsk_free_pkt(xsk, desc);
+            xsk->stats.drops++;
+        }
+    }
+
+    /* 其实就是移动cons指针 */
+    xsk_ring_cons__release(&xsk->rx, rcvd);
+    xsk->stats.rx_packets += pkts;
+    if (xsk->cap)
+        capture_commit(xsk->cap);
+
+    handler->process(descs, nr);
+
+    for (i = 0; i < nr; i++) {
+        switch (descs[i].verdict) {
+            case PKT_VERDICT_TX:
+                tx[nr_tx++] = &descs[i];
+                break;
+            case PKT_VERDICT_FWD:
+                fwd[nr_fwd++] = &descs[i];
+                break;
+            case PKT_VERDICT_DROP:
+            default:
+                xsk_free_pkt(xsk, &descs[i]);
+                xsk->stats.drops++;
+                break;
+        }
+    }
+
+    /* No more transmit slots, drop the rest */
+    sent = xsk_transmit(xsk, tx, nr_tx);
+    for (i = sent; i < nr_tx; i++)
+        xsk_free_pkt(xsk, tx[i]);
+    xsk->stats.drops += nr_tx - sent;
+
+    for (i = 0; i < nr_fwd; i++)
+        fwd_rewrite_mac(xsk->fwd->port, fwd[i]);
+    sent = xsk_transmit(xsk->fwd, fwd, nr_fwd);
+    for (i = sent; i < nr_fwd; i++)
+        xsk_free_pkt(xsk, fwd[i]);
+    xsk->stats.drops += nr_fwd - sent;
+}
+
+unsigned int tx_only_batch(struct xsk_socket_info *xsk,
+                           const struct txgen *gen, uint64_t *rng,
+                           unsigned int nr) {
+    unsigned int sent, i;
+    uint32_t tx_idx = 0;
+
+    sent = xsk_prod_nb_free(&xsk->tx, nr);
+    if (sent >= nr)
+        sent = nr;
+    else
+        xsk->stats.tx_ring_full++;
+    if (!sent || xsk_ring_prod__reserve(&xsk->tx, sent, &tx_idx) != sent)
+        return 0;
+
+    for (i = 0; i < sent; i++) {
+        const struct txgen_pkt *pkt = txgen_next(gen, rng);
+        struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&xsk->tx, tx_idx++);
+
+        tx_desc->addr = pkt->addr;
+        tx_desc->len = pkt->len;
+        tx_desc->options = 0;
+        xsk->stats.tx_bytes += pkt->len;
+    }
+    xsk_ring_prod__submit(&xsk->tx, sent);
+
+    xsk_tx_posted(xsk, sent);
+    xsk->stats.tx_packets += sent;
+    return sent;
+}
+
+void xsk_prefill_fill_ring(struct xsk_socket_info *xsk, unsigned int nr) {
+    unsigned int free_frames = xsk_umem_free_frames(xsk);
+
+    if (nr > free_frames)
+        nr = free_frames;
+    xsk_share_lock(xsk);
+    if (nr)
+        xsk_fill_frames(xsk, nr);
+    xsk_share_unlock(xsk);
+}
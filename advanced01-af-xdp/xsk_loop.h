@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _XSK_LOOP_H
+#define _XSK_LOOP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <bpf/xsk.h>
+#include <linux/if_ether.h>
+
+#include "capture.h"
+#include "hist.h"
+#include "pkt_handler.h"
+#include "txgen.h"
+#include "xsk_frame_pool.h"
+#include "xsk_stats.h"
+
+/* The AF_XDP ring handling of af_xdp_user: fill ring refills, the RX
+ * loop feeding the packet handler, TX and completion.
+ *
+ * Everything here only touches the rings through the inline xsk_ring_*
+ * helpers of <bpf/xsk.h> and wakes the kernel through xsk->kick, so
+ * ring_bench can run the same code on rings in plain memory, without a
+ * NIC or root.
+ */
+
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
+
+#define RX_BATCH_SIZE      64
+/* 为便于理解，我们可以先把RX_BATCH_SIZE设置小一点 */
+//#define RX_BATCH_SIZE      4
+#define RX_BATCH_MAX       256
+/* Buffers in one XDP_USE_SG packet (MAX_SKB_FRAGS + 1). The RX loop
+ * leaves a packet whose tail isn't in the batch for the next round, so
+ * with --multi-buffer a batch must be able to hold a whole one. */
+#define XSK_MAX_FRAGS      18
+
+/* An interface af_xdp_user has sockets on. Frames forwarded out of a port
+ * with rewrite set get its MAC as source and nexthop as destination,
+ * otherwise they leave untouched (bump in the wire). */
+struct fwd_port {
+    char *ifname;
+    int ifindex;
+    uint8_t mac[ETH_ALEN];
+    uint8_t nexthop[ETH_ALEN];
+    bool rewrite;
+};
+
+/* --steer: the sockets bound to one queue of a port share the fill and
+ * completion ring of the first one, each worker takes the lock around
+ * them. Completions can't be told apart by socket, so TX in flight is
+ * counted for the whole group. */
+struct xsk_ring_share {
+    pthread_spinlock_t lock;
+    _Atomic uint32_t outstanding_tx;
+};
+
+struct xsk_umem_info { // 该结构体是linux源码samples示例中用的
+    struct xsk_ring_prod fq;
+    struct xsk_ring_cons cq;
+    struct xsk_umem *umem;
+    void *buffer;
+    uint64_t buffer_size;
+    struct xsk_frame_pool *pool;
+    uint32_t frame_size;
+    bool unaligned;
+    /* XDP RX timestamp of the packet each frame holds, 0 if unknown,
+     * read back when the frame shows up on a completion ring */
+    uint64_t *rx_ts;
+};
+
+struct xsk_socket_info { // 该结构体是linux源码samples示例中用的，有过修改
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_umem_info *umem;
+    struct xsk_socket *xsk;
+    int fd;
+    const struct fwd_port *port; /* interface the socket is bound to */
+    int queue;
+    /* RX descriptors per round, at most RX_BATCH_MAX. Changed on the fly
+     * by --autotune, the next round picks it up. */
+    _Atomic uint32_t rx_batch;
+
+    /* Wakes the kernel up to transmit, NULL for a sendto() on the socket.
+     * ring_bench points it at its simulated kernel. */
+    void (*kick)(struct xsk_socket_info *xsk);
+
+    /* Fill/completion rings, the umem's own ones for the first socket,
+     * fq_ring/cq_ring for every other socket sharing the umem */
+    struct xsk_ring_prod *fq;
+    struct xsk_ring_cons *cq;
+    struct xsk_ring_prod fq_ring;
+    struct xsk_ring_cons cq_ring;
+    struct xsk_ring_share *share; /* NULL unless fq/cq are shared */
+    int slot; /* --steer: index among the sockets of the queue */
+    /* --steer: this socket's xsk_busy_map entry, NULL without steering */
+    uint32_t *busy;
+
+    struct xsk_frame_cache *frames; /* this thread's view of umem->pool */
+
+    /* TX frames are txgen templates, completion doesn't free them */
+    bool static_tx;
+
+    struct capture_ring *cap; /* --capture, this socket's ring */
+
+    uint32_t outstanding_tx;
+
+    /* Socket PKT_VERDICT_FWD packets leave from, the socket itself when
+     * there is no forwarding port */
+    struct xsk_socket_info *fwd;
+
+    struct xsk_counters stats; /* owner thread only, see xsk_stats_publish() */
+
+    /* Read by the stats thread, kept off the cache lines above */
+    struct xsk_stats_block stats_pub;
+    struct hist rx_lat __attribute__((aligned(CACHE_LINE_SIZE))); /* XDP program to userspace */
+    struct hist tx_lat; /* XDP program to TX completion */
+};
+
+/* Address of the packet data for a RX/TX/completion descriptor addr. In
+ * unaligned mode the kernel keeps the chunk address in the low 48 bits and
+ * the data offset in the high 16 bits.
+ */
+static inline void *xsk_umem_frame_data(struct xsk_umem_info *umem, uint64_t addr) {
+    if (umem->unaligned)
+        addr = xsk_umem__add_offset_to_addr(addr);
+    return xsk_umem__get_data(umem->buffer, addr);
+}
+
+/* Chunk address to give back to the frame pool for a descriptor addr */
+static inline uint64_t xsk_umem_frame_base(struct xsk_umem_info *umem, uint64_t addr) {
+    if (umem->unaligned)
+        return xsk_umem__extract_addr(addr);
+    return addr & ~((uint64_t) umem->frame_size - 1);
+}
+
+/* Bytes from the packet data of a descriptor addr to the end of its frame */
+static inline uint32_t xsk_umem_frame_room(struct xsk_umem_info *umem, uint64_t addr) {
+    uint64_t data = umem->unaligned ? xsk_umem__add_offset_to_addr(addr) : addr;
+
+    return umem->frame_size - (data - xsk_umem_frame_base(umem, addr));
+}
+
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+
+static inline uint64_t gettime(void) {
+    struct timespec t;
+    int res;
+
+    res = clock_gettime(CLOCK_MONOTONIC, &t);
+    if (res < 0) {
+        fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
+        exit(1);
+    }
+    return (uint64_t) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
+}
+
+/* TX descriptors the kernel hasn't completed yet, with --steer those of
+ * every socket sharing the completion ring */
+static inline uint32_t xsk_tx_in_flight(const struct xsk_socket_info *xsk) {
+    if (xsk->share)
+        return atomic_load_explicit(&xsk->share->outstanding_tx, memory_order_relaxed);
+    return xsk->outstanding_tx;
+}
+
+/* Check if TX is done, wake the kernel up and free what it sent */
+void complete_tx(struct xsk_socket_info *xsk);
+/* One round of RX: up to xsk->rx_batch descriptors through handler,
+ * replies out of xsk, PKT_VERDICT_FWD out of xsk->fwd */
+void handle_receive_packets(struct xsk_socket_info *xsk,
+                            const struct pkt_handler *handler);
+/* Post up to nr templates picked by gen with a single reservation */
+unsigned int tx_only_batch(struct xsk_socket_info *xsk,
+                           const struct txgen *gen, uint64_t *rng,
+                           unsigned int nr);
+/* Stuff the fill ring of a new socket with up to nr frames */
+void xsk_prefill_fill_ring(struct xsk_socket_info *xsk, unsigned int nr);
+
+#endif /* _XSK_LOOP_H */
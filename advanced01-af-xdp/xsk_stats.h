@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _XSK_STATS_H
+#define _XSK_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "xsk_frame_pool.h" /* CACHE_LINE_SIZE */
+
+/* Per-worker packet counters.
+ *
+ * A worker counts into its own struct xsk_counters, which nobody else
+ * reads, and copies it to its struct xsk_stats_block once per loop. The
+ * block sits on cache lines of its own, so the stats thread only ever
+ * pulls those lines away from the worker, never the ring state. Readers
+ * take consistent snapshots with a seqcount: the writer makes seq odd
+ * while copying, the reader retries until it sees the same even seq
+ * before and after its copy.
+ */
+
+struct xsk_counters {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t drops;        /* freed in userspace: filtered, handler DROP, no TX slot */
+    uint64_t tx_ring_full; /* TX batches that didn't all fit in the TX ring */
+    uint64_t fill_starved; /* fill ring refills short of free frames */
+    uint64_t wakeups;      /* sendto() kicks and poll() calls */
+    uint64_t capture_drops; /* --capture ring full, packet went on uncaptured */
+};
+
+#define XSK_COUNTERS_NR (sizeof(struct xsk_counters) / sizeof(uint64_t))
+
+struct xsk_stats_block {
+    _Atomic uint32_t seq;
+    uint64_t counters[XSK_COUNTERS_NR]; /* struct xsk_counters, word by word */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Single writer, the owner of c */
+static inline void xsk_stats_publish(struct xsk_stats_block *b,
+                                     const struct xsk_counters *c) {
+    const uint64_t *src = (const uint64_t *) c;
+    uint32_t seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&b->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (unsigned int i = 0; i < XSK_COUNTERS_NR; i++)
+        __atomic_store_n(&b->counters[i], src[i], __ATOMIC_RELAXED);
+    atomic_store_explicit(&b->seq, seq + 2, memory_order_release);
+}
+
+static inline void xsk_stats_read(struct xsk_stats_block *b,
+                                  struct xsk_counters *c) {
+    uint64_t *dst = (uint64_t *) c;
+    uint32_t seq;
+
+    do {
+        while ((seq = atomic_load_explicit(&b->seq, memory_order_acquire)) & 1)
+            ;
+        for (unsigned int i = 0; i < XSK_COUNTERS_NR; i++)
+            dst[i] = __atomic_load_n(&b->counters[i], __ATOMIC_RELAXED);
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&b->seq, memory_order_relaxed) != seq);
+}
+
+#endif /* _XSK_STATS_H */
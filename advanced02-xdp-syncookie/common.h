@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __COMMON_H
+#define __COMMON_H
+
+/* Shared by xdp_syncookie_kern.c and xdp_syncookie_user.c */
+
+/* Key of allow_map, a connection whose handshake went through the SYN
+ * cookie check. Addresses and ports in network byte order, as the
+ * client sent them. */
+struct flow_v4 {
+    __u32 saddr;
+    __u32 daddr;
+    __u16 sport;
+    __u16 dport;
+};
+
+#define ALLOW_ENTRIES 65536
+
+/* Value of syncookie_cfg_map, what the SYN-ACKs advertise. wscale has to
+ * match the --wscale of the SYNPROXY rule behind. */
+struct syncookie_cfg {
+    __u16 mss;
+    __u8 wscale;
+    __u8 ttl;
+};
+
+#define SYNCOOKIE_DEFAULT_MSS    1460
+#define SYNCOOKIE_DEFAULT_WSCALE 7
+#define SYNCOOKIE_DEFAULT_TTL    64
+
+/* stats_map keys */
+enum syncookie_stat {
+    STAT_SYNACK,        /* SYN answered with a cookie */
+    STAT_COOKIE_OK,     /* ACK with a valid cookie, flow allowed */
+    STAT_COOKIE_BAD,    /* ACK without a valid cookie, dropped */
+    STAT_ALLOWED,       /* packet of an allowed flow, passed */
+    STAT_DROP,          /* anything else to a protected port */
+    STAT_CONNTRACK,     /* packet of a flow evicted from allow_map that
+                         * conntrack still knows, passed */
+    STAT_MAX
+};
+
+#endif /* __COMMON_H */
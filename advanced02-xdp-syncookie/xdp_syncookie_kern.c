@@ -0,0 +1,378 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "common.h"
+
+/* SYN flood mitigation for the TCP ports set in ports_map.
+ *
+ * A SYN to a protected port never reaches the kernel, xdp_syncookie
+ * answers it with a SYN-ACK carrying a SYN cookie and sends it back out
+ * with XDP_TX. The ACK that completes the handshake is checked against
+ * the cookie, a good one puts the flow into allow_map and goes up to the
+ * SYNPROXY rule that opens the connection to the listener. Everything
+ * else to a protected port that isn't in allow_map is dropped.
+ *
+ * The cookies are the kernel's own (bpf_tcp_raw_gen_syncookie_ipv4,
+ * Linux 6.0+), so SYNPROXY validates them with the same secret.
+ *
+ * allow_map is an LRU: a flood of good handshakes can push idle long
+ * lived connections out of it. Their packets then miss it and would fail
+ * the cookie check, so before dropping them we ask conntrack, which
+ * SYNPROXY put the connection into. */
+
+#define TCPOPT_EOL       0
+#define TCPOPT_NOP       1
+#define TCPOPT_MSS       2
+#define TCPOPT_WINDOW    3
+#define TCPOPT_SACK_PERM 4
+#define TCPOPT_TIMESTAMP 8
+
+#define IP_DF     0x4000
+#define IP_MF     0x2000
+#define IP_OFFSET 0x1fff
+
+#define TCP_HDR_BUF  64 /* power of two >= the 60 bytes a header can have */
+#define TCP_OPTS_MAX 40
+/* The SYN-ACK options always take this much, unused ones are NOPs */
+#define SYNACK_OPTLEN 20
+
+/* The timestamp cookie: the low bits of our tsval keep what the SYN
+ * offered, the ACK brings them back in tsecr. Same layout as
+ * synproxy_init_timestamp_cookie(). */
+#define TS_OPT_WSCALE_MASK 0xf
+#define TS_OPT_SACK        (1 << 4)
+#define TS_OPT_LOW_BITS    0x3f
+
+/* Non-zero at the index of a protected port (host byte order) */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 65536);
+    __type(key, __u32);
+    __type(value, __u32);
+} ports_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct syncookie_cfg);
+} syncookie_cfg_map SEC(".maps");
+
+/* Flows that completed the cookie handshake, when they did (ns) */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, ALLOW_ENTRIES);
+    __type(key, struct flow_v4);
+    __type(value, __u64);
+} allow_map SEC(".maps");
+
+/* Packets per enum syncookie_stat */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, STAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+} stats_map SEC(".maps");
+
+/* nf_conntrack kfuncs, resolved against the kernel's BTF at load time.
+ * The opts layout is that of Linux 6.1+, 6.0 has reserved[3] in place
+ * of dir, same size. */
+struct nf_conn;
+
+struct bpf_ct_opts {
+    __s32 netns_id;
+    __s32 error;
+    __u8 l4proto;
+    __u8 dir;
+    __u8 reserved[2];
+};
+
+extern struct nf_conn *bpf_xdp_ct_lookup(struct xdp_md *xdp_ctx, struct bpf_sock_tuple *bpf_tuple,
+                                         __u32 tuple__sz, struct bpf_ct_opts *opts,
+                                         __u32 opts__sz) __ksym;
+extern void bpf_ct_release(struct nf_conn *ct) __ksym;
+
+/* What the SYN offered */
+struct syn_opts {
+    __u8 wscale;
+    __u8 ws_ok;
+    __u8 sack_ok;
+    __u8 ts_ok;
+    __u32 tsval;
+};
+
+static __always_inline int account(__u32 stat, int action)
+{
+    __u64 *cnt = bpf_map_lookup_elem(&stats_map, &stat);
+
+    if (cnt)
+        (*cnt)++;
+    return action;
+}
+
+static __always_inline __u16 csum_fold(__u64 sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Options of a copied TCP header of len bytes */
+static __always_inline void parse_syn_opts(const __u8 *hdr, __u32 len, struct syn_opts *o)
+{
+    __u32 i = sizeof(struct tcphdr);
+
+    for (int n = 0; n < TCP_OPTS_MAX && i < len; n++) {
+        __u8 kind = hdr[i & (TCP_HDR_BUF - 1)], optlen;
+
+        if (kind == TCPOPT_EOL)
+            break;
+        if (kind == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        optlen = hdr[(i + 1) & (TCP_HDR_BUF - 1)];
+        if (optlen < 2 || i + optlen > len)
+            break;
+
+        switch (kind) {
+            case TCPOPT_WINDOW:
+                if (optlen == 3) {
+                    o->wscale = hdr[(i + 2) & (TCP_HDR_BUF - 1)];
+                    if (o->wscale > 14)
+                        o->wscale = 14;
+                    o->ws_ok = 1;
+                }
+                break;
+            case TCPOPT_SACK_PERM:
+                o->sack_ok = optlen == 2;
+                break;
+            case TCPOPT_TIMESTAMP:
+                if (optlen == 10) {
+                    o->tsval = (__u32) hdr[(i + 2) & (TCP_HDR_BUF - 1)] << 24 |
+                               (__u32) hdr[(i + 3) & (TCP_HDR_BUF - 1)] << 16 |
+                               (__u32) hdr[(i + 4) & (TCP_HDR_BUF - 1)] << 8 |
+                               hdr[(i + 5) & (TCP_HDR_BUF - 1)];
+                    o->ts_ok = 1;
+                }
+                break;
+        }
+        i += optlen;
+    }
+}
+
+/* Window scaling and SACK only fit into the timestamp cookie, without
+ * timestamps the SYN-ACK offers just the MSS, as kernel cookies do */
+static __always_inline void synack_opts(__u8 *opt, const struct syn_opts *o,
+                                        const struct syncookie_cfg *cfg)
+{
+    __u32 tsval, tsecr;
+
+    __builtin_memset(opt, TCPOPT_NOP, SYNACK_OPTLEN);
+    opt[0] = TCPOPT_MSS;
+    opt[1] = 4;
+    opt[2] = cfg->mss >> 8;
+    opt[3] = cfg->mss & 0xff;
+    if (!o->ts_ok)
+        return;
+
+    tsval = (bpf_ktime_get_ns() / 1000000) & ~TS_OPT_LOW_BITS;
+    tsval |= o->ws_ok ? o->wscale : TS_OPT_WSCALE_MASK;
+    if (o->sack_ok) {
+        tsval |= TS_OPT_SACK;
+        opt[4] = TCPOPT_SACK_PERM;
+        opt[5] = 2;
+    }
+    tsval = bpf_htonl(tsval);
+    tsecr = bpf_htonl(o->tsval);
+    opt[6] = TCPOPT_TIMESTAMP;
+    opt[7] = 10;
+    __builtin_memcpy(&opt[8], &tsval, sizeof(tsval));
+    __builtin_memcpy(&opt[12], &tsecr, sizeof(tsecr));
+    if (o->ws_ok) {
+        opt[17] = TCPOPT_WINDOW;
+        opt[18] = 3;
+        opt[19] = cfg->wscale;
+    }
+}
+
+/* Turn the SYN into the SYN-ACK in place. Its length becomes fixed:
+ * Ethernet, IPv4 without options, TCP with SYNACK_OPTLEN of options. */
+static __always_inline int syn_reply(struct xdp_md *ctx, struct iphdr *ip, struct tcphdr *th)
+{
+    const __u32 reply_len = sizeof(struct ethhdr) + sizeof(struct iphdr) +
+                            sizeof(struct tcphdr) + SYNACK_OPTLEN;
+    __u8 hdr[TCP_HDR_BUF] = {}, opt[SYNACK_OPTLEN], mac[ETH_ALEN];
+    __u32 th_len = th->doff * 4, zero = 0, cookie, seq, addr;
+    struct syn_opts o = {};
+    struct syncookie_cfg *cfg;
+    struct ethhdr *eth;
+    void *data, *data_end;
+    __u16 port;
+    __s64 value;
+    __u64 sum;
+    int delta;
+
+    cfg = bpf_map_lookup_elem(&syncookie_cfg_map, &zero);
+    if (!cfg || th_len < sizeof(*th))
+        return account(STAT_DROP, XDP_DROP);
+
+    /* The helper reads th_len bytes, from the stack that's easy to prove */
+    if (bpf_xdp_load_bytes(ctx, sizeof(struct ethhdr) + sizeof(*ip), hdr, th_len))
+        return account(STAT_DROP, XDP_DROP);
+    value = bpf_tcp_raw_gen_syncookie_ipv4(ip, (struct tcphdr *) hdr, th_len);
+    if (value < 0)
+        return account(STAT_DROP, XDP_DROP);
+    cookie = (__u32) value;
+    parse_syn_opts(hdr, th_len, &o);
+    synack_opts(opt, &o, cfg);
+
+    data = (void *) (long) ctx->data;
+    data_end = (void *) (long) ctx->data_end;
+    delta = (int) reply_len - (int) (data_end - data);
+    if (delta && bpf_xdp_adjust_tail(ctx, delta))
+        return account(STAT_DROP, XDP_DROP);
+
+    /* The headers before the options are still in place */
+    data = (void *) (long) ctx->data;
+    data_end = (void *) (long) ctx->data_end;
+    eth = data;
+    ip = (void *) (eth + 1);
+    th = (void *) (ip + 1);
+    if (data + reply_len > data_end)
+        return account(STAT_DROP, XDP_DROP);
+
+    __builtin_memcpy(mac, eth->h_source, ETH_ALEN);
+    __builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+    __builtin_memcpy(eth->h_dest, mac, ETH_ALEN);
+
+    addr = ip->saddr;
+    ip->saddr = ip->daddr;
+    ip->daddr = addr;
+    ip->tot_len = bpf_htons(reply_len - sizeof(struct ethhdr));
+    ip->id = 0;
+    ip->frag_off = bpf_htons(IP_DF);
+    ip->ttl = cfg->ttl;
+    ip->check = 0;
+    ip->check = csum_fold((__u32) bpf_csum_diff(0, 0, (__be32 *) ip, sizeof(*ip), 0));
+
+    port = th->source;
+    th->source = th->dest;
+    th->dest = port;
+    seq = th->seq;
+    th->seq = bpf_htonl(cookie);
+    th->ack_seq = bpf_htonl(bpf_ntohl(seq) + 1);
+    th->res1 = 0;
+    th->doff = (sizeof(*th) + SYNACK_OPTLEN) / 4;
+    th->fin = th->rst = th->psh = th->urg = th->ece = th->cwr = 0;
+    th->syn = th->ack = 1;
+    th->window = 0; /* SYNPROXY opens it once the listener answered */
+    th->urg_ptr = 0;
+    __builtin_memcpy(th + 1, opt, SYNACK_OPTLEN);
+
+    th->check = 0;
+    sum = (__u32) bpf_csum_diff(0, 0, (__be32 *) th, sizeof(*th) + SYNACK_OPTLEN, 0);
+    sum += (__u64) ip->saddr + ip->daddr +
+           bpf_htonl(IPPROTO_TCP << 16 | (sizeof(*th) + SYNACK_OPTLEN));
+    th->check = csum_fold(sum);
+
+    return account(STAT_SYNACK, XDP_TX);
+}
+
+/* Whether conntrack has the connection of this client packet */
+static __always_inline int ct_known(struct xdp_md *ctx, const struct flow_v4 *flow)
+{
+    struct bpf_sock_tuple tuple = {};
+    struct bpf_ct_opts opts = {.netns_id = BPF_F_CURRENT_NETNS, .l4proto = IPPROTO_TCP};
+    struct nf_conn *ct;
+
+    tuple.ipv4.saddr = flow->saddr;
+    tuple.ipv4.daddr = flow->daddr;
+    tuple.ipv4.sport = flow->sport;
+    tuple.ipv4.dport = flow->dport;
+    ct = bpf_xdp_ct_lookup(ctx, &tuple, sizeof(tuple.ipv4), &opts, sizeof(opts));
+    if (!ct)
+        return 0;
+    bpf_ct_release(ct);
+    return 1;
+}
+
+SEC("xdp")
+int  xdp_syncookie(struct xdp_md *ctx)
+{
+    void *data = (void *) (long) ctx->data;
+    void *data_end = (void *) (long) ctx->data_end;
+    struct ethhdr *eth = data;
+    struct iphdr *ip = (void *) (eth + 1);
+    struct flow_v4 flow;
+    struct tcphdr *th;
+    __u32 port, *protect;
+    __u64 now;
+
+    if ((void *) (ip + 1) > data_end) // To pass eBPF verifier
+        return XDP_PASS;
+    if (eth->h_proto != bpf_htons(ETH_P_IP) || ip->protocol != IPPROTO_TCP)
+        return XDP_PASS;
+    /* Later fragments have no ports, the kernel reassembles them */
+    if (ip->frag_off & bpf_htons(IP_OFFSET))
+        return XDP_PASS;
+
+    th = (void *) ip + ip->ihl * 4;
+    if ((void *) (th + 1) > data_end)
+        return XDP_PASS;
+    port = bpf_ntohs(th->dest);
+    protect = bpf_map_lookup_elem(&ports_map, &port);
+    if (!protect || !*protect)
+        return XDP_PASS;
+
+    /* IP options or a first fragment on a protected port, never seen
+     * in a legitimate handshake */
+    if (ip->ihl != 5 || ip->frag_off & bpf_htons(IP_MF))
+        return account(STAT_DROP, XDP_DROP);
+    th = (void *) (ip + 1);
+    if ((void *) (th + 1) > data_end)
+        return account(STAT_DROP, XDP_DROP);
+
+    if (th->syn && !th->ack)
+        return syn_reply(ctx, ip, th);
+
+    flow.saddr = ip->saddr;
+    flow.daddr = ip->daddr;
+    flow.sport = th->source;
+    flow.dport = th->dest;
+    if (bpf_map_lookup_elem(&allow_map, &flow)) {
+        /* The rest of the teardown is conntrack's business, see below */
+        if (th->fin || th->rst)
+            bpf_map_delete_elem(&allow_map, &flow);
+        return account(STAT_ALLOWED, XDP_PASS);
+    }
+
+    if (ct_known(ctx, &flow)) {
+        /* Evicted but alive: back into allow_map once it carries data
+         * again, not for the last ACKs of a connection going away */
+        now = bpf_ktime_get_ns();
+        if (!th->fin && !th->rst && bpf_ntohs(ip->tot_len) > sizeof(*ip) + th->doff * 4)
+            bpf_map_update_elem(&allow_map, &flow, &now, BPF_ANY);
+        return account(STAT_CONNTRACK, XDP_PASS);
+    }
+
+    if (!th->ack || th->syn || th->rst)
+        return account(STAT_DROP, XDP_DROP);
+    if (bpf_tcp_raw_check_syncookie_ipv4(ip, th))
+        return account(STAT_COOKIE_BAD, XDP_DROP);
+
+    now = bpf_ktime_get_ns();
+    bpf_map_update_elem(&allow_map, &flow, &now, BPF_ANY);
+    return account(STAT_COOKIE_OK, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
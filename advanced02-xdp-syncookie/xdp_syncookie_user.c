@@ -0,0 +1,433 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> // uint32_t uint16_t define
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "common.h"
+
+/* xdp prog loading related config options */
+struct config {
+    uint32_t xdp_flags;
+    int ifindex;
+    char *ifname;
+    char filename[512];
+    char progname[32];
+    bool do_unload;
+    bool set_cfg;               /* --mss, --wscale or --ttl given */
+    struct syncookie_cfg synack;
+};
+
+static const char *ports_path = "/sys/fs/bpf/syncookie_ports";
+static const char *cfg_path = "/sys/fs/bpf/syncookie_cfg";
+static const char *allow_path = "/sys/fs/bpf/syncookie_allow";
+static const char *stats_path = "/sys/fs/bpf/syncookie_stats";
+
+static const char *const stat_names[STAT_MAX] = {
+        [STAT_SYNACK] = "syn-ack sent",
+        [STAT_COOKIE_OK] = "cookie ok",
+        [STAT_COOKIE_BAD] = "cookie bad",
+        [STAT_ALLOWED] = "allowed",
+        [STAT_DROP] = "drop",
+        [STAT_CONNTRACK] = "conntrack",
+};
+
+static void usage(char *name) {
+    printf("usage %s [options] \n\n"
+           "Requried options:\n"
+           "-d, --dev <ifname>\t\tSpecify the device <ifname>\n\n"
+
+           "Other options:\n"
+           "-h, --help\t\tthis text you see right here\n"
+           "-S, --skb-mode\t\tInstall XDP program in SKB (AKA generic) mode\n"
+           "-N, --native-mode\t(default) Install XDP program in native mode\n"
+           "-F, --force\t\tForce install, replacing existing program on interface\n"
+           "-U, --unload\t\tUnload XDP program instead of loading\n"
+           "-o, --obj <objname>\tSpecify the obj filename <objname>\n"
+           "-n, --name <progname>\tSpecify the program name <progname>\n"
+
+           "SYN cookies:\n"
+           "    --port-add <port>\tAnswer SYNs to the TCP port with cookies\n"
+           "    --port-delete <port>\tStop protecting the port\n"
+           "    --show\t\tShow the protected ports and the counters\n"
+           "    --allowed\t\tShow the flows that passed the cookie check\n"
+           "    --mss <n>\t\tMSS the SYN-ACKs advertise, default %d\n"
+           "    --wscale <n>\tWindow scale they advertise, default %d, has to\n"
+           "\t\t\tmatch the SYNPROXY rule\n"
+           "    --ttl <n>\t\tTTL of the SYN-ACKs, default %d\n"
+           "\t\t\tWithout -d these change the program already loaded\n",
+           name, SYNCOOKIE_DEFAULT_MSS, SYNCOOKIE_DEFAULT_WSCALE, SYNCOOKIE_DEFAULT_TTL);
+} // End of usage
+
+static int open_map(const char *path) {
+    int map_fd = bpf_obj_get(path);
+
+    if (map_fd < 0)
+        fprintf(stderr, "Error: Failed to fetch the map %s: %d (%s)\n",
+                path, map_fd, strerror(errno));
+    return map_fd;
+}
+
+static int parse_port(const char *str, __u32 *port) {
+    char *end;
+    unsigned long p = strtoul(str, &end, 10);
+
+    if (*end || end == str || !p || p > 65535) {
+        fprintf(stderr, "Error: Invalid port %s\n", str);
+        return -1;
+    }
+    *port = p;
+    return 0;
+}
+
+static int port_update(const char *str, bool add) {
+    __u32 port, value = add;
+    int map_fd;
+
+    if (parse_port(str, &port))
+        return -1;
+    map_fd = open_map(ports_path);
+    if (map_fd < 0)
+        return -1;
+    if (bpf_map_update_elem(map_fd, &port, &value, BPF_ANY)) {
+        fprintf(stderr, "Error: Failed to update map: %s\n", strerror(errno));
+        return -1;
+    }
+    printf("Success: map updated!\n");
+    return 0;
+}
+
+static int syncookie_cfg_set(int map_fd, const struct syncookie_cfg *synack) {
+    __u32 zero = 0;
+
+    if (bpf_map_update_elem(map_fd, &zero, synack, BPF_ANY)) {
+        fprintf(stderr, "Error: Failed to update map: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int syncookie_show(void) {
+    int ports_fd, cfg_fd, stats_fd, nr_cpus;
+    struct syncookie_cfg synack;
+    __u32 key, value, n = 0;
+
+    ports_fd = open_map(ports_path);
+    cfg_fd = open_map(cfg_path);
+    stats_fd = open_map(stats_path);
+    nr_cpus = libbpf_num_possible_cpus();
+    if (ports_fd < 0 || cfg_fd < 0 || stats_fd < 0 || nr_cpus <= 0)
+        return -1;
+
+    printf("protected ports:");
+    for (key = 0; key < 65536; key++) {
+        if (!bpf_map_lookup_elem(ports_fd, &key, &value) && value) {
+            printf(" %u", key);
+            n++;
+        }
+    }
+    printf("%s\n", n ? "" : " none");
+
+    key = 0;
+    if (!bpf_map_lookup_elem(cfg_fd, &key, &synack))
+        printf("syn-ack: mss %u wscale %u ttl %u\n", synack.mss, synack.wscale, synack.ttl);
+
+    for (key = 0; key < STAT_MAX; key++) {
+        __u64 cnt[nr_cpus], sum = 0;
+
+        if (bpf_map_lookup_elem(stats_fd, &key, cnt)) {
+            fprintf(stderr, "Error: Failed to read map: %s\n", strerror(errno));
+            return -1;
+        }
+        for (int cpu = 0; cpu < nr_cpus; cpu++)
+            sum += cnt[cpu];
+        printf("%-16s %16llu pkts\n", stat_names[key], (unsigned long long) sum);
+    }
+    return 0;
+}
+
+static __u64 ktime_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int allowed_show(void) {
+    struct flow_v4 key, next, *prev = NULL;
+    int map_fd = open_map(allow_path);
+    __u64 now = ktime_now(), since;
+    char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+    if (map_fd < 0)
+        return -1;
+    printf("allowed flows:\n");
+    while (!bpf_map_get_next_key(map_fd, prev, &next)) {
+        key = next;
+        prev = &key;
+        if (bpf_map_lookup_elem(map_fd, &key, &since))
+            continue; /* evicted meanwhile */
+        inet_ntop(AF_INET, &key.saddr, src, sizeof(src));
+        inet_ntop(AF_INET, &key.daddr, dst, sizeof(dst));
+        printf("%s:%u -> %s:%u, %llu s ago\n", src, ntohs(key.sport), dst, ntohs(key.dport),
+               (unsigned long long) (now - since) / 1000000000ULL);
+    }
+    return 0;
+}
+
+static int pin_map(struct bpf_object *obj, const char *name, const char *path) {
+    int map_fd, err;
+
+    map_fd = bpf_object__find_map_fd_by_name(obj, name);
+    if (map_fd < 0) {
+        fprintf(stderr, "Error: bpf_object__find_map_fd_by_name failed\n");
+        return -1;
+    }
+
+    err = bpf_obj_pin(map_fd, path);
+    if (err < 0) {
+        fprintf(stderr, "Error: Failed to pin map to the file system: %d (%s)\n",
+                err, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int err;
+
+    struct config cfg = {
+            /* set XDP_FLAGS_UPDATE_IF_NOEXIST to avoid accidentally unloading
+             * an unrelated XDP program, a good practice */
+            .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_DRV_MODE,
+            .ifindex   = -1,
+            .do_unload = false,
+            .filename = "xdp_syncookie_kern.o",
+            .progname = "xdp_syncookie",
+            .synack = {
+                    .mss = SYNCOOKIE_DEFAULT_MSS,
+                    .wscale = SYNCOOKIE_DEFAULT_WSCALE,
+                    .ttl = SYNCOOKIE_DEFAULT_TTL,
+            },
+    };
+
+    struct option long_options[] = {{"dev",          required_argument, 0, 'd'},
+                                    {"skb-mode",     no_argument,       0, 'S'},
+                                    {"native-mode",  no_argument,       0, 'N'},
+                                    {"force",        no_argument,       0, 'F'},
+                                    {"help",         no_argument,       0, 'h'},
+                                    {"unload",       no_argument,       0, 'U'},
+                                    {"obj",          required_argument, 0, 'o'},
+                                    {"name",         required_argument, 0, 'n'},
+                                    {"port-add",     required_argument, 0, '1'},
+                                    {"port-delete",  required_argument, 0, '2'},
+                                    {"show",         no_argument,       0, '3'},
+                                    {"allowed",      no_argument,       0, '4'},
+                                    {"mss",          required_argument, 0, '5'},
+                                    {"wscale",       required_argument, 0, '6'},
+                                    {"ttl",          required_argument, 0, '7'},
+                                    {0, 0, 0, 0}
+    };
+    int c, option_index;
+    unsigned long n;
+
+    while ((c = getopt_long(argc, argv, "d:SNFhUo:n:1:2:345:6:7:", long_options, &option_index)) != EOF) {
+        switch (c) {
+            case 'd':
+                if (strlen(optarg) >= IF_NAMESIZE) {
+                    fprintf(stderr, "Error: dev name is too long\n");
+                    goto error;
+                }
+                cfg.ifname = optarg;
+                cfg.ifindex = if_nametoindex(cfg.ifname);
+                if (cfg.ifindex == 0) {
+                    fprintf(stderr, "ERR: dev name unknown err\n");
+                    goto error;
+                }
+                break;
+            case 'U':
+                cfg.do_unload = true;
+                break;
+            case 'S':
+                cfg.xdp_flags &= ~XDP_FLAGS_MODES;    /* Clear flags */
+                cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;  /* Set   flag */
+                break;
+            case 'N':
+                cfg.xdp_flags &= ~XDP_FLAGS_MODES;    /* Clear flags */
+                cfg.xdp_flags |= XDP_FLAGS_DRV_MODE;  /* Set   flag */
+                break;
+            case 'F':
+                cfg.xdp_flags &= ~XDP_FLAGS_UPDATE_IF_NOEXIST;
+                break;
+            case 'o':
+                strncpy((char *) &cfg.filename, optarg, sizeof(cfg.filename) - 1);
+                break;
+            case 'n':
+                strncpy((char *) &cfg.progname, optarg, sizeof(cfg.progname) - 1);
+                break;
+            case '1':
+                return port_update(optarg, true) ? 1 : 0;
+            case '2':
+                return port_update(optarg, false) ? 1 : 0;
+            case '3':
+                return syncookie_show() ? 1 : 0;
+            case '4':
+                return allowed_show() ? 1 : 0;
+            case '5':
+                n = strtoul(optarg, NULL, 0);
+                if (n < 536 || n > 65535) {
+                    fprintf(stderr, "Error: MSS out of range (536-65535)\n");
+                    goto error;
+                }
+                cfg.synack.mss = n;
+                cfg.set_cfg = true;
+                break;
+            case '6':
+                n = strtoul(optarg, NULL, 0);
+                if (n > 14) {
+                    fprintf(stderr, "Error: window scale out of range (0-14)\n");
+                    goto error;
+                }
+                cfg.synack.wscale = n;
+                cfg.set_cfg = true;
+                break;
+            case '7':
+                n = strtoul(optarg, NULL, 0);
+                if (!n || n > 255) {
+                    fprintf(stderr, "Error: TTL out of range (1-255)\n");
+                    goto error;
+                }
+                cfg.synack.ttl = n;
+                cfg.set_cfg = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            error:
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    } // end of while
+
+    /* Without a device the settings go to the loaded program */
+    if (cfg.ifindex == -1 && cfg.set_cfg) {
+        int cfg_fd = open_map(cfg_path);
+
+        if (cfg_fd < 0 || syncookie_cfg_set(cfg_fd, &cfg.synack))
+            return 1;
+        printf("Success: map updated!\n");
+        return 0;
+    }
+
+    if (cfg.ifindex == -1) {
+        fprintf(stderr, "Error: required option -d/--dev missing\n");
+        usage(argv[0]);
+        return -1;
+    }
+    /* Unload XDP prog */
+    if (cfg.do_unload) {
+        remove(ports_path);
+        remove(cfg_path);
+        remove(allow_path);
+        remove(stats_path);
+
+        err = bpf_xdp_detach(cfg.ifindex, cfg.xdp_flags, NULL);
+        if (err) {
+            fprintf(stderr, "Error: bpf_xdp_detach failed (err=%d): %s\n",
+                    err, strerror(errno));
+            return -1;
+        }
+        printf("Success: XDP prog detached from device:%s(ifindex:%d)\n",
+               cfg.ifname, cfg.ifindex);
+        return 0;
+    }
+
+    /* The verifier would only say "unknown func" */
+    if (libbpf_probe_bpf_helper(BPF_PROG_TYPE_XDP, BPF_FUNC_tcp_raw_gen_syncookie_ipv4, NULL) <= 0 ||
+        libbpf_probe_bpf_helper(BPF_PROG_TYPE_XDP, BPF_FUNC_tcp_raw_check_syncookie_ipv4, NULL) <= 0) {
+        fprintf(stderr, "Error: the kernel has no bpf_tcp_raw_*_syncookie_ipv4 helpers "
+                        "(Linux 6.0+), use net.ipv4.tcp_syncookies instead\n");
+        return 1;
+    }
+
+    /* open obj */
+    struct bpf_object *obj;
+    obj = bpf_object__open_file(cfg.filename, NULL);
+    err = libbpf_get_error(obj);
+    if (err) {
+        fprintf(stderr, "Error: bpf_object__open_file failed (err=%d): %s\n",
+                err, strerror(errno));
+        return -1;
+    }
+
+    struct bpf_program *bpf_prog;
+    bpf_prog = bpf_object__find_program_by_name(obj, cfg.progname);
+    if (!bpf_prog) {
+        fprintf(stderr, "Error: bpf_object__find_program_by_name failed\n");
+        return -1;
+    }
+
+    /* Load obj into kernel */
+    err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "Error: bpf_object__load failed\n"
+                        "Hint: bpf_xdp_ct_lookup needs nf_conntrack, modprobe nf_conntrack\n");
+        return 1;
+    }
+
+    if (syncookie_cfg_set(bpf_object__find_map_fd_by_name(obj, "syncookie_cfg_map"), &cfg.synack))
+        return 1;
+
+    /* Pin the maps to bpf file system */
+    if (pin_map(obj, "ports_map", ports_path) ||
+        pin_map(obj, "syncookie_cfg_map", cfg_path) ||
+        pin_map(obj, "allow_map", allow_path) ||
+        pin_map(obj, "stats_map", stats_path))
+        return 1;
+
+    /* Get file descriptor for program */
+    int prog_fd;
+    prog_fd = bpf_program__fd(bpf_prog);
+    if (prog_fd < 0) {
+        fprintf(stderr, "Error: Couldn't get file descriptor for program\n");
+        return 1;
+    }
+
+    /* load xdp prog in the specified interface */
+    err = bpf_xdp_attach(cfg.ifindex, prog_fd, cfg.xdp_flags, NULL);
+    if (err < 0) {
+        fprintf(stderr, "Error: ifindex(%d) bpf_xdp_attach failed (%d): %s\n",
+                cfg.ifindex, -err, strerror(-err));
+        switch (-err) {
+            case EBUSY:
+            case EEXIST:
+                fprintf(stderr, "Hint: XDP already loaded on device"
+                                " use --force or -F to swap/replace\n");
+                break;
+            case EOPNOTSUPP:
+                fprintf(stderr, "Hint: Native-XDP not supported"
+                                " use --skb-mode or -S\n");
+                break;
+            default:
+                break;
+        }
+        return -1;
+    }
+
+    printf("Success: XDP prog loaded on device:%s(ifindex:%d)\n",
+           cfg.ifname, cfg.ifindex);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __COMMON_H
+#define __COMMON_H
+
+/* Shared by xdp_prog_kern.c and xdp_prog_user.c */
+
+/* Key of blacklist_lpm_map. prefixlen leading bits of addr (network byte
+ * order) have to match, the kernel wants prefixlen first. */
+struct lpm_v4_key {
+    __u32 prefixlen;
+    __u32 addr;
+};
+
+/* Key of the IPv6 blacklist, addresses are /128 prefixes in it */
+struct lpm_v6_key {
+    __u32 prefixlen;
+    __u8 addr[16];
+};
+
+/* Value of the blacklist entries, what they dropped. Per CPU for the
+ * addresses, LPM tries have no per-CPU flavour and are added to
+ * atomically. Also the value of stats_map. */
+struct rule_counters {
+    __u64 packets;
+    __u64 bytes;
+};
+
+/* stats_map keys, what happened to the packets */
+enum xdp_stat {
+    STAT_PASS,
+    STAT_BLACKLIST, /* dropped by blacklist_map, blacklist_lpm_map or blacklist_v6_map */
+    STAT_BAN,       /* dropped by ban_map, or banned right away */
+    STAT_RATE_LIMIT,
+    STAT_CONNTRACK, /* passed on the ct_map fast path */
+    STAT_MAX
+};
+
+/* Connection tracking of TCP flows in ct_map. xdp_prog only sees what
+ * it receives, the key is the 5-tuple as it arrives. */
+struct ct_key {
+    __u32 saddr[4]; /* IPv4 in [0], the rest 0 */
+    __u32 daddr[4];
+    __u16 sport;    /* network byte order */
+    __u16 dport;
+    __u8 proto;
+    __u8 family;    /* 4 or 6 */
+    __u16 pad;
+};
+
+enum ct_state {
+    CT_NONE,        /* not seen on this CPU */
+    CT_SYN_SENT,    /* SYN passed, waiting for the handshake ACK */
+    CT_ESTABLISHED,
+    CT_FIN_WAIT,    /* FIN seen */
+    CT_STATE_MAX
+};
+
+/* Per CPU. A flow sticks to its RX queue, should it show up on another
+ * CPU it finds CT_NONE there and goes through the policy once more. */
+struct ct_entry {
+    __u64 last_seen; /* bpf_ktime_get_ns() */
+    __u64 packets;
+    __u64 bytes;
+    __u32 state;
+    __u32 gen;       /* blacklist generation the flow was checked against */
+    __u32 epoch;     /* policy_epoch_map then */
+    __u32 pad;
+};
+
+/* Default size of ct_map, xdp_prog_user --ct-entries. Every entry has a
+ * value for each possible CPU. */
+#define CT_ENTRIES 65536
+
+/* Idle time after which a flow goes through the policy again */
+#define CT_TIMEOUT_SYN_S 30
+#define CT_TIMEOUT_EST_S 300
+#define CT_TIMEOUT_FIN_S 10
+
+/* Default size of the blacklist_map generations, xdp_prog_user
+ * --max-entries changes it */
+#define BLACKLIST_ENTRIES 65536
+
+/* Prefixes in the blacklist_lpm_map generations, e.g. a few thousand /16
+ * and /24 cover millions of addresses */
+#define BLACKLIST_LPM_ENTRIES 16384 /* --max-prefixes, also of blacklist_v6_map */
+
+/* Slots of the outer blacklist maps: the generation in use and the one
+ * being built */
+#define BLACKLIST_GENERATIONS 2
+
+/* Rate limit of the sources in a prefix, rate_class_map value */
+struct rate_class {
+    __u64 rate;  /* packets per second, per CPU */
+    __u64 burst; /* bucket depth in packets, at least 1 */
+};
+
+/* Per source and CPU, rate_limit_map value */
+struct token_bucket {
+    __u64 tokens;  /* in 1/RATE_LIMIT_UNIT packets */
+    __u64 last_ns; /* last refill, bpf_ktime_get_ns() */
+    __u64 passed;
+    __u64 dropped;
+};
+
+#define RATE_LIMIT_UNIT      1000000000ULL /* tokens per packet, 1 per ns at 1 pps */
+#define RATE_LIMIT_MAX_BURST 1000000000ULL /* keeps burst * RATE_LIMIT_UNIT in 64 bits */
+#define RATE_CLASS_ENTRIES   1024
+#define RATE_LIMIT_SOURCES   65536 /* buckets, least recently used go first */
+
+/* Heavy hitter detection: a count-min sketch per CPU counts packets per
+ * source in windows of window_ns. A source whose estimate reaches
+ * threshold within a window is put into ban_map for ban_ns. */
+struct hh_cfg {
+    __u32 threshold; /* packets per window and CPU, 0 is off */
+    __u32 pad;
+    __u64 window_ns;
+    __u64 ban_ns;
+};
+
+#define HH_DEPTH       2    /* rows, an estimate is the minimum over them */
+#define HH_WIDTH       1024 /* counters per row, a power of two */
+#define HH_BAN_ENTRIES 65536
+
+struct hh_cell {
+    __u32 epoch; /* window the count belongs to, older counts are stale */
+    __u32 count;
+};
+
+struct hh_sketch {
+    struct hh_cell cells[HH_DEPTH][HH_WIDTH];
+};
+
+#endif /* __COMMON_H */
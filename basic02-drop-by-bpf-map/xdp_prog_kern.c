@@ -5,43 +5,491 @@
 #include <linux/ip.h>
 #include <arpa/inet.h>
 #include <linux/in.h>
+#include <linux/ipv6.h>
 #include <bpf/bpf_helpers.h>
 
+#include "common.h"
+#include "parsing_helpers.h"
+
+/* The blacklist is built by xdp_prog_user in generations. A generation
+ * is an inner map in each of the outer maps below, at the index in
+ * blacklist_gen_map. A new one is filled while the old one is in use,
+ * then a single write to blacklist_gen_map switches all of them over. */
+
+/* Single addresses, checked first */
+struct blacklist_v4 {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(max_entries, BLACKLIST_ENTRIES);
+    __type(key, __u32);
+    __type(value, struct rule_counters);
+};
+
+/* CIDR prefixes, checked when the exact match misses. A lookup walks at
+ * most 32 trie levels however many prefixes there are. */
+struct blacklist_lpm_v4 {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, BLACKLIST_LPM_ENTRIES);
+    __type(key, struct lpm_v4_key);
+    __type(value, struct rule_counters);
+    __uint(map_flags, BPF_F_NO_PREALLOC); /* required for LPM tries */
+};
+
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1000);
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, BLACKLIST_GENERATIONS);
     __type(key, __u32);
-    __type(value, __u32);
+    __array(values, struct blacklist_v4);
 } blacklist_map SEC(".maps");
 
-SEC("xdp")
-int  xdp_prog(struct xdp_md *ctx)
+/* IPv6 addresses and prefixes, a single trie for both */
+struct blacklist_lpm_v6 {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, BLACKLIST_LPM_ENTRIES);
+    __type(key, struct lpm_v6_key);
+    __type(value, struct rule_counters);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, BLACKLIST_GENERATIONS);
+    __type(key, __u32);
+    __array(values, struct blacklist_lpm_v4);
+} blacklist_lpm_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, BLACKLIST_GENERATIONS);
+    __type(key, __u32);
+    __array(values, struct blacklist_lpm_v6);
+} blacklist_v6_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32); /* generation in use */
+} blacklist_gen_map SEC(".maps");
+
+/* Bumped by xdp_prog_user whenever it changes the policy in place (an
+ * entry of the generation in use, a rate limit, the auto-ban settings),
+ * tracked flows go through the policy again */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} policy_epoch_map SEC(".maps");
+
+/* Packets and bytes per enum xdp_stat */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, STAT_MAX);
+    __type(key, __u32);
+    __type(value, struct rule_counters);
+} stats_map SEC(".maps");
+
+/* Which sources get rate limited, and how much. Longest prefix wins,
+ * sources without a class are not limited. */
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, RATE_CLASS_ENTRIES);
+    __type(key, struct lpm_v4_key);
+    __type(value, struct rate_class);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} rate_class_map SEC(".maps");
+
+/* A token bucket per source and CPU, no atomics needed. Sources that
+ * went quiet are recycled when the map is full. */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(max_entries, RATE_LIMIT_SOURCES);
+    __type(key, __u32);
+    __type(value, struct token_bucket);
+} rate_limit_map SEC(".maps");
+
+/* Heavy hitter detection, see common.h */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct hh_cfg);
+} hh_cfg_map SEC(".maps");
+
+/* Per CPU, so counting needs no atomics. Cells carry their window
+ * instead of being cleared when a window ends. */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct hh_sketch);
+} hh_sketch_map SEC(".maps");
+
+/* Flows that passed the policy, see struct ct_entry */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(max_entries, CT_ENTRIES);
+    __type(key, struct ct_key);
+    __type(value, struct ct_entry);
+} ct_map SEC(".maps");
+
+/* Banned sources and when the ban ends (bpf_ktime_get_ns()). Expired
+ * entries are deleted by xdp_prog_user --reap. */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, HH_BAN_ENTRIES);
+    __type(key, __u32);
+    __type(value, __u64);
+} ban_map SEC(".maps");
+
+static __always_inline void *blacklist_lookup(void *outer, __u32 gen, const void *key)
 {
-    int ipsize = 0;
-    void *data = (void *) (long) ctx->data;
-    void *data_end = (void *) (long) ctx->data_end;
-    struct ethhdr *eth = data;
-    struct iphdr *ip;
-    ipsize = sizeof(*eth);
-    ip = data + ipsize;
-    ipsize += sizeof(struct iphdr);
-    if (data + ipsize > data_end) { // To pass eBPF verifier
+    void *inner = bpf_map_lookup_elem(outer, &gen);
+
+    if (!inner)
+        return 0;
+    return bpf_map_lookup_elem(inner, key);
+}
+
+static __always_inline int account(__u32 stat, __u64 bytes, int action)
+{
+    struct rule_counters *c = bpf_map_lookup_elem(&stats_map, &stat);
+
+    if (c) {
+        c->packets++;
+        c->bytes += bytes;
+    }
+    return action;
+}
+
+static __always_inline int banned(__u32 saddr, __u64 now)
+{
+    __u64 *expiry = bpf_map_lookup_elem(&ban_map, &saddr);
+
+    return expiry && *expiry > now;
+}
+
+static __always_inline __u32 hh_index(__u32 saddr, __u32 row)
+{
+    __u32 h = (saddr ^ (row * 0x9E3779B9)) * 0x85EBCA6B;
+
+    h ^= h >> 16;
+    return h & (HH_WIDTH - 1);
+}
+
+/* Count saddr in this CPU's sketch and ban it once its estimate for the
+ * current window reaches the threshold. Returns whether it got banned. */
+static __always_inline int heavy_hitter(__u32 saddr, __u64 now)
+{
+    __u32 zero = 0, epoch, est = ~0U;
+    struct hh_sketch *sk;
+    struct hh_cfg *cfg;
+
+    cfg = bpf_map_lookup_elem(&hh_cfg_map, &zero);
+    if (!cfg || !cfg->threshold || !cfg->window_ns)
+        return 0;
+    sk = bpf_map_lookup_elem(&hh_sketch_map, &zero);
+    if (!sk)
+        return 0;
+
+    epoch = now / cfg->window_ns;
+#pragma unroll
+    for (__u32 row = 0; row < HH_DEPTH; row++) {
+        struct hh_cell *c = &sk->cells[row][hh_index(saddr, row)];
+
+        if (c->epoch != epoch) {
+            c->epoch = epoch;
+            c->count = 0;
+        }
+        c->count++;
+        if (c->count < est)
+            est = c->count;
+    }
+
+    /* Banned sources don't get here, the ban is checked first */
+    if (est >= cfg->threshold) {
+        __u64 expiry = now + cfg->ban_ns;
+
+        bpf_map_update_elem(&ban_map, &saddr, &expiry, BPF_ANY);
+        return 1;
+    }
+    return 0;
+}
+
+/* Refill saddr's bucket for the time since its last packet, then take a
+ * token for this one or drop it */
+static __always_inline int rate_limit(__u32 saddr, __u64 now)
+{
+    struct lpm_v4_key key = {.prefixlen = 32, .addr = saddr};
+    struct token_bucket *tb, new_tb = {};
+    struct rate_class *rc;
+    __u64 cap, tokens;
+
+    rc = bpf_map_lookup_elem(&rate_class_map, &key);
+    if (!rc)
+        return XDP_PASS;
+
+    cap = rc->burst * RATE_LIMIT_UNIT;
+    tb = bpf_map_lookup_elem(&rate_limit_map, &saddr);
+    if (!tb) {
+        /* New source, starts with a full bucket */
+        new_tb.tokens = cap - RATE_LIMIT_UNIT;
+        new_tb.last_ns = now;
+        new_tb.passed = 1;
+        bpf_map_update_elem(&rate_limit_map, &saddr, &new_tb, BPF_NOEXIST);
+        return XDP_PASS;
+    }
+
+    /* Compare before multiplying, a long idle time would overflow */
+    if (tb->tokens >= cap || now - tb->last_ns >= (cap - tb->tokens) / rc->rate)
+        tokens = cap;
+    else
+        tokens = tb->tokens + (now - tb->last_ns) * rc->rate;
+    tb->last_ns = now;
+
+    if (tokens < RATE_LIMIT_UNIT) {
+        tb->tokens = tokens;
+        tb->dropped++;
         return XDP_DROP;
     }
+    tb->tokens = tokens - RATE_LIMIT_UNIT;
+    tb->passed++;
+    return XDP_PASS;
+}
+
+#define CT_TCP_FIN 0x01
+#define CT_TCP_SYN 0x02
+#define CT_TCP_RST 0x04
+#define CT_TCP_ACK 0x10
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static __always_inline __u64 ct_timeout(__u32 state)
+{
+    switch (state) {
+        case CT_SYN_SENT:
+            return CT_TIMEOUT_SYN_S * NSEC_PER_SEC;
+        case CT_ESTABLISHED:
+            return CT_TIMEOUT_EST_S * NSEC_PER_SEC;
+        default:
+            return CT_TIMEOUT_FIN_S * NSEC_PER_SEC;
+    }
+}
+
+/* Ports and flags of a TCP packet into key, -1 for anything else: UDP
+ * and the rest have no handshake to go by and always get the policy */
+static __always_inline int ct_parse(struct hdr_cursor *nh, void *data_end, int l4,
+                                    struct ct_key *key, __u8 *flags)
+{
+    struct tcphdr *th;
+
+    if (l4 != IPPROTO_TCP || parse_tcphdr(nh, data_end, &th) < 0)
+        return -1;
+    key->sport = th->source;
+    key->dport = th->dest;
+    key->proto = IPPROTO_TCP;
+    *flags = ((__u8 *) th)[13];
+    return 0;
+}
+
+static __always_inline int ct_expired(const struct ct_entry *ct, __u64 now)
+{
+    return ct->state == CT_NONE || now - ct->last_seen > ct_timeout(ct->state);
+}
+
+/* Counts the packet, RST ends the flow and FIN starts its end */
+static __always_inline void ct_update(struct ct_entry *ct, const struct ct_key *key,
+                                      __u8 flags, __u64 bytes, __u64 now)
+{
+    if (flags & CT_TCP_RST)
+        bpf_map_delete_elem(&ct_map, key);
+    else if (flags & CT_TCP_FIN)
+        ct->state = CT_FIN_WAIT;
+    ct->last_seen = now;
+    ct->packets++;
+    ct->bytes += bytes;
+}
+
+/* The fast path, for flows past their SYN that were checked against the
+ * policy in use and haven't timed out. Anything else, a repeated SYN as
+ * well, returns -1 and goes through the policy. Bans are per source and
+ * come and go with other flows, they are checked on every packet, and
+ * heavy hitter detection has to see the packets it counts. */
+static __always_inline int ct_track(struct ct_entry *ct, const struct ct_key *key,
+                                    __u8 flags, __u32 gen, __u32 epoch, __u64 bytes, __u64 now)
+{
+    if (ct_expired(ct, now) || ct->gen != gen || ct->epoch != epoch)
+        return -1;
+    if (ct->state == CT_SYN_SENT && (flags & (CT_TCP_SYN | CT_TCP_ACK)) != CT_TCP_ACK)
+        return -1;
+    if (key->family == 4 && (banned(key->saddr[0], now) || heavy_hitter(key->saddr[0], now)))
+        return -1;
+
+    if (ct->state == CT_SYN_SENT)
+        ct->state = CT_ESTABLISHED;
+    ct_update(ct, key, flags, bytes, now);
+    return account(STAT_CONNTRACK, bytes, XDP_PASS);
+}
+
+/* Rate limits count every packet of a source, its flows stay off the
+ * fast path */
+static __always_inline int ct_allowed(const struct ct_key *key)
+{
+    struct lpm_v4_key lpm_key = {.prefixlen = 32, .addr = key->saddr[0]};
+
+    return key->family != 4 || !bpf_map_lookup_elem(&rate_class_map, &lpm_key);
+}
+
+/* A packet that passed the policy starts tracking its flow. Only from
+ * a SYN (or the SYN-ACK of a connection this host opened), flows picked
+ * up in the middle could be anything. ct is this CPU's stale copy, if
+ * the flow has an entry: one still alive was only sent through the policy
+ * because that changed, and is checked against the new one now. */
+static __always_inline void ct_new(struct ct_entry *ct, const struct ct_key *key, __u8 flags,
+                                   __u32 gen, __u32 epoch, __u64 bytes, __u64 now)
+{
+    struct ct_entry entry = {.last_seen = now, .packets = 1, .bytes = bytes,
+                             .gen = gen, .epoch = epoch};
+
+    if (!ct_allowed(key))
+        return;
+    if (ct && !ct_expired(ct, now) && !(flags & CT_TCP_SYN)) {
+        ct->gen = gen;
+        ct->epoch = epoch;
+        ct_update(ct, key, flags, bytes, now);
+        return;
+    }
+    if ((flags & (CT_TCP_SYN | CT_TCP_RST | CT_TCP_FIN)) != CT_TCP_SYN)
+        return;
+    entry.state = flags & CT_TCP_ACK ? CT_ESTABLISHED : CT_SYN_SENT;
+    if (ct)
+        *ct = entry;
+    else
+        bpf_map_update_elem(&ct_map, key, &entry, BPF_ANY);
+}
 
+/* Blacklist, bans, rate limits, all keyed by the IPv4 source */
+static __always_inline int xdp_ipv4(struct iphdr *ip, __u32 gen, __u64 bytes, __u64 now)
+{
     __u32 key = ip->saddr;
-    __u32 *value;
+    struct lpm_v4_key lpm_key = {.prefixlen = 32, .addr = ip->saddr};
+    struct rule_counters *value;
+
+    if (banned(ip->saddr, now))
+        return account(STAT_BAN, bytes, XDP_DROP);
 
-    value = bpf_map_lookup_elem(&blacklist_map, &key);
+    value = blacklist_lookup(&blacklist_map, gen, &key);
     if (value) {
         // bpf_printk("ip found in blacklist, dropped\n");
-        return XDP_DROP;
+        value->packets++; /* this CPU's copy */
+        value->bytes += bytes;
+        return account(STAT_BLACKLIST, bytes, XDP_DROP);
+    }
+
+    value = blacklist_lookup(&blacklist_lpm_map, gen, &lpm_key);
+    if (value) {
+        // bpf_printk("ip in a blacklisted prefix, dropped\n");
+        __sync_fetch_and_add(&value->packets, 1);
+        __sync_fetch_and_add(&value->bytes, bytes);
+        return account(STAT_BLACKLIST, bytes, XDP_DROP);
+    }
+
+    if (heavy_hitter(ip->saddr, now)) {
+        // bpf_printk("heavy hitter, banned\n");
+        return account(STAT_BAN, bytes, XDP_DROP);
+    }
+
+    if (rate_limit(ip->saddr, now) == XDP_DROP)
+        return account(STAT_RATE_LIMIT, bytes, XDP_DROP);
+
+    // bpf_printk("Good to pass\n");
+    return account(STAT_PASS, bytes, XDP_PASS);
+}
+
+/* IPv6 sources only go through the blacklist */
+static __always_inline int xdp_ipv6(struct ipv6hdr *ip6, __u32 gen, __u64 bytes)
+{
+    struct lpm_v6_key key = {.prefixlen = 128};
+    struct rule_counters *value;
+
+    __builtin_memcpy(key.addr, &ip6->saddr, sizeof(key.addr));
+    value = blacklist_lookup(&blacklist_v6_map, gen, &key);
+    if (value) {
+        __sync_fetch_and_add(&value->packets, 1);
+        __sync_fetch_and_add(&value->bytes, bytes);
+        return account(STAT_BLACKLIST, bytes, XDP_DROP);
+    }
+    return account(STAT_PASS, bytes, XDP_PASS);
+}
+
+SEC("xdp")
+int  xdp_prog(struct xdp_md *ctx)
+{
+    void *data = (void *) (long) ctx->data;
+    void *data_end = (void *) (long) ctx->data_end;
+    struct hdr_cursor nh = {.pos = data};
+    __u64 bytes = data_end - data, now;
+    struct ct_entry *ct = 0;
+    struct ct_key key = {};
+    struct ipv6hdr *ip6 = 0;
+    struct iphdr *ip = 0;
+    struct ethhdr *eth;
+    __u32 zero = 0, *gen_p, *epoch_p, gen, epoch;
+    int proto, l4, action, tracked;
+    __u8 flags = 0;
+
+    /* Behind up to two VLAN tags. Truncated headers are dropped,
+     * anything but IP (ARP, LLDP, ...) passes. */
+    proto = parse_ethhdr(&nh, data_end, &eth);
+    if (proto == bpf_htons(ETH_P_IP)) {
+        l4 = parse_iphdr(&nh, data_end, &ip);
+        if (l4 < 0)
+            return XDP_DROP;
+        if (ip->frag_off & bpf_htons(IP_OFFSET))
+            l4 = -1; /* no ports in later fragments */
+        key.family = 4;
+        key.saddr[0] = ip->saddr;
+        key.daddr[0] = ip->daddr;
+    } else if (proto == bpf_htons(ETH_P_IPV6)) {
+        l4 = parse_ip6hdr(&nh, data_end, &ip6);
+        if (l4 < 0)
+            return XDP_DROP;
+        l4 = skip_ip6hdrext(&nh, data_end, l4);
+        key.family = 6;
+        __builtin_memcpy(key.saddr, &ip6->saddr, sizeof(key.saddr));
+        __builtin_memcpy(key.daddr, &ip6->daddr, sizeof(key.daddr));
     } else {
-        // bpf_printk("Good to pass\n");
+        return proto < 0 ? XDP_DROP : XDP_PASS;
+    }
+
+    /* Read once, all lookups see the same generation. A flow is only
+     * tracked as checked against the policy it was checked against, a
+     * change made meanwhile bumps the values and sends it back here. */
+    gen_p = bpf_map_lookup_elem(&blacklist_gen_map, &zero);
+    epoch_p = bpf_map_lookup_elem(&policy_epoch_map, &zero);
+    if (!gen_p || !epoch_p)
         return XDP_PASS;
+    gen = *(volatile __u32 *)gen_p;
+    epoch = *(volatile __u32 *)epoch_p;
+    now = bpf_ktime_get_ns();
+
+    tracked = !ct_parse(&nh, data_end, l4, &key, &flags);
+    if (tracked) {
+        ct = bpf_map_lookup_elem(&ct_map, &key);
+        if (ct) {
+            action = ct_track(ct, &key, flags, gen, epoch, bytes, now);
+            if (action >= 0)
+                return action;
+        }
     }
 
-    return XDP_PASS;
+    if (proto == bpf_htons(ETH_P_IP))
+        action = xdp_ipv4(ip, gen, bytes, now);
+    else
+        action = xdp_ipv6(ip6, gen, bytes);
+    if (tracked && action == XDP_PASS)
+        ct_new(ct, &key, flags, gen, epoch, bytes, now);
+    return action;
 }
 
 char _license[] SEC("license") = "GPL";
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -14,6 +16,12 @@
 #include <net/if.h>
 #include <linux/if_link.h> /* depend on kernel-headers installed */
 
+#include "common.h"
+
+#ifndef ENOTSUPP
+#define ENOTSUPP 524 /* kernel internal, leaks out of some bpf() commands */
+#endif
+
 /* xdp prog loading related config options */
 struct config {
     uint32_t xdp_flags;
@@ -22,9 +30,54 @@ struct config {
     char filename[512];
     char progname[32];
     bool do_unload;
+    bool show;          /* --map-show */
+    int top;            /* --top, -1 lists the blacklist as is */
+    __u32 max_entries;  /* of blacklist_map, 0 keeps the default */
+    __u32 max_prefixes; /* of blacklist_lpm_map */
+    __u32 ct_entries;   /* of ct_map, 0 keeps the default */
+    int action;         /* option of the command to run instead of loading, 0 for none */
+    const char *action_arg;
 };
 
 static const char *file_path = "/sys/fs/bpf/black_list";
+static const char *lpm_file_path = "/sys/fs/bpf/black_list_lpm";
+static const char *gen_file_path = "/sys/fs/bpf/black_list_gen";
+static const char *v6_file_path = "/sys/fs/bpf/black_list_v6";
+static const char *rate_class_path = "/sys/fs/bpf/rate_class";
+static const char *rate_limit_path = "/sys/fs/bpf/rate_limit";
+static const char *hh_cfg_path = "/sys/fs/bpf/auto_ban_cfg";
+static const char *ban_path = "/sys/fs/bpf/auto_ban";
+static const char *stats_path = "/sys/fs/bpf/xdp_stats";
+static const char *ct_path = "/sys/fs/bpf/conntrack";
+static const char *epoch_path = "/sys/fs/bpf/policy_epoch";
+
+static const char *const stat_names[STAT_MAX] = {
+        [STAT_PASS] = "pass",
+        [STAT_BLACKLIST] = "drop blacklist",
+        [STAT_BAN] = "drop ban",
+        [STAT_RATE_LIMIT] = "drop rate limit",
+        [STAT_CONNTRACK] = "pass conntrack",
+};
+
+static const char *const ct_state_names[CT_STATE_MAX] = {
+        [CT_NONE] = "none",
+        [CT_SYN_SENT] = "syn_sent",
+        [CT_ESTABLISHED] = "established",
+        [CT_FIN_WAIT] = "fin_wait",
+};
+
+/* Possible CPUs, per-CPU map values come as one copy for each */
+static int nr_cpus;
+
+/* --auto-ban defaults and --reap interval */
+#define HH_DEFAULT_WINDOW_MS 10
+#define HH_DEFAULT_BAN_S     60
+#define HH_REAP_INTERVAL_S   1
+
+/* Keys per batch syscall of --import, --export, --map-show and
+ * --map-delete all */
+#define BATCH_CHUNK 65536
+#define BATCH_VALUE_BYTES (16 << 20) /* value buffer limit per syscall */
 
 static void usage(char *name) {
     printf("usage %s [options] \n\n"
@@ -42,19 +95,1079 @@ static void usage(char *name) {
            "-n, --name <progname>\tSpecify the program name <progname>\n"
 
            "Map operations:\n"
-           "    --map-add <addr>\tAdd an IP to blacklist_map\n"
-           "    --map-delete <addr/all>\tDelete an IP to blacklist_map\n"
-           "    --map-show\t\tShow blocked IPs in blacklist_map\n", name);
+           "    --map-add <addr>[/len]\tAdd an IPv4 or IPv6 address, or a CIDR prefix,\n"
+           "\t\t\tto the blacklist\n"
+           "    --map-delete <addr>[/len]|all\tDelete an IP or prefix from the blacklist,\n"
+           "\t\t\tall switches to an empty generation\n"
+           "    --map-show\t\tShow blocked IPs and prefixes\n"
+           "    --top <n>\t\tWith --map-show: the packet counters, and the n entries\n"
+           "\t\t\tthat dropped the most (0 for all, least used last)\n"
+           "    --import <file>\tAdd the IPs and prefixes listed in <file>, one per line\n"
+           "    --replace <file>\tBuild a new generation from <file> and switch to it\n"
+           "    --export <file>\tWrite the blacklist to <file> in the --import format\n"
+           "    --max-entries <n>\tAddresses per generation, when loading or with\n"
+           "\t\t\t--replace, default %d (or the size in use)\n"
+           "    --max-prefixes <n>\tPrefixes per generation, default %d, and as many\n"
+           "\t\t\tIPv6 addresses and prefixes\n"
+
+           "Rate limiting:\n"
+           "    --rate-limit <addr>[/len]:<pps>[:<burst>]\tLimit every source in the prefix\n"
+           "\t\t\tto pps packets per second and CPU, bursts of burst (default pps)\n"
+           "    --rate-delete <addr>[/len]\tRemove a rate limit\n"
+           "    --rate-show\t\tShow the rate limits\n"
+           "    --top-throttled <n>\tShow the n sources with the most dropped packets\n"
+
+           "Automatic bans:\n"
+           "    --auto-ban <pps>[:<window_ms>[:<ban_s>]]\tBan sources sending more than pps\n"
+           "\t\t\tpackets per second to a CPU, measured over window_ms (default %d),\n"
+           "\t\t\tfor ban_s seconds (default %d), 0 turns it off\n"
+           "    --bans\t\tShow the banned sources\n"
+           "    --reap\t\tKeep deleting expired bans, every %d s\n"
+
+           "Connection tracking:\n"
+           "    --ct-show\t\tShow the tracked TCP flows\n"
+           "    --ct-flush\t\tForget all flows, they go through the policy again\n"
+           "    --ct-entries <n>\tFlows tracked, when loading, default %d\n",
+           name, BLACKLIST_ENTRIES, BLACKLIST_LPM_ENTRIES,
+           HH_DEFAULT_WINDOW_MS, HH_DEFAULT_BAN_S, HH_REAP_INTERVAL_S, CT_ENTRIES);
 } // End of usage
 
+/* "a.b.c.d" or "a.b.c.d/len", the bits past len are cleared */
+static int parse_prefix(const char *str, struct lpm_v4_key *key) {
+    char buf[INET_ADDRSTRLEN + 3];
+    char *slash, *end;
+    struct in_addr ia;
+    long len = 32;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+    slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || len < 0 || len > 32)
+            return -1;
+    }
+    if (inet_pton(AF_INET, buf, &ia) != 1)
+        return -1;
+
+    key->prefixlen = len;
+    key->addr = len ? ia.s_addr & htonl(~0U << (32 - len)) : 0;
+    return 0;
+}
+
+/* Same for IPv6, "addr" is a /128 */
+static int parse_prefix6(const char *str, struct lpm_v6_key *key) {
+    char buf[INET6_ADDRSTRLEN + 4];
+    char *slash, *end;
+    long len = 128;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+    slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || len < 0 || len > 128)
+            return -1;
+    }
+    if (inet_pton(AF_INET6, buf, key->addr) != 1)
+        return -1;
+
+    key->prefixlen = len;
+    for (int i = 0; i < 16; i++) {
+        if (len >= 8)
+            len -= 8;
+        else {
+            key->addr[i] &= len ? 0xff << (8 - len) : 0;
+            len = 0;
+        }
+    }
+    return 0;
+}
+
+static int open_map(const char *path) {
+    int map_fd = bpf_obj_get(path);
+
+    if (map_fd < 0)
+        fprintf(stderr, "Error: Failed to fetch the map %s: %d (%s)\n",
+                path, map_fd, strerror(errno));
+    return map_fd;
+}
+
+/* After changing the policy in place: tracked flows go through it again.
+ * Concurrent bumps may collapse into one, any change of the value does. */
+static int policy_changed(void) {
+    int map_fd = open_map(epoch_path);
+    __u32 zero = 0, epoch;
+
+    if (map_fd < 0)
+        return -1;
+    if (bpf_map_lookup_elem(map_fd, &zero, &epoch))
+        goto err;
+    epoch++;
+    if (bpf_map_update_elem(map_fd, &zero, &epoch, BPF_ANY))
+        goto err;
+    return 0;
+
+err:
+    fprintf(stderr, "Error: Can't bump the policy epoch: %s, tracked flows keep "
+                    "passing until --ct-flush\n", strerror(errno));
+    return -1;
+}
+
+/* The pinned outer maps and the generation xdp_prog uses */
+struct blacklist {
+    int outer_fd, lpm_outer_fd, v6_outer_fd, gen_fd;
+    __u32 gen;
+    int map_fd, lpm_fd, v6_fd; /* inner maps of gen */
+};
+
+/* Inner map at index gen of an outer map */
+static int open_inner(int outer_fd, __u32 gen) {
+    __u32 id;
+    int fd;
+
+    if (bpf_map_lookup_elem(outer_fd, &gen, &id)) {
+        fprintf(stderr, "Error: No blacklist generation %u: %s\n", gen, strerror(errno));
+        return -1;
+    }
+    fd = bpf_map_get_fd_by_id(id);
+    if (fd < 0)
+        fprintf(stderr, "Error: Can't open map id %u: %s\n", id, strerror(errno));
+    return fd;
+}
+
+static int blacklist_open(struct blacklist *bl) {
+    __u32 zero = 0;
+
+    bl->outer_fd = open_map(file_path);
+    bl->lpm_outer_fd = open_map(lpm_file_path);
+    bl->v6_outer_fd = open_map(v6_file_path);
+    bl->gen_fd = open_map(gen_file_path);
+    if (bl->outer_fd < 0 || bl->lpm_outer_fd < 0 || bl->v6_outer_fd < 0 || bl->gen_fd < 0)
+        return -1;
+    if (bpf_map_lookup_elem(bl->gen_fd, &zero, &bl->gen)) {
+        fprintf(stderr, "Error: Can't read the blacklist generation: %s\n", strerror(errno));
+        return -1;
+    }
+    bl->map_fd = open_inner(bl->outer_fd, bl->gen);
+    bl->lpm_fd = open_inner(bl->lpm_outer_fd, bl->gen);
+    bl->v6_fd = open_inner(bl->v6_outer_fd, bl->gen);
+    return bl->map_fd < 0 || bl->lpm_fd < 0 || bl->v6_fd < 0 ? -1 : 0;
+}
+
+static __u32 map_max_entries(int map_fd) {
+    struct bpf_map_info info = {};
+    __u32 len = sizeof(info);
+
+    if (bpf_obj_get_info_by_fd(map_fd, &info, &len))
+        return 0;
+    return info.max_entries;
+}
+
+/* Empty inner maps for a new generation. Sizes of 0 take those of the
+ * generation in use, if there is one, or the defaults. The IPv6 trie
+ * gets max_prefixes entries too. */
+static int blacklist_create(const struct blacklist *bl, __u32 max_entries, __u32 max_prefixes,
+                            int *map_fd, int *lpm_fd, int *v6_fd) {
+    LIBBPF_OPTS(bpf_map_create_opts, lpm_opts, .map_flags = BPF_F_NO_PREALLOC);
+
+    if (!max_entries)
+        max_entries = bl ? map_max_entries(bl->map_fd) : BLACKLIST_ENTRIES;
+    if (!max_prefixes)
+        max_prefixes = bl ? map_max_entries(bl->lpm_fd) : BLACKLIST_LPM_ENTRIES;
+
+    *map_fd = bpf_map_create(BPF_MAP_TYPE_PERCPU_HASH, "blacklist_v4", sizeof(__u32),
+                             sizeof(struct rule_counters), max_entries, NULL);
+    *lpm_fd = bpf_map_create(BPF_MAP_TYPE_LPM_TRIE, "blacklist_lpm_v4",
+                             sizeof(struct lpm_v4_key), sizeof(struct rule_counters),
+                             max_prefixes, &lpm_opts);
+    *v6_fd = bpf_map_create(BPF_MAP_TYPE_LPM_TRIE, "blacklist_lpm_v6",
+                            sizeof(struct lpm_v6_key), sizeof(struct rule_counters),
+                            max_prefixes, &lpm_opts);
+    if (*map_fd < 0 || *lpm_fd < 0 || *v6_fd < 0) {
+        fprintf(stderr, "Error: Can't create blacklist maps: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Put a generation into the unused slots and switch xdp_prog over to it
+ * with a single write. The old one stays in its slots, a packet that read
+ * the old generation just before the switch still finds its maps there;
+ * the next install replaces it. */
+static int blacklist_install(struct blacklist *bl, int map_fd, int lpm_fd, int v6_fd) {
+    __u32 next = (bl->gen + 1) % BLACKLIST_GENERATIONS, zero = 0;
+
+    if (bpf_map_update_elem(bl->outer_fd, &next, &map_fd, BPF_ANY) ||
+        bpf_map_update_elem(bl->lpm_outer_fd, &next, &lpm_fd, BPF_ANY) ||
+        bpf_map_update_elem(bl->v6_outer_fd, &next, &v6_fd, BPF_ANY) ||
+        bpf_map_update_elem(bl->gen_fd, &zero, &next, BPF_ANY)) {
+        fprintf(stderr, "Error: Failed to install blacklist generation: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    bl->gen = next;
+    bl->map_fd = map_fd;
+    bl->lpm_fd = lpm_fd;
+    bl->v6_fd = v6_fd;
+    return 0;
+}
+
+/* Single addresses go to blacklist_map, checked first by xdp_prog,
+ * shorter prefixes to blacklist_lpm_map, anything IPv6 to
+ * blacklist_v6_map. All of the generation in use. */
+static int blacklist_update(const char *str, bool add) {
+    struct rule_counters value[nr_cpus]; /* one per CPU for blacklist_map */
+    struct lpm_v6_key key6;
+    struct lpm_v4_key key;
+    struct blacklist bl;
+    bool v6 = false;
+    int map_fd, err;
+
+    memset(value, 0, sizeof(value));
+    if (parse_prefix(str, &key)) {
+        if (parse_prefix6(str, &key6)) {
+            fprintf(stderr, "Error: %s is not an IP address or prefix\n", str);
+            return -1;
+        }
+        v6 = true;
+    }
+    if (blacklist_open(&bl))
+        return -1;
+
+    if (v6) {
+        map_fd = bl.v6_fd;
+        err = add ? bpf_map_update_elem(map_fd, &key6, value, BPF_ANY) :
+                    bpf_map_delete_elem(map_fd, &key6);
+    } else if (key.prefixlen == 32) {
+        map_fd = bl.map_fd;
+        err = add ? bpf_map_update_elem(map_fd, &key.addr, value, BPF_ANY) :
+                    bpf_map_delete_elem(map_fd, &key.addr);
+    } else {
+        map_fd = bl.lpm_fd;
+        err = add ? bpf_map_update_elem(map_fd, &key, value, BPF_ANY) :
+                    bpf_map_delete_elem(map_fd, &key);
+    }
+    if (err) {
+        fprintf(stderr, "Error: Failed to %s map: %d (%s)\n",
+                add ? "update" : "delete", map_fd, strerror(errno));
+        return -1;
+    }
+    if (policy_changed())
+        return -1;
+    if (add)
+        printf("Success: map updated!\n");
+    else
+        printf("Success: %s deleted in map!\n", str);
+    return 0;
+}
+
+/* The kernel has no batch ops for every map type (LPM tries), callers
+ * then fall back to one syscall per key */
+static bool batch_unsupported(void) {
+    return errno == EINVAL || errno == EOPNOTSUPP || errno == ENOTSUPP;
+}
+
+/* Add n keys of key_size bytes with zeroed values, BATCH_CHUNK keys per
+ * syscall, fewer for large (per-CPU) values. Returns how many were
+ * written, all of them unless an error was printed. */
+static size_t map_update_keys(int map_fd, const void *keys, size_t key_size,
+                              size_t value_size, size_t n) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = BPF_ANY);
+    size_t chunk = BATCH_CHUNK, done = 0;
+    const char *k = keys;
+    __u32 count = 0;
+    void *values;
+
+    if (chunk > BATCH_VALUE_BYTES / value_size)
+        chunk = BATCH_VALUE_BYTES / value_size;
+    values = calloc(chunk, value_size);
+    if (!values) {
+        fprintf(stderr, "Error: Can't allocate batch buffer\n");
+        return 0;
+    }
+
+    while (done < n) {
+        count = n - done < chunk ? n - done : chunk;
+        if (!bpf_map_update_batch(map_fd, k + done * key_size, values, &count, &opts)) {
+            done += count;
+            continue;
+        }
+        if (!batch_unsupported() || count)
+            goto err;
+        for (; done < n; done++) {
+            if (bpf_map_update_elem(map_fd, k + done * key_size, values, BPF_ANY))
+                goto err;
+        }
+    }
+    free(values);
+    return done;
+
+err:
+    free(values);
+    done += count;
+    fprintf(stderr, "Error: Failed to update map after %zu of %zu entries: %s\n",
+            done, n, strerror(errno));
+    return done;
+}
+
+/* Call fn for every key and value, BATCH_CHUNK keys per syscall, fewer
+ * for large (per-CPU) values. value_size is what a lookup copies out,
+ * for per-CPU maps the rounded up value times the possible CPUs. */
+static int map_for_each(int map_fd, size_t key_size, size_t value_size,
+                        void (*fn)(const void *key, const void *value, void *ctx),
+                        void *ctx) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 chunk = BATCH_CHUNK, batch, count;
+    void *in_batch = NULL;
+    char *keys, *values, *prev = NULL;
+    int err = -1;
+
+    if (chunk > BATCH_VALUE_BYTES / value_size)
+        chunk = BATCH_VALUE_BYTES / value_size;
+    keys = malloc(chunk * key_size);
+    values = malloc(chunk * value_size);
+    if (!keys || !values) {
+        fprintf(stderr, "Error: Can't allocate batch buffer\n");
+        goto out;
+    }
+
+    for (;;) {
+        count = chunk;
+        err = bpf_map_lookup_batch(map_fd, in_batch, &batch, keys, values, &count, &opts);
+        if (err && errno != ENOENT)
+            break;
+        for (__u32 i = 0; i < count; i++)
+            fn(keys + i * key_size, values + i * value_size, ctx);
+        if (err) { /* ENOENT, that was the last chunk */
+            err = 0;
+            goto out;
+        }
+        in_batch = &batch;
+    }
+
+    if (in_batch || !batch_unsupported()) {
+        fprintf(stderr, "Error: Failed to read map: %d (%s)\n", map_fd, strerror(errno));
+        err = -1;
+        goto out;
+    }
+    /* One key at a time, keys vanishing meanwhile are skipped */
+    err = 0;
+    while (bpf_map_get_next_key(map_fd, prev, keys) == 0) {
+        if (!bpf_map_lookup_elem(map_fd, keys, values))
+            fn(keys, values, ctx);
+        memcpy(keys + key_size, keys, key_size);
+        prev = keys + key_size;
+    }
+out:
+    free(keys);
+    free(values);
+    return err;
+}
+
+/* Delete n keys of key_size bytes, BATCH_CHUNK keys per syscall. Keys
+ * gone meanwhile are skipped. */
+static int map_delete_keys(int map_fd, const void *keys, size_t key_size, size_t n) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    const char *k = keys;
+    __u32 chunk, count;
+
+    for (size_t done = 0; done < n; done += chunk) {
+        chunk = n - done < BATCH_CHUNK ? n - done : BATCH_CHUNK;
+        count = chunk;
+        if (!bpf_map_delete_batch(map_fd, k + done * key_size, &count, &opts))
+            continue;
+        if (errno != ENOENT && !batch_unsupported())
+            return -1;
+        /* A key the LRU evicted meanwhile stops the batch, or there
+         * are no batch ops: the rest one by one */
+        for (__u32 i = count; i < chunk; i++)
+            bpf_map_delete_elem(map_fd, k + (done + i) * key_size);
+    }
+    return 0;
+}
+
+/* Switching to an empty generation costs xdp_prog nothing, unlike
+ * deleting the keys one by one under it */
+static int blacklist_clear(const struct config *cfg) {
+    struct blacklist bl;
+    int map_fd, lpm_fd, v6_fd;
+
+    if (blacklist_open(&bl) ||
+        blacklist_create(&bl, cfg->max_entries, cfg->max_prefixes, &map_fd, &lpm_fd, &v6_fd) ||
+        blacklist_install(&bl, map_fd, lpm_fd, v6_fd))
+        return -1;
+    printf("Success: All entries deleted in map!\n");
+    return 0;
+}
+
+static void print_addr(const void *key, const void *value, void *ctx) {
+    struct in_addr ia = {*(const __u32 *) key};
+
+    fprintf(ctx, "%s\n", inet_ntoa(ia));
+}
+
+static void print_prefix(const void *key, const void *value, void *ctx) {
+    const struct lpm_v4_key *k = key;
+    struct in_addr ia = {k->addr};
+
+    fprintf(ctx, "%s/%u\n", inet_ntoa(ia), k->prefixlen);
+}
+
+static void print_prefix6(const void *key, const void *value, void *ctx) {
+    const struct lpm_v6_key *k = key;
+    char addr[INET6_ADDRSTRLEN];
+
+    inet_ntop(AF_INET6, k->addr, addr, sizeof(addr));
+    if (k->prefixlen == 128)
+        fprintf(ctx, "%s\n", addr);
+    else
+        fprintf(ctx, "%s/%u\n", addr, k->prefixlen);
+}
+
+/* All maps to out, in the --import format */
+static int blacklist_dump(FILE *out) {
+    struct blacklist bl;
+
+    if (blacklist_open(&bl))
+        return -1;
+    if (map_for_each(bl.map_fd, sizeof(__u32), nr_cpus * sizeof(struct rule_counters),
+                     print_addr, out) ||
+        map_for_each(bl.lpm_fd, sizeof(struct lpm_v4_key), sizeof(struct rule_counters),
+                     print_prefix, out) ||
+        map_for_each(bl.v6_fd, sizeof(struct lpm_v6_key), sizeof(struct rule_counters),
+                     print_prefix6, out))
+        return -1;
+    return 0;
+}
+
+/* Growing array of fixed size keys, for --import and the reports */
+struct key_array {
+    void *keys;
+    size_t key_size, n, cap;
+};
+
+static int key_array_push(struct key_array *a, const void *key) {
+    if (a->n == a->cap) {
+        size_t cap = a->cap ? a->cap * 2 : BATCH_CHUNK;
+        void *keys = realloc(a->keys, cap * a->key_size);
+
+        if (!keys)
+            return -1;
+        a->keys = keys;
+        a->cap = cap;
+    }
+    memcpy((char *) a->keys + a->n++ * a->key_size, key, a->key_size);
+    return 0;
+}
+
+/* A blacklist entry and what it dropped, in a key_array */
+struct rule_stat {
+    char entry[INET6_ADDRSTRLEN + 4]; /* address/prefixlen */
+    struct rule_counters c;
+};
+
+static void collect_addr(const void *key, const void *value, void *ctx) {
+    const struct rule_counters *c = value;
+    struct in_addr ia = {*(const __u32 *) key};
+    struct rule_stat r = {};
+
+    snprintf(r.entry, sizeof(r.entry), "%s/32", inet_ntoa(ia));
+    for (int cpu = 0; cpu < nr_cpus; cpu++) {
+        r.c.packets += c[cpu].packets;
+        r.c.bytes += c[cpu].bytes;
+    }
+    key_array_push(ctx, &r);
+}
+
+static void collect_prefix(const void *key, const void *value, void *ctx) {
+    const struct lpm_v4_key *k = key;
+    struct in_addr ia = {k->addr};
+    struct rule_stat r = {.c = *(const struct rule_counters *) value};
+
+    snprintf(r.entry, sizeof(r.entry), "%s/%u", inet_ntoa(ia), k->prefixlen);
+    key_array_push(ctx, &r);
+}
+
+static void collect_prefix6(const void *key, const void *value, void *ctx) {
+    const struct lpm_v6_key *k = key;
+    struct rule_stat r = {.c = *(const struct rule_counters *) value};
+    char addr[INET6_ADDRSTRLEN];
+
+    inet_ntop(AF_INET6, k->addr, addr, sizeof(addr));
+    snprintf(r.entry, sizeof(r.entry), "%s/%u", addr, k->prefixlen);
+    key_array_push(ctx, &r);
+}
+
+static int cmp_rule_packets(const void *a, const void *b) {
+    const struct rule_stat *x = a, *y = b;
+
+    return x->c.packets < y->c.packets ? 1 : x->c.packets > y->c.packets ? -1 : 0;
+}
+
+/* stats_map, summed over the CPUs */
+static int stats_show(void) {
+    struct rule_counters c[nr_cpus];
+    int map_fd = open_map(stats_path);
+
+    if (map_fd < 0)
+        return -1;
+    for (__u32 stat = 0; stat < STAT_MAX; stat++) {
+        __u64 packets = 0, bytes = 0;
+
+        if (bpf_map_lookup_elem(map_fd, &stat, c)) {
+            fprintf(stderr, "Error: Failed to read map: %d (%s)\n", map_fd, strerror(errno));
+            return -1;
+        }
+        for (int cpu = 0; cpu < nr_cpus; cpu++) {
+            packets += c[cpu].packets;
+            bytes += c[cpu].bytes;
+        }
+        printf("%-16s %16llu pkts %16llu bytes\n", stat_names[stat],
+               (unsigned long long) packets, (unsigned long long) bytes);
+    }
+    return 0;
+}
+
+/* --map-show --top n: the counters, then the entries by dropped
+ * packets, read with batched lookups */
+static int blacklist_top(int n) {
+    struct key_array rules = {.key_size = sizeof(struct rule_stat)};
+    struct blacklist bl;
+    int err = -1;
+
+    if (stats_show() || blacklist_open(&bl))
+        return -1;
+    if (map_for_each(bl.map_fd, sizeof(__u32), nr_cpus * sizeof(struct rule_counters),
+                     collect_addr, &rules) ||
+        map_for_each(bl.lpm_fd, sizeof(struct lpm_v4_key), sizeof(struct rule_counters),
+                     collect_prefix, &rules) ||
+        map_for_each(bl.v6_fd, sizeof(struct lpm_v6_key), sizeof(struct rule_counters),
+                     collect_prefix6, &rules))
+        goto out;
+
+    qsort(rules.keys, rules.n, sizeof(struct rule_stat), cmp_rule_packets);
+    printf("\n%-32s %16s %16s\n", "entry", "packets", "bytes");
+    for (size_t i = 0; i < rules.n && (!n || i < (size_t) n); i++) {
+        const struct rule_stat *r = (const struct rule_stat *) rules.keys + i;
+
+        printf("%-32s %16llu %16llu\n", r->entry, (unsigned long long) r->c.packets,
+               (unsigned long long) r->c.bytes);
+    }
+    err = 0;
+out:
+    free(rules.keys);
+    return err;
+}
+
+static int blacklist_show(int top) {
+    if (top >= 0)
+        return blacklist_top(top);
+    printf("black_list_ipaddr:\n");
+    return blacklist_dump(stdout);
+}
+
+static int blacklist_export(const char *path) {
+    FILE *f = fopen(path, "w");
+    int err;
+
+    if (!f) {
+        fprintf(stderr, "Error: Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    err = blacklist_dump(f);
+    if (fclose(f) && !err) {
+        fprintf(stderr, "Error: Can't write %s: %s\n", path, strerror(errno));
+        err = -1;
+    }
+    if (!err)
+        printf("Success: blacklist exported to %s\n", path);
+    return err;
+}
+
+/* One address or prefix per line, blank lines and # comments are
+ * skipped. The whole file is parsed before the maps are touched. */
+static int read_feed(const char *path, struct key_array *addrs, struct key_array *prefixes,
+                     struct key_array *prefixes6) {
+    char line[256], *p, *end;
+    unsigned long lineno = 0;
+    struct lpm_v6_key key6;
+    struct lpm_v4_key key;
+    int err = -1;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        for (p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+        end = p + strcspn(p, "# \t\r\n");
+        if (end == p)
+            continue;
+        *end = '\0';
+        if (!parse_prefix(p, &key))
+            err = key.prefixlen == 32 ? key_array_push(addrs, &key.addr) :
+                                        key_array_push(prefixes, &key);
+        else if (!parse_prefix6(p, &key6))
+            err = key_array_push(prefixes6, &key6);
+        else {
+            fprintf(stderr, "Error: %s:%lu: %s is not an IP address or prefix\n",
+                    path, lineno, p);
+            err = -1;
+            goto out;
+        }
+        if (err) {
+            fprintf(stderr, "Error: Can't allocate memory for %s\n", path);
+            goto out;
+        }
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "Error: Can't read %s\n", path);
+        goto out;
+    }
+    err = 0;
+out:
+    fclose(f);
+    return err;
+}
+
+/* --import adds to the generation in use, --replace builds a new one
+ * from the file alone and switches to it once it is complete */
+static int blacklist_import(const char *path, const struct config *cfg, bool replace) {
+    struct key_array addrs = {.key_size = sizeof(__u32)};
+    struct key_array prefixes = {.key_size = sizeof(struct lpm_v4_key)};
+    struct key_array prefixes6 = {.key_size = sizeof(struct lpm_v6_key)};
+    int map_fd, lpm_fd, v6_fd, err = -1;
+    struct blacklist bl;
+
+    if (read_feed(path, &addrs, &prefixes, &prefixes6) || blacklist_open(&bl))
+        goto out;
+    map_fd = bl.map_fd;
+    lpm_fd = bl.lpm_fd;
+    v6_fd = bl.v6_fd;
+    if (replace && blacklist_create(&bl, cfg->max_entries, cfg->max_prefixes,
+                                    &map_fd, &lpm_fd, &v6_fd))
+        goto out;
+
+    if (map_update_keys(map_fd, addrs.keys, addrs.key_size,
+                        nr_cpus * sizeof(struct rule_counters), addrs.n) < addrs.n ||
+        map_update_keys(lpm_fd, prefixes.keys, prefixes.key_size,
+                        sizeof(struct rule_counters), prefixes.n) < prefixes.n ||
+        map_update_keys(v6_fd, prefixes6.keys, prefixes6.key_size,
+                        sizeof(struct rule_counters), prefixes6.n) < prefixes6.n)
+        goto out;
+    /* A new generation re-checks the flows by itself */
+    if (replace ? blacklist_install(&bl, map_fd, lpm_fd, v6_fd) : policy_changed())
+        goto out;
+    printf("Success: %zu addresses, %zu prefixes and %zu IPv6 entries %s\n", addrs.n,
+           prefixes.n, prefixes6.n, replace ? "installed as a new generation" : "imported");
+    err = 0;
+out:
+    free(addrs.keys);
+    free(prefixes.keys);
+    free(prefixes6.keys);
+    return err;
+}
+
+/* "<addr>[/len]:<pps>[:<burst>]" */
+static int parse_rate(const char *str, struct lpm_v4_key *key, struct rate_class *rc) {
+    char buf[INET_ADDRSTRLEN + 3 + 48], *colon, *end;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+    colon = strchr(buf, ':');
+    if (!colon)
+        return -1;
+    *colon++ = '\0';
+    if (parse_prefix(buf, key))
+        return -1;
+
+    rc->rate = strtoull(colon, &end, 0);
+    rc->burst = rc->rate;
+    if (*end == ':')
+        rc->burst = strtoull(end + 1, &end, 0);
+    if (*end || !rc->rate || !rc->burst || rc->burst > RATE_LIMIT_MAX_BURST)
+        return -1;
+    return 0;
+}
+
+static int rate_class_update(const char *str, bool add) {
+    struct lpm_v4_key key;
+    struct rate_class rc;
+    int map_fd, err;
+
+    if (add ? parse_rate(str, &key, &rc) : parse_prefix(str, &key)) {
+        fprintf(stderr, "Error: %s is not %s\n", str,
+                add ? "<addr>[/len]:<pps>[:<burst>]" : "an IPv4 address or prefix");
+        return -1;
+    }
+    map_fd = open_map(rate_class_path);
+    if (map_fd < 0)
+        return -1;
+    err = add ? bpf_map_update_elem(map_fd, &key, &rc, BPF_ANY) :
+                bpf_map_delete_elem(map_fd, &key);
+    if (err) {
+        fprintf(stderr, "Error: Failed to %s map: %d (%s)\n",
+                add ? "update" : "delete", map_fd, strerror(errno));
+        return -1;
+    }
+    if (policy_changed())
+        return -1;
+    printf("Success: rate limit %s!\n", add ? "set" : "removed");
+    return 0;
+}
+
+static void print_rate_class(const void *key, const void *value, void *ctx) {
+    const struct lpm_v4_key *k = key;
+    const struct rate_class *rc = value;
+    struct in_addr ia = {k->addr};
+
+    printf("%s/%u\t%llu pps, burst %llu\n", inet_ntoa(ia), k->prefixlen,
+           (unsigned long long) rc->rate, (unsigned long long) rc->burst);
+}
+
+static int rate_class_show(void) {
+    int map_fd = open_map(rate_class_path);
 
+    if (map_fd < 0)
+        return -1;
+    printf("rate_limits:\n");
+    return map_for_each(map_fd, sizeof(struct lpm_v4_key), sizeof(struct rate_class),
+                        print_rate_class, NULL);
+}
+
+/* Per source totals of rate_limit_map, summed over the CPUs */
+struct throttled {
+    __u32 saddr;
+    __u64 passed, dropped;
+};
+
+struct throttled_list {
+    struct throttled *v;
+    size_t n, cap;
+};
+
+static void collect_throttled(const void *key, const void *value, void *ctx) {
+    const struct token_bucket *tb = value;
+    struct throttled_list *l = ctx;
+    struct throttled t = {.saddr = *(const __u32 *) key};
+
+    for (int cpu = 0; cpu < nr_cpus; cpu++) {
+        t.passed += tb[cpu].passed;
+        t.dropped += tb[cpu].dropped;
+    }
+    if (!t.dropped)
+        return;
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        struct throttled *v = realloc(l->v, cap * sizeof(*v));
+
+        if (!v)
+            return;
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = t;
+}
+
+static int cmp_dropped(const void *a, const void *b) {
+    const struct throttled *x = a, *y = b;
+
+    return x->dropped < y->dropped ? 1 : x->dropped > y->dropped ? -1 : 0;
+}
+
+static int rate_limit_top(int n) {
+    struct throttled_list l = {};
+    int map_fd, err;
+
+    map_fd = open_map(rate_limit_path);
+    if (map_fd < 0)
+        return -1;
+    /* sizeof(struct token_bucket) is a multiple of 8, as per-CPU values
+     * are laid out */
+    err = map_for_each(map_fd, sizeof(__u32), nr_cpus * sizeof(struct token_bucket),
+                       collect_throttled, &l);
+    if (err)
+        goto out;
+
+    qsort(l.v, l.n, sizeof(*l.v), cmp_dropped);
+    printf("%-16s %16s %16s\n", "source", "dropped", "passed");
+    for (size_t i = 0; i < l.n && i < (size_t) n; i++) {
+        struct in_addr ia = {l.v[i].saddr};
+
+        printf("%-16s %16llu %16llu\n", inet_ntoa(ia),
+               (unsigned long long) l.v[i].dropped, (unsigned long long) l.v[i].passed);
+    }
+out:
+    free(l.v);
+    return err;
+}
+
+/* "<pps>[:<window_ms>[:<ban_s>]]" */
+static int auto_ban_set(const char *str) {
+    unsigned long long pps, window_ms = HH_DEFAULT_WINDOW_MS, ban_s = HH_DEFAULT_BAN_S;
+    struct hh_cfg cfg = {};
+    __u32 zero = 0;
+    char *end;
+    int map_fd;
+
+    pps = strtoull(str, &end, 0);
+    if (*end == ':')
+        window_ms = strtoull(end + 1, &end, 0);
+    if (*end == ':')
+        ban_s = strtoull(end + 1, &end, 0);
+    if (*end || !window_ms || !ban_s) {
+        fprintf(stderr, "Error: --auto-ban wants <pps>[:<window_ms>[:<ban_s>]]\n");
+        return -1;
+    }
+
+    if (pps) {
+        cfg.threshold = pps * window_ms / 1000 ? pps * window_ms / 1000 : 1;
+        cfg.window_ns = window_ms * 1000000;
+        cfg.ban_ns = ban_s * 1000000000;
+    }
+    map_fd = open_map(hh_cfg_path);
+    if (map_fd < 0)
+        return -1;
+    if (bpf_map_update_elem(map_fd, &zero, &cfg, BPF_ANY)) {
+        fprintf(stderr, "Error: Failed to update map: %d (%s)\n", map_fd, strerror(errno));
+        return -1;
+    }
+    if (policy_changed())
+        return -1;
+    if (pps)
+        printf("Success: banning sources over %u packets per %llu ms for %llu s\n",
+               cfg.threshold, window_ms, ban_s);
+    else
+        printf("Success: automatic bans off\n");
+    return 0;
+}
+
+/* Same clock as bpf_ktime_get_ns() */
+static __u64 ktime_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ban_scan {
+    __u64 now;
+    bool reap;      /* collect the expired bans instead of printing */
+    __u32 *expired;
+    size_t n, cap;
+};
+
+static void scan_ban(const void *key, const void *value, void *ctx) {
+    __u64 expiry = *(const __u64 *) value;
+    struct ban_scan *s = ctx;
+    struct in_addr ia = {*(const __u32 *) key};
+
+    if (!s->reap) {
+        if (expiry > s->now)
+            printf("%-16s %8.1f s\n", inet_ntoa(ia), (expiry - s->now) / 1e9);
+        return;
+    }
+    if (expiry > s->now)
+        return;
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        __u32 *v = realloc(s->expired, cap * sizeof(*v));
+
+        if (!v)
+            return;
+        s->expired = v;
+        s->cap = cap;
+    }
+    s->expired[s->n++] = ia.s_addr;
+}
+
+static int bans_show(void) {
+    struct ban_scan s = {.now = ktime_now()};
+    int map_fd = open_map(ban_path);
+
+    if (map_fd < 0)
+        return -1;
+    printf("%-16s %10s\n", "banned", "remaining");
+    return map_for_each(map_fd, sizeof(__u32), sizeof(__u64), scan_ban, &s);
+}
+
+/* Collect the expired bans with batched lookups, then delete them in
+ * batches. A source banned again in between loses the new ban, the
+ * sketch catches it again within a window. */
+static int bans_reap(void) {
+    struct ban_scan s = {.reap = true};
+    int map_fd = open_map(ban_path);
+
+    if (map_fd < 0)
+        return -1;
+    for (;;) {
+        s.now = ktime_now();
+        s.n = 0;
+        if (map_for_each(map_fd, sizeof(__u32), sizeof(__u64), scan_ban, &s) ||
+            map_delete_keys(map_fd, s.expired, sizeof(__u32), s.n))
+            goto err;
+        if (s.n)
+            printf("Reaped %zu expired bans\n", s.n);
+        sleep(HH_REAP_INTERVAL_S);
+    }
+
+err:
+    fprintf(stderr, "Error: Failed to reap bans: %s\n", strerror(errno));
+    free(s.expired);
+    return -1;
+}
+
+/* A flow's copies from all CPUs: the counters add up, the state is
+ * that of the CPU that saw it last */
+static void print_ct(const void *key, const void *value, void *ctx) {
+    const struct ct_key *k = key;
+    const struct ct_entry *e = value, *last = NULL;
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    int af = k->family == 6 ? AF_INET6 : AF_INET;
+    __u64 packets = 0, bytes = 0, now = *(__u64 *) ctx;
+
+    for (int cpu = 0; cpu < nr_cpus; cpu++) {
+        packets += e[cpu].packets;
+        bytes += e[cpu].bytes;
+        if (e[cpu].state != CT_NONE && (!last || e[cpu].last_seen > last->last_seen))
+            last = &e[cpu];
+    }
+    if (!last)
+        return;
+    inet_ntop(af, k->saddr, src, sizeof(src));
+    inet_ntop(af, k->daddr, dst, sizeof(dst));
+    printf("%s%s%s:%u -> %s%s%s:%u %-11s %12llu %16llu %8llu\n",
+           af == AF_INET6 ? "[" : "", src, af == AF_INET6 ? "]" : "", ntohs(k->sport),
+           af == AF_INET6 ? "[" : "", dst, af == AF_INET6 ? "]" : "", ntohs(k->dport),
+           last->state < CT_STATE_MAX ? ct_state_names[last->state] : "?",
+           (unsigned long long) packets, (unsigned long long) bytes,
+           (unsigned long long) (now - last->last_seen) / 1000000000ULL);
+}
+
+static int ct_show(void) {
+    int map_fd = open_map(ct_path);
+    __u64 now = ktime_now();
+
+    if (map_fd < 0)
+        return -1;
+    printf("flow, state, packets, bytes, idle (s)\n");
+    return map_for_each(map_fd, sizeof(struct ct_key), nr_cpus * sizeof(struct ct_entry),
+                        print_ct, &now);
+}
+
+static void collect_key(const void *key, const void *value, void *ctx) {
+    key_array_push(ctx, key);
+}
+
+/* Batched reads of the keys, then batched deletes */
+static int ct_flush(void) {
+    struct key_array keys = {.key_size = sizeof(struct ct_key)};
+    int map_fd = open_map(ct_path), err = -1;
+
+    if (map_fd < 0)
+        return -1;
+    if (map_for_each(map_fd, sizeof(struct ct_key), nr_cpus * sizeof(struct ct_entry),
+                     collect_key, &keys))
+        goto out;
+    if (map_delete_keys(map_fd, keys.keys, keys.key_size, keys.n)) {
+        fprintf(stderr, "Error: Failed to delete flows: %s\n", strerror(errno));
+        goto out;
+    }
+    printf("Success: %zu flows deleted\n", keys.n);
+    err = 0;
+out:
+    free(keys.keys);
+    return err;
+}
+
+/* Map sizes, 0 and anything that isn't a number are mistakes rather
+ * than a way to ask for the default */
+static int parse_size(const char *str, const char *what, __u32 *val) {
+    unsigned long n;
+    char *end;
+
+    errno = 0;
+    n = strtoul(str, &end, 0);
+    if (errno || end == str || *end || *str == '-' || !n || n > UINT32_MAX) {
+        fprintf(stderr, "Error: %s has to be a number above 0, not %s\n", what, str);
+        return -1;
+    }
+    *val = n;
+    return 0;
+}
+
+/* Commands on the maps of the loaded program, run once every option has
+ * been parsed so that the sizes given after them apply too */
+static int run_action(const struct config *cfg) {
+    const char *arg = cfg->action_arg;
+
+    switch (cfg->action) {
+        case '1':
+            return blacklist_update(arg, true);
+        case '2':
+            if (!strcmp(arg, "all"))
+                return blacklist_clear(cfg);
+            return blacklist_update(arg, false);
+        case '4':
+            return blacklist_import(arg, cfg, false);
+        case '5':
+            return blacklist_export(arg);
+        case '8':
+            return blacklist_import(arg, cfg, true);
+        case '9':
+            return rate_class_update(arg, true);
+        case 'r':
+            return rate_class_update(arg, false);
+        case 'R':
+            return rate_class_show();
+        case 't':
+            return rate_limit_top(atoi(arg));
+        case 'a':
+            return auto_ban_set(arg);
+        case 'b':
+            return bans_show();
+        case 'p':
+            return bans_reap();
+        case 'c':
+            return ct_show();
+        case 'f':
+            return ct_flush();
+    }
+    return -1;
+}
+
+/* Pin map name of obj to path */
+static int pin_map(struct bpf_object *obj, const char *name, const char *path) {
+    int map_fd, err;
+
+    map_fd = bpf_object__find_map_fd_by_name(obj, name);
+    if (map_fd < 0) {
+        fprintf(stderr, "Error: bpf_object__find_map_fd_by_name failed\n");
+        return -1;
+    }
+
+    err = bpf_obj_pin(map_fd, path);
+    if (err < 0) {
+        fprintf(stderr, "Error: Failed to pin map to the file system: %d (%s)\n",
+                err, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
 int main(int argc, char **argv) {
     int err;
     int map_fd = 0;
-    __u32 key;
-    __u32 value;
-    __u32 next_key, lookup_key = -1;
 
     struct config cfg = {
             /* set XDP_FLAGS_UPDATE_IF_NOEXIST to avoid accidentally unloading
@@ -63,7 +1176,8 @@ int main(int argc, char **argv) {
             .ifindex   = -1,
             .do_unload = false,
             .filename = "xdp_prog_kern.o",
-            .progname = "xdp_prog"
+            .progname = "xdp_prog",
+            .top = -1,
     };
 
     struct option long_options[] = {{"dev",          required_argument, 0, 'd'},
@@ -76,10 +1190,34 @@ int main(int argc, char **argv) {
                                     {"name",         no_argument,       0, 'n'},
                                     {"map-add",      required_argument, 0, '1'},
                                     {"map-delete",   required_argument, 0, '2'},
-                                    {"map-show",     no_argument,       0, '3'}
+                                    {"map-show",     no_argument,       0, '3'},
+                                    {"import",       required_argument, 0, '4'},
+                                    {"export",       required_argument, 0, '5'},
+                                    {"replace",      required_argument, 0, '8'},
+                                    {"rate-limit",   required_argument, 0, '9'},
+                                    {"rate-delete",  required_argument, 0, 'r'},
+                                    {"rate-show",    no_argument,       0, 'R'},
+                                    {"top-throttled", required_argument, 0, 't'},
+                                    {"auto-ban",     required_argument, 0, 'a'},
+                                    {"bans",         no_argument,       0, 'b'},
+                                    {"reap",         no_argument,       0, 'p'},
+                                    {"top",          required_argument, 0, 'T'},
+                                    {"ct-show",      no_argument,       0, 'c'},
+                                    {"ct-flush",     no_argument,       0, 'f'},
+                                    {"ct-entries",   required_argument, 0, 'e'},
+                                    {"max-entries",  required_argument, 0, '6'},
+                                    {"max-prefixes", required_argument, 0, '7'},
+                                    {0, 0, 0, 0}
     };
     int c, option_index;
-    while ((c = getopt_long(argc, argv, "d:USNHFho:n:1:2:3", long_options, &option_index)) != EOF) {
+
+    nr_cpus = libbpf_num_possible_cpus();
+    if (nr_cpus <= 0) {
+        fprintf(stderr, "Error: Can't get the number of CPUs\n");
+        return 1;
+    }
+
+    while ((c = getopt_long(argc, argv, "d:USNHFho:n:1:2:34:5:6:7:8:9:", long_options, &option_index)) != EOF) {
         switch (c) {
             case 'd':
                 if (strlen(optarg) >= IF_NAMESIZE) {
@@ -118,68 +1256,44 @@ int main(int argc, char **argv) {
                 strncpy((char *) &cfg.progname, optarg, sizeof(cfg.progname));
                 break;
             case '1':
-                map_fd = bpf_obj_get(file_path);
-                if (map_fd < 0) {
-                    fprintf(stderr, "Error: Failed to fetch the map: %d (%s)\n",
-                            map_fd, strerror(errno));
-                    return 1;
-                }
-                key = inet_addr(optarg);
-                err = bpf_map_update_elem(map_fd, &key, &value, BPF_ANY);
-                if (err) {
-                    fprintf(stderr, "Error: Failed to update map: %d (%s)\n",
-                            map_fd, strerror(errno));
-                    return -1;
-                } else {
-                    printf("Success: map updated!\n");
-                }
-                return 0;
             case '2':
-                map_fd = bpf_obj_get(file_path);
-                if (map_fd < 0) {
-                    fprintf(stderr, "Error: Failed to fetch the map: %d (%s)\n",
-                            map_fd, strerror(errno));
-                    return 1;
-                }
-
-                if (!strcmp(optarg, "all")) {
-                    while (bpf_map_get_next_key(map_fd, &lookup_key, &next_key)
-                           == 0) {
-                        err = bpf_map_delete_elem(map_fd, &next_key);
-                        if (err) {
-                            fprintf(stderr, "Error: Failed to delete map: %d (%s)\n",
-                                    map_fd, strerror(errno));
-                            return 1;
-                        }
-                        lookup_key = next_key;
-                    }
-                    printf("Success: All entries deleted in map!\n");
-                } else {
-                    key = inet_addr(optarg);
-                    err = bpf_map_delete_elem(map_fd, &key);
-                    if (err) {
-                        fprintf(stderr, "Error: Failed to delete map: %d (%s)\n",
-                                map_fd, strerror(errno));
-                        return 1;
-                    } else {
-                        printf("Success: %s deleted in map!\n", optarg);
-                    }
+            case '4':
+            case '5':
+            case '8':
+            case '9':
+            case 'r':
+            case 'R':
+            case 't':
+            case 'a':
+            case 'b':
+            case 'p':
+            case 'c':
+            case 'f':
+                if (cfg.action) {
+                    fprintf(stderr, "Error: one command at a time\n");
+                    goto error;
                 }
-                return 0;
+                cfg.action = c;
+                cfg.action_arg = optarg;
+                break;
             case '3':
-                map_fd = bpf_obj_get(file_path);
-                if (map_fd < 0) {
-                    fprintf(stderr, "Error: Failed to fetch the map: %d (%s)\n",
-                            map_fd, strerror(errno));
-                    return 1;
-                }
-                printf("black_list_ipaddr:\n");
-                while (bpf_map_get_next_key(map_fd, &lookup_key, &next_key) == 0) {
-                    struct in_addr ia = {next_key};
-                    printf("%s\n", inet_ntoa(ia));
-                    lookup_key = next_key;
-                }
-                return 0;
+                cfg.show = true;
+                break;
+            case 'T':
+                cfg.top = atoi(optarg);
+                break;
+            case 'e':
+                if (parse_size(optarg, "--ct-entries", &cfg.ct_entries))
+                    goto error;
+                break;
+            case '6':
+                if (parse_size(optarg, "--max-entries", &cfg.max_entries))
+                    goto error;
+                break;
+            case '7':
+                if (parse_size(optarg, "--max-prefixes", &cfg.max_prefixes))
+                    goto error;
+                break;
             case 'h':
                 usage(argv[0]);
                 exit(0);
@@ -191,6 +1305,11 @@ int main(int argc, char **argv) {
         }
     } // end of while
 
+    if (cfg.action)
+        return run_action(&cfg) ? 1 : 0;
+    if (cfg.show)
+        return blacklist_show(cfg.top) ? 1 : 0;
+
     if (cfg.ifindex == -1) {
         fprintf(stderr, "Error: required option -d/--dev missing\n");
         usage(argv[0]);
@@ -205,6 +1324,16 @@ int main(int argc, char **argv) {
         } else {
             printf("Pinned map removed\n");
         }
+        remove(lpm_file_path);
+        remove(gen_file_path);
+        remove(v6_file_path);
+        remove(rate_class_path);
+        remove(rate_limit_path);
+        remove(hh_cfg_path);
+        remove(ban_path);
+        remove(stats_path);
+        remove(ct_path);
+        remove(epoch_path);
 
         /* bpf_set_link_xdp_fd() has been deprecated since libbpf v1.0+
          * Use bpf_xdp_detach and bpf_xdp_attach instead.
@@ -262,6 +1391,12 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    if (cfg.ct_entries &&
+        bpf_map__set_max_entries(bpf_object__find_map_by_name(obj, "ct_map"), cfg.ct_entries)) {
+        fprintf(stderr, "Error: Can't resize ct_map\n");
+        return 1;
+    }
+
     /* Load obj into kernel */
     err = bpf_object__load(obj);
     if (err) {
@@ -269,17 +1404,33 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    /* Find map fd and pin it to bpf file system */
-    map_fd = bpf_object__find_map_fd_by_name(obj, "blacklist_map");
-    if (map_fd < 0) {
-        fprintf(stderr, "Error: bpf_object__find_map_fd_by_name failed\n");
+    /* Pin the maps to bpf file system */
+    if (pin_map(obj, "blacklist_map", file_path) ||
+        pin_map(obj, "blacklist_lpm_map", lpm_file_path) ||
+        pin_map(obj, "blacklist_gen_map", gen_file_path) ||
+        pin_map(obj, "blacklist_v6_map", v6_file_path) ||
+        pin_map(obj, "rate_class_map", rate_class_path) ||
+        pin_map(obj, "rate_limit_map", rate_limit_path) ||
+        pin_map(obj, "hh_cfg_map", hh_cfg_path) ||
+        pin_map(obj, "ban_map", ban_path) ||
+        pin_map(obj, "stats_map", stats_path) ||
+        pin_map(obj, "ct_map", ct_path) ||
+        pin_map(obj, "policy_epoch_map", epoch_path))
         return 1;
-    }
 
-    err = bpf_obj_pin(map_fd, file_path);
-    if (err < 0) {
-        fprintf(stderr, "Error: Failed to pin map to the file system: %d (%s)\n",
-                err, strerror(errno));
+    /* Generation 0, empty. blacklist_gen_map starts out at 0. */
+    __u32 gen = 0;
+    int lpm_fd, v6_fd;
+
+    if (blacklist_create(NULL, cfg.max_entries, cfg.max_prefixes, &map_fd, &lpm_fd, &v6_fd))
+        return 1;
+    if (bpf_map_update_elem(bpf_object__find_map_fd_by_name(obj, "blacklist_map"),
+                            &gen, &map_fd, BPF_ANY) ||
+        bpf_map_update_elem(bpf_object__find_map_fd_by_name(obj, "blacklist_lpm_map"),
+                            &gen, &lpm_fd, BPF_ANY) ||
+        bpf_map_update_elem(bpf_object__find_map_fd_by_name(obj, "blacklist_v6_map"),
+                            &gen, &v6_fd, BPF_ANY)) {
+        fprintf(stderr, "Error: Failed to update map: %s\n", strerror(errno));
         return 1;
     }
 
@@ -0,0 +1,42 @@
+#ifndef __COMMON_H
+#define __COMMON_H
+
+#include <linux/types.h>
+
+/* One record per sampled reply, 32 bytes plus the 8 byte ring buffer
+ * header. Addresses and ports stay in network byte order. */
+struct tx_event {
+    __u64 ts;      /* bpf_ktime_get_ns() */
+    __be32 saddr;
+    __be32 daddr;
+    __be16 sport;
+    __be16 dport;
+    __u32 len;     /* payload bytes, all segments of a GSO packet */
+    __u8 proto;    /* IPPROTO_TCP or IPPROTO_UDP */
+    __u8 pad[7];
+};
+
+struct tx_cfg {
+    __u32 port;         /* source port of the replies (host byte order), 0 for all */
+    __u32 sample;       /* report 1 in sample replies per CPU */
+    __u32 wakeup_bytes; /* wake the consumer once this much is queued, 0 on every event */
+};
+
+#define TX_DEFAULT_PORT         6379
+#define TX_DEFAULT_SAMPLE       1
+#define TX_DEFAULT_WAKEUP_BYTES (64 * 1024)
+
+/* Size of the ring buffer, a power of 2 multiple of the page size;
+ * tc-prog-user --ringbuf-size changes it when loading. At 1M events/s
+ * (40 MB/s) this holds 400 ms of events. */
+#define TX_RINGBUF_SIZE (16 * 1024 * 1024)
+
+/* Packets per CPU in stats_map */
+enum tx_stat {
+    STAT_SEEN,    /* replies matching the port */
+    STAT_SAMPLED, /* events queued */
+    STAT_LOST,    /* ring buffer full */
+    STAT_MAX,
+};
+
+#endif /* __COMMON_H */
@@ -1,71 +1,119 @@
 #include <linux/bpf.h>
-#include <linux/if_ether.h>
 #include <linux/pkt_cls.h>
-#include <linux/ip.h>
-#include <linux/in.h>
-#include <linux/udp.h>
-#include <linux/tcp.h>
-#include <linux/string.h>
 #include <linux/types.h>
 #include <bpf/bpf_helpers.h>
 
+#include "parsing_helpers.h"
+#include "common.h"
 
-#ifndef be16
-#define be16 __be16
-#endif
-#ifndef be32
-#define be32 __be32
-#endif
-#ifndef u32
-#define u32 __u32
-#endif
-#ifndef u16
-#define u16 __u16
-#endif
-#ifndef htonl
-#define htonl __constant_htonl
-#endif
-#ifndef ntohl
-#define ntohl __constant_ntohl
-#endif
-#ifndef htons
-#define htons __constant_htons
-#endif
-#ifndef ntohs
-#define ntohs __constant_ntohs
-#endif
+/* Events for tc-prog-user --events, instead of bpf_printk(): trace_pipe
+ * is one globally locked, rate limited buffer of text */
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, TX_RINGBUF_SIZE);
+} events SEC(".maps");
 
-SEC("tx_prog")
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct tx_cfg);
+} tx_cfg_map SEC(".maps");
+
+/* Packets per enum tx_stat */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, STAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+} stats_map SEC(".maps");
+
+static __always_inline __u64 stat_inc(__u32 stat)
+{
+    __u64 *cnt = bpf_map_lookup_elem(&stats_map, &stat);
+
+    if (!cnt)
+        return 0;
+    return ++*cnt;
+}
+
+/* Without a wakeup for every event the consumer sleeps until a batch of
+ * wakeup_bytes is queued, or its epoll timeout */
+static __always_inline __u64 wakeup_flag(const struct tx_cfg *cfg)
+{
+    if (!cfg->wakeup_bytes)
+        return 0;
+    if (bpf_ringbuf_query(&events, BPF_RB_AVAIL_DATA) >= cfg->wakeup_bytes)
+        return BPF_RB_FORCE_WAKEUP;
+    return BPF_RB_NO_WAKEUP;
+}
+
+SEC("tc")
 int tx_prog_main(struct __sk_buff *skb) // 相比xdp_md来说__sk_buff结构体具有的信息多的多
 {
-    int ipsize = 0;
     void *data_end = (void *)(long)skb->data_end;
     void *data     = (void *)(long)skb->data;
-    struct ethhdr *eth = data;
-    struct iphdr *ip = data + sizeof(*eth);
-    struct tcphdr *tcp = data + sizeof(*eth) + sizeof(*ip);
+    struct hdr_cursor nh = { .pos = data };
+    struct ethhdr *eth;
+    struct iphdr *ip;
+    struct tcphdr *tcp;
+    struct udphdr *udp;
+    struct tx_event *e;
+    struct tx_cfg *cfg;
+    __be16 sport, dport;
+    __u32 key = 0, hdrlen;
+    __u64 seen;
+    int proto;
 
-    ipsize = sizeof(*eth);
-    ipsize += sizeof(struct iphdr);
-    if (data + ipsize > data_end) { // To pass eBPF verifier
+    cfg = bpf_map_lookup_elem(&tx_cfg_map, &key);
+    if (!cfg)
         return TC_ACT_OK;
-    }
 
-    if (ip->protocol != IPPROTO_TCP){
-        bpf_printk("Not TCP, PASS.\n");
+    if (parse_ethhdr(&nh, data_end, &eth) != bpf_htons(ETH_P_IP))
+        return TC_ACT_OK;
+    proto = parse_iphdr(&nh, data_end, &ip);
+    if (proto < 0 || ip->frag_off & bpf_htons(IP_OFFSET)) // no L4 header after the first fragment
+        return TC_ACT_OK;
+    if (proto == IPPROTO_TCP) {
+        if (parse_tcphdr(&nh, data_end, &tcp) < 0)
+            return TC_ACT_OK;
+        sport = tcp->source;
+        dport = tcp->dest;
+    } else if (proto == IPPROTO_UDP) {
+        if (parse_udphdr(&nh, data_end, &udp) < 0)
+            return TC_ACT_OK;
+        sport = udp->source;
+        dport = udp->dest;
+    } else {
         return TC_ACT_OK;
     }
-    ipsize += sizeof(struct tcphdr);
 
-    if (data + ipsize > data_end)
+    if (cfg->port && sport != bpf_htons(cfg->port)) // e.g. not a redis reply
+        return TC_ACT_OK;
+    /* skb->len covers every segment of a GSO packet, pure ACKs carry no reply */
+    hdrlen = nh.pos - data;
+    if (skb->len <= hdrlen)
         return TC_ACT_OK;
 
-    __be16 sport = tcp->source;
+    seen = stat_inc(STAT_SEEN);
+    if (cfg->sample > 1 && seen % cfg->sample)
+        return TC_ACT_OK;
 
-    if (sport == htons(6379)) { // if this is a redis reply
-        bpf_printk("That's a tcp reply to redis client.\n");
+    e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+    if (!e) {
+        stat_inc(STAT_LOST);
+        return TC_ACT_OK;
     }
-    bpf_printk("Not from port 6379, pass.\n");
+    e->ts = bpf_ktime_get_ns();
+    e->saddr = ip->saddr;
+    e->daddr = ip->daddr;
+    e->sport = sport;
+    e->dport = dport;
+    e->len = skb->len - hdrlen;
+    e->proto = proto;
+    __builtin_memset(e->pad, 0, sizeof(e->pad));
+    bpf_ringbuf_submit(e, wakeup_flag(cfg));
+    stat_inc(STAT_SAMPLED);
     return TC_ACT_OK;
 }
-char _license[] SEC("license") = "GPL";
\ No newline at end of file
+char _license[] SEC("license") = "GPL";
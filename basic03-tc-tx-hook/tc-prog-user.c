@@ -0,0 +1,543 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> // uint32_t uint16_t define
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "common.h"
+
+/* Fixed handle and priority, so -U finds the filter again */
+#define TC_HANDLE 1
+#define TC_PRIO   1
+
+/* Longest the consumer sleeps, the events queued without a wakeup wait
+ * at most this long */
+#define POLL_TIMEOUT_MS 100
+
+enum consume_mode {
+    CONSUME_NONE,
+    CONSUME_EVENTS,  /* one line per event */
+    CONSUME_SUMMARY, /* one line per second */
+};
+
+/* tc prog loading related config options */
+struct config {
+    int ifindex;
+    char *ifname;
+    char filename[512];
+    char progname[32];
+    bool do_unload;
+    bool force;
+    bool set_cfg;               /* --port, --sample or --wakeup given */
+    __u32 ringbuf_size;         /* --ringbuf-size, 0 keeps TX_RINGBUF_SIZE */
+    enum consume_mode consume;
+    struct tx_cfg tx;
+};
+
+static const char *events_path = "/sys/fs/bpf/tc_tx_events";
+static const char *cfg_path = "/sys/fs/bpf/tc_tx_cfg";
+static const char *stats_path = "/sys/fs/bpf/tc_tx_stats";
+
+static const char *const stat_names[STAT_MAX] = {
+        [STAT_SEEN] = "replies",
+        [STAT_SAMPLED] = "events",
+        [STAT_LOST] = "lost",
+};
+
+static volatile sig_atomic_t stop;
+
+static void usage(char *name) {
+    printf("usage %s [options] \n\n"
+           "Requried options:\n"
+           "-d, --dev <ifname>\t\tSpecify the device <ifname>\n\n"
+
+           "Other options:\n"
+           "-h, --help\t\tthis text you see right here\n"
+           "-F, --force\t\tForce install, replacing existing filter on interface\n"
+           "-U, --unload\t\tUnload tc filter instead of loading\n"
+           "-o, --obj <objname>\tSpecify the obj filename <objname>\n"
+           "-n, --name <progname>\tSpecify the program name <progname>\n"
+
+           "Events:\n"
+           "    --events\t\tPrint the replies as they are sent, until Ctrl-C\n"
+           "    --summary\t\tPrint the replies and bytes per second instead\n"
+           "    --show\t\tShow the settings and the counters\n"
+           "    --port <n>\t\tSource port of the replies, default %d, 0 for all\n"
+           "    --sample <n>\tReport 1 in n replies per CPU, default %d\n"
+           "    --wakeup <bytes>\tWake the consumer once this much is queued,\n"
+           "\t\t\tdefault %d, 0 for every event, at most half the ring buffer\n"
+           "\t\t\tWithout -d these change the program already loaded\n"
+           "    --ringbuf-size <bytes>\tRing buffer size, when loading, a power of 2,\n"
+           "\t\t\tdefault %d\n",
+           name, TX_DEFAULT_PORT, TX_DEFAULT_SAMPLE, TX_DEFAULT_WAKEUP_BYTES, TX_RINGBUF_SIZE);
+} // End of usage
+
+static int open_map(const char *path) {
+    int map_fd = bpf_obj_get(path);
+
+    if (map_fd < 0)
+        fprintf(stderr, "Error: Failed to fetch the map %s: %d (%s)\n",
+                path, map_fd, strerror(errno));
+    return map_fd;
+}
+
+static int tx_cfg_set(int map_fd, const struct tx_cfg *tx) {
+    __u32 zero = 0;
+
+    if (bpf_map_update_elem(map_fd, &zero, tx, BPF_ANY)) {
+        fprintf(stderr, "Error: Failed to update map: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* A wakeup_bytes the ring buffer can't queue never wakes the consumer,
+ * and one close to its size loses events before the consumer runs; half
+ * of the ring is left for those queued while it wakes up */
+static int wakeup_check(__u32 wakeup_bytes, __u32 ringbuf_size) {
+    if (wakeup_bytes > ringbuf_size / 2) {
+        fprintf(stderr, "Error: wakeup size %u has to be at most half the "
+                        "ring buffer size %u\n", wakeup_bytes, ringbuf_size);
+        return -1;
+    }
+    return 0;
+}
+
+/* max_entries of the pinned ring buffer, its size in bytes */
+static __u32 ringbuf_size_get(void) {
+    struct bpf_map_info info = {};
+    __u32 len = sizeof(info);
+    int map_fd = open_map(events_path);
+
+    if (map_fd < 0)
+        return 0;
+    if (bpf_obj_get_info_by_fd(map_fd, &info, &len))
+        fprintf(stderr, "Error: Failed to get info of the map %s: %s\n",
+                events_path, strerror(errno));
+    close(map_fd);
+    return info.max_entries;
+}
+
+/* Sums of the per-CPU counters */
+static int stats_read(int map_fd, int nr_cpus, __u64 *sums) {
+    for (__u32 key = 0; key < STAT_MAX; key++) {
+        __u64 cnt[nr_cpus];
+
+        if (bpf_map_lookup_elem(map_fd, &key, cnt)) {
+            fprintf(stderr, "Error: Failed to read map: %s\n", strerror(errno));
+            return -1;
+        }
+        sums[key] = 0;
+        for (int cpu = 0; cpu < nr_cpus; cpu++)
+            sums[key] += cnt[cpu];
+    }
+    return 0;
+}
+
+static int tx_show(void) {
+    int cfg_fd, stats_fd, nr_cpus;
+    __u64 sums[STAT_MAX];
+    struct tx_cfg tx;
+    __u32 key = 0;
+
+    cfg_fd = open_map(cfg_path);
+    stats_fd = open_map(stats_path);
+    nr_cpus = libbpf_num_possible_cpus();
+    if (cfg_fd < 0 || stats_fd < 0 || nr_cpus <= 0)
+        return -1;
+
+    if (!bpf_map_lookup_elem(cfg_fd, &key, &tx))
+        printf("port %u, 1 in %u sampled, wakeup after %u bytes\n",
+               tx.port, tx.sample, tx.wakeup_bytes);
+    if (stats_read(stats_fd, nr_cpus, sums))
+        return -1;
+    for (key = 0; key < STAT_MAX; key++)
+        printf("%-16s %16llu pkts\n", stat_names[key], (unsigned long long) sums[key]);
+    return 0;
+}
+
+struct consumer {
+    enum consume_mode mode;
+    __u64 events;
+    __u64 bytes;
+};
+
+/* Called by ring_buffer__consume() for each record, in order */
+static int handle_event(void *ctx, void *data, size_t size) {
+    struct consumer *c = ctx;
+    const struct tx_event *e = data;
+    char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+    if (size < sizeof(*e))
+        return 0;
+    c->events++;
+    c->bytes += e->len;
+    if (c->mode != CONSUME_EVENTS)
+        return 0;
+
+    inet_ntop(AF_INET, &e->saddr, src, sizeof(src));
+    inet_ntop(AF_INET, &e->daddr, dst, sizeof(dst));
+    printf("%llu %s %s:%u %s:%u %u\n", (unsigned long long) e->ts,
+           e->proto == IPPROTO_TCP ? "tcp" : "udp",
+           src, ntohs(e->sport), dst, ntohs(e->dport), e->len);
+    return 0;
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static __u64 now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Sleeps in epoll_wait() on the ring buffer and drains everything queued
+ * on each wakeup, so the cost per wakeup is spread over a batch */
+static int tx_consume(enum consume_mode mode) {
+    struct consumer c = { .mode = mode };
+    struct ring_buffer *rb = NULL;
+    struct epoll_event ev = { .events = EPOLLIN };
+    __u64 sums[STAT_MAX], lost, last_events = 0, last_bytes = 0, next;
+    int events_fd, stats_fd, epfd = -1, nr_cpus, n, err = -1;
+
+    events_fd = open_map(events_path);
+    stats_fd = open_map(stats_path);
+    nr_cpus = libbpf_num_possible_cpus();
+    if (events_fd < 0 || stats_fd < 0 || nr_cpus <= 0)
+        return -1;
+    if (stats_read(stats_fd, nr_cpus, sums))
+        return -1;
+    lost = sums[STAT_LOST];
+
+    rb = ring_buffer__new(events_fd, handle_event, &c, NULL);
+    if (!rb) {
+        fprintf(stderr, "Error: ring_buffer__new failed: %s\n", strerror(errno));
+        return -1;
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, events_fd, &ev)) {
+        fprintf(stderr, "Error: epoll setup failed: %s\n", strerror(errno));
+        goto out;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    next = now_ms() + 1000;
+    while (!stop) {
+        n = epoll_wait(epfd, &ev, 1, POLL_TIMEOUT_MS);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: epoll_wait failed: %s\n", strerror(errno));
+            goto out;
+        }
+        /* Also on a timeout, for the events queued without a wakeup */
+        n = ring_buffer__consume(rb);
+        if (n < 0) {
+            fprintf(stderr, "Error: ring_buffer__consume failed: %d\n", n);
+            goto out;
+        }
+        if (mode == CONSUME_EVENTS)
+            fflush(stdout);
+
+        if (mode == CONSUME_SUMMARY && now_ms() >= next) {
+            if (stats_read(stats_fd, nr_cpus, sums))
+                goto out;
+            printf("%llu events/s, %llu bytes/s, %llu lost\n",
+                   (unsigned long long) (c.events - last_events),
+                   (unsigned long long) (c.bytes - last_bytes),
+                   (unsigned long long) (sums[STAT_LOST] - lost));
+            fflush(stdout);
+            last_events = c.events;
+            last_bytes = c.bytes;
+            lost = sums[STAT_LOST];
+            next += 1000;
+        }
+    }
+    err = 0;
+
+out:
+    if (epfd >= 0)
+        close(epfd);
+    ring_buffer__free(rb);
+    return err;
+}
+
+static int pin_map(struct bpf_object *obj, const char *name, const char *path) {
+    int map_fd, err;
+
+    map_fd = bpf_object__find_map_fd_by_name(obj, name);
+    if (map_fd < 0) {
+        fprintf(stderr, "Error: bpf_object__find_map_fd_by_name failed\n");
+        return -1;
+    }
+
+    err = bpf_obj_pin(map_fd, path);
+    if (err < 0) {
+        fprintf(stderr, "Error: Failed to pin map to the file system: %d (%s)\n",
+                err, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned long parse_num(const char *str, unsigned long max, const char *what) {
+    char *end;
+    unsigned long n = strtoul(str, &end, 0);
+
+    if (*end || end == str || n > max) {
+        fprintf(stderr, "Error: Invalid %s %s\n", what, str);
+        return -1UL;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    int err;
+
+    struct config cfg = {
+            .ifindex   = -1,
+            .do_unload = false,
+            .filename = "tc-prog-kern.o",
+            .progname = "tx_prog_main",
+            .tx = {
+                    .port = TX_DEFAULT_PORT,
+                    .sample = TX_DEFAULT_SAMPLE,
+                    .wakeup_bytes = TX_DEFAULT_WAKEUP_BYTES,
+            },
+    };
+
+    struct option long_options[] = {{"dev",          required_argument, 0, 'd'},
+                                    {"force",        no_argument,       0, 'F'},
+                                    {"help",         no_argument,       0, 'h'},
+                                    {"unload",       no_argument,       0, 'U'},
+                                    {"obj",          required_argument, 0, 'o'},
+                                    {"name",         required_argument, 0, 'n'},
+                                    {"events",       no_argument,       0, '1'},
+                                    {"summary",      no_argument,       0, '2'},
+                                    {"show",         no_argument,       0, '3'},
+                                    {"port",         required_argument, 0, '4'},
+                                    {"sample",       required_argument, 0, '5'},
+                                    {"wakeup",       required_argument, 0, '6'},
+                                    {"ringbuf-size", required_argument, 0, '7'},
+                                    {0, 0, 0, 0}
+    };
+    int c, option_index;
+    unsigned long n;
+
+    while ((c = getopt_long(argc, argv, "d:FhUo:n:1234:5:6:7:", long_options, &option_index)) != EOF) {
+        switch (c) {
+            case 'd':
+                if (strlen(optarg) >= IF_NAMESIZE) {
+                    fprintf(stderr, "Error: dev name is too long\n");
+                    goto error;
+                }
+                cfg.ifname = optarg;
+                cfg.ifindex = if_nametoindex(cfg.ifname);
+                if (cfg.ifindex == 0) {
+                    fprintf(stderr, "ERR: dev name unknown err\n");
+                    goto error;
+                }
+                break;
+            case 'U':
+                cfg.do_unload = true;
+                break;
+            case 'F':
+                cfg.force = true;
+                break;
+            case 'o':
+                strncpy((char *) &cfg.filename, optarg, sizeof(cfg.filename) - 1);
+                break;
+            case 'n':
+                strncpy((char *) &cfg.progname, optarg, sizeof(cfg.progname) - 1);
+                break;
+            case '1':
+                cfg.consume = CONSUME_EVENTS;
+                break;
+            case '2':
+                cfg.consume = CONSUME_SUMMARY;
+                break;
+            case '3':
+                return tx_show() ? 1 : 0;
+            case '4':
+                n = parse_num(optarg, 65535, "port");
+                if (n == -1UL)
+                    goto error;
+                cfg.tx.port = n;
+                cfg.set_cfg = true;
+                break;
+            case '5':
+                n = parse_num(optarg, UINT32_MAX, "sample rate");
+                if (n == -1UL)
+                    goto error;
+                if (!n) {
+                    fprintf(stderr, "Error: sample rate has to be at least 1\n");
+                    goto error;
+                }
+                cfg.tx.sample = n;
+                cfg.set_cfg = true;
+                break;
+            case '6':
+                n = parse_num(optarg, UINT32_MAX, "wakeup size");
+                if (n == -1UL)
+                    goto error;
+                cfg.tx.wakeup_bytes = n;
+                cfg.set_cfg = true;
+                break;
+            case '7':
+                n = parse_num(optarg, 1UL << 30, "ring buffer size");
+                if (n == -1UL || n < 4096 || (n & (n - 1))) {
+                    fprintf(stderr, "Error: ring buffer size has to be a power of 2, "
+                                    "at least a page\n");
+                    goto error;
+                }
+                cfg.ringbuf_size = n;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            error:
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    } // end of while
+
+    /* For --events a pipe gets the lines in large writes, once per batch;
+     * has to happen before anything is printed */
+    if (cfg.consume == CONSUME_EVENTS)
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+    /* Without a device the settings go to the loaded program */
+    if (cfg.ifindex == -1 && (cfg.set_cfg || cfg.consume)) {
+        if (cfg.set_cfg) {
+            __u32 ringbuf_size = ringbuf_size_get();
+            int cfg_fd;
+
+            if (!ringbuf_size || wakeup_check(cfg.tx.wakeup_bytes, ringbuf_size))
+                return 1;
+            cfg_fd = open_map(cfg_path);
+            if (cfg_fd < 0 || tx_cfg_set(cfg_fd, &cfg.tx))
+                return 1;
+            printf("Success: map updated!\n");
+        }
+        return cfg.consume && tx_consume(cfg.consume) ? 1 : 0;
+    }
+
+    if (cfg.ifindex == -1) {
+        fprintf(stderr, "Error: required option -d/--dev missing\n");
+        usage(argv[0]);
+        return -1;
+    }
+
+    DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = cfg.ifindex,
+                        .attach_point = BPF_TC_EGRESS);
+    DECLARE_LIBBPF_OPTS(bpf_tc_opts, tc_opts, .handle = TC_HANDLE, .priority = TC_PRIO);
+
+    /* Unload tc prog, the clsact qdisc stays for other filters */
+    if (cfg.do_unload) {
+        remove(events_path);
+        remove(cfg_path);
+        remove(stats_path);
+
+        err = bpf_tc_detach(&hook, &tc_opts);
+        if (err) {
+            fprintf(stderr, "Error: bpf_tc_detach failed (err=%d): %s\n",
+                    err, strerror(-err));
+            return -1;
+        }
+        printf("Success: tc prog detached from device:%s(ifindex:%d)\n",
+               cfg.ifname, cfg.ifindex);
+        return 0;
+    }
+
+    if (wakeup_check(cfg.tx.wakeup_bytes, cfg.ringbuf_size ? cfg.ringbuf_size : TX_RINGBUF_SIZE))
+        return 1;
+
+    /* open obj */
+    struct bpf_object *obj;
+    obj = bpf_object__open_file(cfg.filename, NULL);
+    err = libbpf_get_error(obj);
+    if (err) {
+        fprintf(stderr, "Error: bpf_object__open_file failed (err=%d): %s\n",
+                err, strerror(errno));
+        return -1;
+    }
+
+    struct bpf_program *bpf_prog;
+    bpf_prog = bpf_object__find_program_by_name(obj, cfg.progname);
+    if (!bpf_prog) {
+        fprintf(stderr, "Error: bpf_object__find_program_by_name failed\n");
+        return -1;
+    }
+
+    if (cfg.ringbuf_size &&
+        bpf_map__set_max_entries(bpf_object__find_map_by_name(obj, "events"), cfg.ringbuf_size)) {
+        fprintf(stderr, "Error: Failed to resize the ring buffer\n");
+        return 1;
+    }
+
+    /* Load obj into kernel */
+    err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "Error: bpf_object__load failed\n");
+        return 1;
+    }
+
+    if (tx_cfg_set(bpf_object__find_map_fd_by_name(obj, "tx_cfg_map"), &cfg.tx))
+        return 1;
+
+    /* Pin the maps to bpf file system */
+    if (pin_map(obj, "events", events_path) ||
+        pin_map(obj, "tx_cfg_map", cfg_path) ||
+        pin_map(obj, "stats_map", stats_path))
+        return 1;
+
+    /* Get file descriptor for program */
+    int prog_fd;
+    prog_fd = bpf_program__fd(bpf_prog);
+    if (prog_fd < 0) {
+        fprintf(stderr, "Error: Couldn't get file descriptor for program\n");
+        return 1;
+    }
+
+    /* Same as tc qdisc add dev <ifname> clsact */
+    err = bpf_tc_hook_create(&hook);
+    if (err && err != -EEXIST) {
+        fprintf(stderr, "Error: bpf_tc_hook_create failed (%d): %s\n", -err, strerror(-err));
+        return -1;
+    }
+
+    tc_opts.prog_fd = prog_fd;
+    if (cfg.force)
+        tc_opts.flags = BPF_TC_F_REPLACE;
+    err = bpf_tc_attach(&hook, &tc_opts);
+    if (err) {
+        fprintf(stderr, "Error: ifindex(%d) bpf_tc_attach failed (%d): %s\n",
+                cfg.ifindex, -err, strerror(-err));
+        if (err == -EEXIST)
+            fprintf(stderr, "Hint: tc filter already loaded on device"
+                            " use --force or -F to replace\n");
+        return -1;
+    }
+
+    printf("Success: tc prog loaded on device:%s(ifindex:%d)\n",
+           cfg.ifname, cfg.ifindex);
+    return cfg.consume && tx_consume(cfg.consume) ? 1 : 0;
+}
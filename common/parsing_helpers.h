@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PARSING_HELPERS_H
+#define __PARSING_HELPERS_H
+
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/bpf_endian.h>
+
+/* Header parsing for the XDP programs, include with -I../common.
+ *
+ * A cursor walks the packet: each parse_* function checks its header
+ * against data_end, moves the cursor past it and returns the next
+ * protocol, or -1 when the packet is too short or malformed. Loops over
+ * VLAN tags and IPv6 extension headers have fixed bounds, so the
+ * verifier sees every packet access checked. */
+
+#define VLAN_MAX_DEPTH 2 /* 802.1Q, or an 802.1ad (QinQ) outer tag on top */
+#define IPV6_EXT_MAX   6 /* extension headers walked before giving up */
+
+struct hdr_cursor {
+    void *pos;
+};
+
+struct vlan_hdr {
+    __be16 h_vlan_TCI;
+    __be16 h_vlan_encapsulated_proto;
+};
+
+struct ipv6_frag_hdr {
+    __u8 nexthdr;
+    __u8 reserved;
+    __be16 frag_off; /* offset in 8 byte units << 3, low bit more fragments */
+    __be32 identification;
+};
+
+#define IPV6_FRAG_OFFSET 0xfff8
+
+/* iphdr frag_off bits, host byte order */
+#define IP_MF     0x2000
+#define IP_OFFSET 0x1fff
+
+static __always_inline int proto_is_vlan(__u16 h_proto)
+{
+    return h_proto == bpf_htons(ETH_P_8021Q) || h_proto == bpf_htons(ETH_P_8021AD);
+}
+
+/* Returns the EtherType (network byte order) after up to VLAN_MAX_DEPTH
+ * tags. Deeper stacks return the VLAN EtherType, callers don't parse
+ * those any further. */
+static __always_inline int parse_ethhdr(struct hdr_cursor *nh, void *data_end,
+                                        struct ethhdr **ethhdr)
+{
+    struct ethhdr *eth = nh->pos;
+    struct vlan_hdr *vlh;
+    __u16 h_proto;
+
+    if ((void *) (eth + 1) > data_end)
+        return -1;
+    *ethhdr = eth;
+    vlh = (void *) (eth + 1);
+    h_proto = eth->h_proto;
+
+#pragma unroll
+    for (int i = 0; i < VLAN_MAX_DEPTH; i++) {
+        if (!proto_is_vlan(h_proto))
+            break;
+        if ((void *) (vlh + 1) > data_end)
+            return -1;
+        h_proto = vlh->h_vlan_encapsulated_proto;
+        vlh++;
+    }
+    nh->pos = vlh;
+    return h_proto;
+}
+
+/* IPv4 with options, the cursor ends up after ihl * 4 bytes */
+static __always_inline int parse_iphdr(struct hdr_cursor *nh, void *data_end,
+                                       struct iphdr **iphdr)
+{
+    struct iphdr *iph = nh->pos;
+    int hdrsize;
+
+    if ((void *) (iph + 1) > data_end)
+        return -1;
+    hdrsize = iph->ihl * 4;
+    if (hdrsize < (int) sizeof(*iph) || nh->pos + hdrsize > data_end)
+        return -1;
+    nh->pos += hdrsize;
+    *iphdr = iph;
+    return iph->protocol;
+}
+
+/* Fixed IPv6 header only, returns its nexthdr. skip_ip6hdrext() gets to
+ * the upper layer header. */
+static __always_inline int parse_ip6hdr(struct hdr_cursor *nh, void *data_end,
+                                        struct ipv6hdr **ip6hdr)
+{
+    struct ipv6hdr *ip6h = nh->pos;
+
+    if ((void *) (ip6h + 1) > data_end)
+        return -1;
+    nh->pos = ip6h + 1;
+    *ip6hdr = ip6h;
+    return ip6h->nexthdr;
+}
+
+/* Walks the extension headers starting with nexthdr and returns the
+ * upper layer protocol, the cursor on its header. A fragment other than
+ * the first has no such header, the walk stops there and returns
+ * IPPROTO_FRAGMENT. -1 for a truncated chain or one longer than
+ * IPV6_EXT_MAX. */
+static __always_inline int skip_ip6hdrext(struct hdr_cursor *nh, void *data_end,
+                                          __u8 nexthdr)
+{
+#pragma unroll
+    for (int i = 0; i < IPV6_EXT_MAX; i++) {
+        struct ipv6_opt_hdr *hdr = nh->pos;
+        struct ipv6_frag_hdr *frag = nh->pos;
+
+        if ((void *) (hdr + 1) > data_end)
+            return -1;
+
+        switch (nexthdr) {
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_DSTOPTS:
+            case IPPROTO_ROUTING:
+            case IPPROTO_MH:
+                nh->pos = (char *) hdr + (hdr->hdrlen + 1) * 8;
+                nexthdr = hdr->nexthdr;
+                break;
+            case IPPROTO_AH:
+                nh->pos = (char *) hdr + (hdr->hdrlen + 2) * 4;
+                nexthdr = hdr->nexthdr;
+                break;
+            case IPPROTO_FRAGMENT:
+                if ((void *) (frag + 1) > data_end)
+                    return -1;
+                if (frag->frag_off & bpf_htons(IPV6_FRAG_OFFSET))
+                    return IPPROTO_FRAGMENT;
+                nh->pos = frag + 1;
+                nexthdr = frag->nexthdr;
+                break;
+            default:
+                return nexthdr;
+        }
+    }
+    return -1;
+}
+
+/* TCP with options, returns the header length */
+static __always_inline int parse_tcphdr(struct hdr_cursor *nh, void *data_end,
+                                        struct tcphdr **tcphdr)
+{
+    struct tcphdr *th = nh->pos;
+    int len;
+
+    if ((void *) (th + 1) > data_end)
+        return -1;
+    len = th->doff * 4;
+    if (len < (int) sizeof(*th) || nh->pos + len > data_end)
+        return -1;
+    nh->pos += len;
+    *tcphdr = th;
+    return len;
+}
+
+/* Returns the payload length the header claims */
+static __always_inline int parse_udphdr(struct hdr_cursor *nh, void *data_end,
+                                        struct udphdr **udphdr)
+{
+    struct udphdr *uh = nh->pos;
+    int len;
+
+    if ((void *) (uh + 1) > data_end)
+        return -1;
+    len = bpf_ntohs(uh->len) - (int) sizeof(*uh);
+    if (len < 0)
+        return -1;
+    nh->pos = uh + 1;
+    *udphdr = uh;
+    return len;
+}
+
+#endif /* __PARSING_HELPERS_H */